@@ -2,20 +2,43 @@
 #define AFLI_H
 
 #include "afli/afli_nodes.h"
+#include "afli/range_iterator.h"
 
 namespace nfl {
 
-template <typename KT, typename VT>
+// The operations are counted by the run statistics policy `SP`, see 
+// CountRunStat
+template <typename KT, typename VT, typename SP=NoRunStat>
 class AFLI {
 typedef std::pair<KT, VT> KVT;
-private:
+protected:
   TNode<KT, VT>* root_;
   HyperParameter hyper_para_;
+  MemoryPool* pool_;
+  IndexStats stats_;      // Kept up to date by the nodes
+
+  static constexpr uint32_t kLookupGroupSize = 16;  // Number of interleaved 
+                                                    // lookups in find_batch
+  static constexpr uint32_t kSnapshotMagic = 0x494c4641;  // "AFLI"
+  static constexpr uint32_t kSnapshotVersion = 2;
+  // Tells apart the key types of the same size in a snapshot
+  static constexpr uint32_t kKeyKind = std::numeric_limits<KT>::is_integer << 1
+                                      | std::numeric_limits<KT>::is_signed;
 public:
-  AFLI() : root_(nullptr) { }
+  // With `use_pool`, all the nodes are allocated from a memory pool that is 
+  // released at once with the index. Otherwise, they are allocated from the 
+  // heap. `huge_pages` backs the pool with transparent huge pages.
+  explicit AFLI(bool use_pool=true, bool huge_pages=false) : root_(nullptr) {
+    pool_ = use_pool ? new MemoryPool(huge_pages) : nullptr;
+    hyper_para_.pool_ = pool_;
+    hyper_para_.stats_ = &stats_;
+  }
 
   ~AFLI() {
-    if (root_ != nullptr) {
+    if (pool_ != nullptr) {
+      // Release all the nodes at once without walking the tree
+      delete pool_;
+    } else if (root_ != nullptr) {
       delete root_;
     }
   }
@@ -23,57 +46,306 @@ public:
   void bulk_load(const KVT* kvs, uint32_t size, int32_t bucket_size=-1, 
                 uint32_t aggregate_size=0) {
     assert_p(root_ == nullptr, "The index must be empty before bulk loading");
-    root_ = new TNode<KT, VT>();
-    if (bucket_size == -1) {
-      hyper_para_.max_bucket_size_ = compute_bucket_size(kvs, size);
-    } else {
-      hyper_para_.max_bucket_size_ = std::min(std::max(
-                                      static_cast<uint32_t>(bucket_size), 
-                                      hyper_para_.kMinBucketSize), 
-                                      hyper_para_.kMaxBucketSize);
+    root_ = pool_new<TNode<KT, VT>>(pool_);
+    // The nodes built by the tasks count themselves at the same time
+    bool shared = stats_.shared_;
+    stats_.shared_ = true;
+    // One thread walks the tree, and the team runs the tasks that it spawns 
+    // for the chunks of large nodes and for the child subtrees
+#pragma omp parallel
+#pragma omp single
+    {
+      if (bucket_size == -1) {
+        hyper_para_.max_bucket_size_ = compute_bucket_size(kvs, size);
+      } else {
+        hyper_para_.max_bucket_size_ = std::min(std::max(
+                                        static_cast<uint32_t>(bucket_size), 
+                                        hyper_para_.kMinBucketSize), 
+                                        hyper_para_.kMaxBucketSize);
+      }
+      hyper_para_.aggregate_size_ = aggregate_size;
+      root_->build(kvs, size, 1, hyper_para_);
     }
-    hyper_para_.aggregate_size_ = aggregate_size;
-    root_->build(kvs, size, 1, hyper_para_);
+    stats_.shared_ = shared;
+  }
+
+  // The policy of growing the nodes with insertions. Model nodes are never
+  // expanded by the concurrent index.
+  void set_growth_policy(const GrowthPolicy& growth) {
+    hyper_para_.growth_ = growth;
+  }
+
+  // Record the structural modifications of the index to `events`, or stop 
+  // recording them if it is null
+  void set_event_log(EventLog* events) {
+    hyper_para_.events_ = events;
   }
 
   ResultIterator<KT, VT> find(KT key) {
-    return root_->find(key);
+    SP::request(kQuery);
+    return root_->template find<SP>(key);
+  }
+
+  // Look up `n` keys and write the results to `out`. The lookups run as 
+  // interleaved state machines. Each one prefetches the memory that its next 
+  // step touches and yields to the others, so that the cache misses of a 
+  // group of lookups overlap instead of stalling one after another.
+  void find_batch(const KT* keys, size_t n, ResultIterator<KT, VT>* out) {
+    LookupState states[kLookupGroupSize];
+    size_t next = 0;
+    uint32_t num_active = 0;
+    for (; num_active < kLookupGroupSize && next < n; ++ num_active, ++ next) {
+      start_lookup(states[num_active], next);
+    }
+    while (num_active > 0) {
+      for (uint32_t s = 0; s < num_active; ) {
+        if (step_lookup(states[s], keys, out)) {
+          s ++;
+        } else if (next < n) {
+          start_lookup(states[s], next ++);
+          s ++;
+        } else {
+          states[s] = states[-- num_active];
+        }
+      }
+    }
+  }
+
+  // Iterator at the smallest key
+  RangeIterator<KT, VT> begin() {
+    return RangeIterator<KT, VT>(root_, nullptr);
+  }
+
+  // Iterator at the first key that is not less than `key`
+  RangeIterator<KT, VT> lower_bound(KT key) {
+    return RangeIterator<KT, VT>(root_, &key);
+  }
+
+  // Copy at most `limit` pairs with keys in [lo, hi] into `results` in key 
+  // order and return the number of copied pairs
+  uint32_t scan(KT lo, KT hi, uint32_t limit, KVT* results) {
+    uint32_t num = 0;
+    for (auto it = lower_bound(lo); num < limit && !it.is_end() 
+          && !(hi < it.key()); it.next()) {
+      results[num ++] = it.kv();
+    }
+    return num;
   }
 
   bool update(KVT kv) {
-    return root_->update(kv);
+    SP::request(kUpdate);
+    return root_->template update<SP>(kv);
   }
 
   uint32_t remove(KT key) {
-    return root_->remove(key);
+    SP::request(kDelete);
+    return root_->template remove<SP>(key, 1, hyper_para_);
   }
     
   void insert(KVT kv) {
-    root_->insert(kv, 1, hyper_para_);
+    SP::request(kInsert);
+    root_->template insert<SP>(kv, 1, hyper_para_);
   }
 
-  void print_stats() {
-    TreeStat ts;
+  // Insert `n` pairs at once. The pairs are sorted, and the pairs that go to
+  // the same node or slot are inserted with one traversal and at most one 
+  // rebuild.
+  void insert_batch(const KVT* kvs, size_t n) {
+    if (n == 0) {
+      return;
+    }
+    assert_p(n <= std::numeric_limits<uint32_t>::max(), 
+              "Too many pairs in a batch");
+    SP::request(kInsert, n);
+    auto key_less = [](const KVT& a, const KVT& b) {
+      return a.first < b.first;
+    };
+    if (std::is_sorted(kvs, kvs + n, key_less)) {
+      root_->template insert_batch<SP>(kvs, n, 1, hyper_para_);
+      return;
+    }
+    std::vector<KVT> sorted(kvs, kvs + n);
+    std::sort(sorted.begin(), sorted.end(), key_less);
+    root_->template insert_batch<SP>(sorted.data(), n, 1, hyper_para_);
+  }
+
+  // Rebuild with fresh models the sub-trees that have degraded with 
+  // insertions, up to `max_pairs` pairs in total, and return the number of 
+  // rebuilt pairs. The insertions rebuild the sub-trees of at most 
+  // `max_retrain_size_` pairs themselves, so this is left for the larger ones.
+  // It walks the whole tree.
+  uint64_t retrain(uint64_t max_pairs=std::numeric_limits<uint64_t>::max()) {
+    uint64_t budget = max_pairs;
+    root_->template retrain<SP>(1, budget, hyper_para_);
+    return max_pairs - budget;
+  }
+
+  // Write the index to a snapshot file. The snapshot stores the pairs and the
+  // models of the nodes, so that `load` restores the same tree without fitting
+  // the models again. It is only readable on machines of the same byte order.
+  void save(const std::string& path) {
+    BinaryWriter out(path);
+    save(out);
+  }
+
+  // Restore an empty index from a snapshot written by `save`
+  void load(const std::string& path) {
+    BinaryReader in(path);
+    load(in);
+  }
+
+  void save(BinaryWriter& out) {
+    assert_p(root_ != nullptr, "The index must be bulk loaded before saving");
+    out.write(kSnapshotMagic);
+    out.write(kSnapshotVersion);
+    out.write<uint32_t>(sizeof(KT));
+    out.write(kKeyKind);
+    out.write<uint32_t>(sizeof(VT));
+    out.write(hyper_para_.max_bucket_size_);
+    out.write(hyper_para_.aggregate_size_);
+    root_->save(out);
+    out.flush();
+  }
+
+  void load(BinaryReader& in) {
+    assert_p(root_ == nullptr, "The index must be empty before loading");
+    assert_p(in.read<uint32_t>() == kSnapshotMagic, "Not an AFLI snapshot");
+    assert_p(in.read<uint32_t>() == kSnapshotVersion, 
+              "Unsupported AFLI snapshot version");
+    assert_p(in.read<uint32_t>() == sizeof(KT) 
+              && in.read<uint32_t>() == kKeyKind
+              && in.read<uint32_t>() == sizeof(VT), 
+              "The key or value type of the snapshot does not match");
+    hyper_para_.max_bucket_size_ = in.read<uint32_t>();
+    hyper_para_.aggregate_size_ = in.read<uint32_t>();
+    root_ = pool_new<TNode<KT, VT>>(pool_);
+    root_->load(in, 1, hyper_para_);
+  }
+
+  // The counters of the index. They are read in O(1) and may be polled by 
+  // another thread while the index serves requests.
+  const IndexStats& index_stats() const {
+    return stats_;
+  }
+
+  TreeStat stats() const {
+    TreeStat ts = stats_.snapshot();
     ts.bucket_size_ = hyper_para_.max_bucket_size_;
-    collect_tree_statistics(root_, 1, ts);
-    ts.show();
+    ts.max_aggregate_ = hyper_para_.aggregate_size_;
+    return ts;
   }
 
-  uint64_t model_size() {
+  // Walk the whole tree to collect the statistics, including the conflicts
+  // that the counters do not keep
+  TreeStat collect_stats() {
     TreeStat ts;
     ts.bucket_size_ = hyper_para_.max_bucket_size_;
+    ts.max_aggregate_ = hyper_para_.aggregate_size_;
     collect_tree_statistics(root_, 1, ts);
-    return ts.model_size_;
+    return ts;
+  }
+
+  void print_stats() {
+    stats().show();
+  }
+
+  // The counters of `SP`, summed over the threads and the indexes that count
+  // with it
+  RunStat run_stats() const {
+    RunStat rs = SP::collect();
+    rs.num_data_ = stats().num_data();
+    rs.bucket_threshold_ = hyper_para_.max_bucket_size_;
+    return rs;
+  }
+
+  uint64_t model_size() {
+    return IndexStats::get(stats_.model_size_);
   }
 
   uint64_t index_size() {
-    TreeStat ts;
-    ts.bucket_size_ = hyper_para_.max_bucket_size_;
-    collect_tree_statistics(root_, 1, ts);
-    return ts.index_size_;
+    return IndexStats::get(stats_.index_size_);
   }
 
 private:
+  enum LookupStage {
+    kStageNode = 0,       // The node header has been prefetched
+    kStageSlot = 1,       // The type word and the entry have been prefetched
+    kStageBucket = 2      // The bucket keys have been prefetched
+  };
+
+  struct LookupState {
+    TNode<KT, VT>*  node_;
+    Bucket<KT, VT>* bucket_;
+    size_t          key_idx_;
+    uint32_t        slot_;
+    uint8_t         stage_;
+  };
+
+  void start_lookup(LookupState& st, size_t key_idx) {
+    st.node_ = root_;
+    st.key_idx_ = key_idx;
+    st.stage_ = kStageNode;
+    SP::request(kQuery);
+    __builtin_prefetch(root_);
+  }
+
+  // Advance the lookup by one step. Return false if the lookup is finished.
+  bool step_lookup(LookupState& st, const KT* keys, 
+                    ResultIterator<KT, VT>* out) {
+    KT key = keys[st.key_idx_];
+    TNode<KT, VT>* node = st.node_;
+    switch (st.stage_) {
+      case kStageNode: {
+        if (node->is_dense()) {
+          out[st.key_idx_] = node->template find<SP>(key);
+          return false;
+        }
+        SP::visit();
+        SP::predict();
+        // The model is inline in the node header
+        uint32_t idx = node->predict_slot(key);
+        __builtin_prefetch(&node->type_word(idx));
+        __builtin_prefetch(&node->entry(idx));
+        st.slot_ = idx;
+        st.stage_ = kStageSlot;
+        return true;
+      }
+      case kStageSlot: {
+        uint32_t idx = st.slot_;
+        uint8_t type = node->entry_type(idx);
+        if (type == kData) {
+          SP::reach(kQuery, IndexStats::kModelSlot);
+          SP::compare(1);
+          out[st.key_idx_] = compare(node->entry(idx).kv_.first, key) 
+                              ? ResultIterator<KT, VT>(&node->entry(idx).kv_)
+                              : ResultIterator<KT, VT>();
+          return false;
+        } else if (type == kBucket) {
+          SP::reach(kQuery, IndexStats::kBucketSlot);
+          st.bucket_ = node->entry(idx).bucket_;
+          // The keys are inline in the bucket and span at most two lines
+          __builtin_prefetch(st.bucket_->keys_);
+          __builtin_prefetch(st.bucket_->keys_ + kMaxBucketSize - 1);
+          st.stage_ = kStageBucket;
+          return true;
+        } else if (type == kNode) {
+          st.node_ = node->entry(idx).child_;
+          __builtin_prefetch(st.node_);
+          st.stage_ = kStageNode;
+          return true;
+        } else {
+          SP::reach(kQuery, IndexStats::kModelSlot);
+          out[st.key_idx_] = {};
+          return false;
+        }
+      }
+      default: {
+        out[st.key_idx_] = st.bucket_->template find<SP>(key);
+        return false;
+      }
+    }
+  }
+
   uint8_t compute_bucket_size(const KVT* kvs, uint32_t size) {
     uint32_t tail_conflicts = compute_tail_conflicts<KT, VT>(kvs, size, 
                                                 hyper_para_.kSizeAmplification, 
@@ -85,13 +357,12 @@ private:
 
   uint32_t collect_tree_statistics(TNode<KT, VT>* node, 
                                     uint32_t depth, TreeStat& ts) {
-    if (node->model_ != nullptr) {
+    if (!node->is_dense()) {
       // Model node
       ts.num_model_nodes_ ++;
-      ts.model_size_ += sizeof(TNode<KT, VT>) + sizeof(LinearModel<KT>);
-      ts.index_size_ += sizeof(TNode<KT, VT>) + sizeof(LinearModel<KT>) 
-                      + sizeof(BIT_TYPE) * 2 * BIT_LEN(node->capacity_) 
-                      + sizeof(Entry<KT, VT>) * node->capacity_;
+      ts.model_size_ += sizeof(TNode<KT, VT>);
+      ts.index_size_ += sizeof(TNode<KT, VT>) 
+                      + TNode<KT, VT>::slot_bytes(node->capacity_);
       bool is_leaf_node = true;
       uint32_t tot_kvs = 0;
       uint32_t tot_conflicts = 0;
@@ -110,27 +381,27 @@ private:
         } else if (type == kBucket) {
           // Bucket pointer
           ts.num_buckets_ ++;
-          ts.num_data_bucket_ += node->entries_[i].bucket_->size_;
-          ts.model_size_ += sizeof(Bucket<KT, VT>);
-          ts.index_size_ += sizeof(Bucket<KT, VT>) 
-                          + sizeof(KVT) * hyper_para_.max_bucket_size_;
-          ts.sum_depth_ += (depth + 1) * node->entries_[i].bucket_->size_;
-          tot_kvs += node->entries_[i].bucket_->size_;
-          tot_conflicts += node->entries_[i].bucket_->size_ - 1;
+          ts.num_data_bucket_ += node->entry(i).bucket_->size_;
+          ts.model_size_ += sizeof(Bucket<KT, VT>) 
+                          - (sizeof(KT) + sizeof(VT)) * kMaxBucketSize;
+          ts.index_size_ += sizeof(Bucket<KT, VT>);
+          ts.sum_depth_ += (depth + 1) * node->entry(i).bucket_->size_;
+          tot_kvs += node->entry(i).bucket_->size_;
+          tot_conflicts += node->entry(i).bucket_->size_ - 1;
           num_conflicts ++;
         } else if (type == kNode) {
           // Child node pointer
           uint32_t num_kvs_child = collect_tree_statistics(
-                                    node->entries_[i].child_, depth + 1, ts);
+                                    node->entry(i).child_, depth + 1, ts);
           tot_conflicts += num_kvs_child;
           num_conflicts ++;
           is_leaf_node = false;
           // Find the duplicated child node pointers
           uint32_t j = i + 1;
-          for (; j < node->size_; ++ j, num_conflicts ++) {
+          for (; j < node->capacity_; ++ j, num_conflicts ++) {
             uint8_t type_j = node->entry_type(j);
             if (type_j != kNode 
-                || node->entries_[j].child_ != node->entries_[i].child_) {
+                || node->entry(j).child_ != node->entry(i).child_) {
               break;
             }
           }
@@ -147,22 +418,19 @@ private:
     } else {
       // Dense node
       ts.num_dense_nodes_ ++;
-      ts.num_data_dense_ ++;
+      ts.num_data_dense_ += node->size_;
       uint32_t tot_conflicts = 0;
       for (uint32_t i = 1; i < node->size_; ++ i) {
-        if (!compare(node->entries_[i].kv_.first, 
-                      node->entries_[i - 1].kv_.first)) {
-          ts.num_data_dense_ ++;
+        if (!compare(node->keys_[i], node->keys_[i - 1])) {
           tot_conflicts ++;
         }
       }
-      ts.sum_depth_ += depth * tot_conflicts;
+      ts.sum_depth_ += depth * node->size_;
       ts.node_conflicts_ += tot_conflicts;
       ts.model_size_ += sizeof(TNode<KT, VT>);
       ts.index_size_ += sizeof(TNode<KT, VT>) 
-                      + sizeof(Entry<KT, VT>) * node->capacity_;
+                      + (sizeof(KT) + sizeof(VT)) * node->capacity_;
       ts.num_leaf_nodes_ ++;
-      ts.sum_depth_ += depth;
       ts.max_depth_ = std::max(ts.max_depth_, depth);
       return tot_conflicts;
     }
@@ -1,35 +1,82 @@
 #ifndef AFLI_NODES_H
 #define AFLI_NODES_H
 
+#include <cstddef>
+
 #include "afli/buckets.h"
 #include "afli/conflicts.h"
 #include "models/linear_model.h"
+#include "util/binary_io.h"
 #include "util/common.h"
-
-#define BIT_TYPE uint8_t
-#define BIT_SIZE (sizeof(BIT_TYPE) * 8)
-#define BIT_LEN(x) (std::ceil((x) * 1. / BIT_SIZE))
-#define BIT_IDX(x) ((x) / BIT_SIZE)
-#define BIT_POS(x) ((x) % BIT_SIZE)
-#define SET_BIT_ONE(x, n) ((x) |= (1 << (n)))
-#define SET_BIT_ZERO(x, n) ((x) &= (~(1 << (n))))
-#define REV_BIT(x, n) ((x) ^= (1 << (n)))
-#define GET_BIT(x, n) (((x) >> (n)) & 1)
+#include "util/event_log.h"
+#include "util/key_search.h"
+#include "util/memory_pool.h"
+#include "util/version_lock.h"
 
 namespace nfl {
 
 template<typename KT, typename VT>
 class TNode;
 
+// How the nodes grow with insertions and contract with removals. Instead of 
+// rebuilding a node whenever it runs out of room, the room is grown 
+// geometrically, so the cost of growing is amortized over the insertions that
+// fill it. Likewise, a node is shrunk only after a fraction of its pairs has
+// been removed.
+struct GrowthPolicy {
+  double expand_ratio_ = 0.5;     // A model node doubles its slots once the 
+                                  // pairs inserted into its slots reach this
+                                  // ratio of its capacity. 0 disables it.
+  uint32_t max_expand_capacity_ = 1 << 10;  // Larger nodes are not expanded, so
+                                            // that one expansion costs no more
+                                            // than a bucket split at P99.99
+  double dense_growth_ = 2;       // A full dense node is rebuilt with this 
+                                  // factor of its size as capacity
+  // How the nodes contract with removals
+  bool contract_ = true;          // Collapse the buckets of at most one pair 
+                                  // into their slots, and merge the child 
+                                  // nodes that fit in a bucket into the slots
+                                  // of the parent
+  double shrink_ratio_ = 0.125;   // A node whose sub-tree holds fewer pairs
+                                  // than this ratio of its capacity is 
+                                  // rebuilt. 0 disables it.
+  // How the models are fitted again as insertions drift away from them
+  double retrain_ratio_ = 4;      // A model node whose sub-tree holds more 
+                                  // pairs than this ratio of its capacity, and
+                                  // twice the pairs its model was fitted to, 
+                                  // is rebuilt with a fresh model. 0 disables 
+                                  // it.
+  double retrain_depth_ = 3;      // AFLI::retrain also rebuilds a sub-tree
+                                  // that has doubled since its model was
+                                  // fitted and whose pairs lie more levels 
+                                  // below its root than this on average
+  uint32_t max_retrain_size_ = 1 << 16;   // Larger sub-trees are not rebuilt
+                                          // by insertions but only by 
+                                          // AFLI::retrain
+
+  // The free slots of a dense node rebuilt from `size` pairs
+  inline uint32_t dense_slack(uint32_t size) const {
+    return static_cast<uint32_t>(size * std::max(dense_growth_ - 1, 0.));
+  }
+};
+
 struct HyperParameter {
   // Parameters
   uint32_t max_bucket_size_ = 6;
   uint32_t aggregate_size_ = 0;
+  GrowthPolicy growth_;
+  MemoryPool* pool_ = nullptr;    // Allocate nodes, buckets and arrays from 
+                                  // the heap if it is null
+  IndexStats* stats_ = nullptr;   // The counters of the index, not kept if 
+                                  // it is null
+  EventLog* events_ = nullptr;    // The structural modifications, not 
+                                  // recorded if it is null
   // Constant parameters
-  const uint32_t kMaxBucketSize = 6;
+  const uint32_t kMaxBucketSize = nfl::kMaxBucketSize;
   const uint32_t kMinBucketSize = 1;
   const double kSizeAmplification = 2;
   const double kTailPercent = 0.99;
+  const uint32_t kParallelBuildSize = 1 << 14;  // The pairs built by a task
 };
 
 enum EntryType {
@@ -48,29 +95,49 @@ union Entry {
   Entry() { }
 };
 
+// The slots of a model node are stored in blocks of 32 entries, each led by a 
+// word that packs the 2-bit types of its entries. The type of a slot is then 
+// decoded from one word next to the entry instead of two separate bitmaps.
+const uint32_t kSlotsPerBlock = 32;
+
+template<typename KT, typename VT>
+struct SlotBlock {
+  uint64_t        types_;
+  Entry<KT, VT>   entries_[kSlotsPerBlock];
+};
+
 template<typename KT, typename VT>
 class TNode {
 typedef std::pair<KT, VT> KVT;
 public:
-  LinearModel<KT>*    model_;
+  LinearModel<KT>     model_;
   uint32_t            size_;
   uint32_t            capacity_;
   uint32_t            size_sub_tree_;
-  uint8_t*            bitmap0_;     // The i-th bit indicates whether the i-th 
-                                    // position has a bucket or a child node.
-  uint8_t*            bitmap1_;     // The i-th bit indicates whether the i-th 
-                                    // position is a bucket.
-  Entry<KT, VT>*      entries_;     // The pointer array that stores the pointer 
-                                    // of buckets or child nodes.
+  uint32_t            num_inserts_;  // The pairs inserted into the slots of a
+                                     // model node since it was last resized
+  uint32_t            fitted_size_;  // The pairs of the sub-tree when the 
+                                     // model was fitted
+  SlotBlock<KT, VT>*  blocks_;      // The slots of a model node with their 
+                                    // types in one allocation. It is null for
+                                    // a dense node. The node stays apart from
+                                    // it, so that expand replaces the slots
+                                    // without moving the node, whose address
+                                    // the slots of its parents and the
+                                    // readers of lock_ hold.
+  KT*                 keys_;        // The sorted keys of a dense node.
+  VT*                 values_;      // The values of a dense node.
+  VersionLock         lock_;        // The optimistic lock used by the 
+                                    // concurrent index.
 
 public:
   // Constructor and deconstructor
-  explicit TNode() : model_(nullptr), size_(0), capacity_(0), 
-                      size_sub_tree_(0), bitmap0_(nullptr), 
-                      bitmap1_(nullptr), entries_(nullptr) { }
+  explicit TNode() : size_(0), capacity_(0), size_sub_tree_(0), 
+                      num_inserts_(0), fitted_size_(0), blocks_(nullptr), 
+                      keys_(nullptr), values_(nullptr) { }
 
   ~TNode() {
-    destory_self();
+    destory_self(0, HyperParameter());
   }
 
   // Get functions
@@ -80,77 +147,125 @@ public:
 
   inline uint32_t size_sub_tree() const { return size_sub_tree_; }
 
-  uint8_t entry_type(uint32_t idx) {
-    uint32_t bit_idx = BIT_IDX(idx);
-    uint32_t bit_pos = BIT_POS(idx);
-    uint8_t bit0 = GET_BIT(bitmap0_[bit_idx], bit_pos);
-    uint8_t bit1 = GET_BIT(bitmap1_[bit_idx], bit_pos);
-    return ((bit1 << 1) | bit0);
+  // Add `delta` to the pairs of the sub-tree and return the sum. The
+  // concurrent index adds to the counts of the ancestors of a changed node
+  // without their locks, so every change of the count is atomic, also by the
+  // holder of the lock.
+  inline uint32_t add_size_sub_tree(int32_t delta) {
+    return __atomic_add_fetch(&size_sub_tree_, delta, __ATOMIC_RELAXED);
   }
 
-private:
-  void set_entry_type(uint32_t idx, uint8_t type) {
-    uint32_t bit_idx = BIT_IDX(idx);
-    uint32_t bit_pos = BIT_POS(idx);
-    if (GET_BIT(bitmap0_[bit_idx], bit_pos) ^ GET_BIT(type, 0)) {
-      REV_BIT(bitmap0_[bit_idx], bit_pos);
-    }
-    if (GET_BIT(bitmap1_[bit_idx], bit_pos) ^ GET_BIT(type, 1)) {
-      REV_BIT(bitmap1_[bit_idx], bit_pos);
-    }
+  inline bool is_dense() const { return blocks_ == nullptr; }
+
+  // Whether the sub-tree of a model node has outgrown its model: it has 
+  // doubled since the model was fitted and most of its pairs are below the 
+  // slots
+  inline bool degraded(const GrowthPolicy& growth) const {
+    return !is_dense() && growth.retrain_ratio_ > 0 
+          && size_sub_tree_ >= 2 * static_cast<uint64_t>(fitted_size_)
+          && size_sub_tree_ > capacity_ * growth.retrain_ratio_;
   }
 
-public:
-  // User API interfaces
+  // The slot predicted by the model
+  inline uint32_t predict_slot(KT key) const {
+    return std::min(std::max(model_.predict(key), 0L), 
+                    static_cast<int64_t>(capacity_ - 1));
+  }
+
+  inline Entry<KT, VT>& entry(uint32_t idx) {
+    return blocks_[idx / kSlotsPerBlock].entries_[idx % kSlotsPerBlock];
+  }
+
+  inline uint64_t& type_word(uint32_t idx) {
+    return blocks_[idx / kSlotsPerBlock].types_;
+  }
+
+  inline uint8_t entry_type(uint32_t idx) {
+    return (type_word(idx) >> (idx % kSlotsPerBlock * 2)) & 3;
+  }
+
+  inline void set_entry_type(uint32_t idx, uint8_t type) {
+    uint32_t shift = idx % kSlotsPerBlock * 2;
+    uint64_t& word = type_word(idx);
+    word = (word & ~(3ULL << shift)) | (static_cast<uint64_t>(type) << shift);
+  }
+
+  // The bytes of the slots of a node with `capacity` slots. The last block is 
+  // cut after its last slot.
+  static size_t slot_bytes(uint32_t capacity) {
+    typedef SlotBlock<KT, VT> Block;
+    uint32_t rem = capacity % kSlotsPerBlock;
+    return sizeof(Block) * (capacity / kSlotsPerBlock) 
+          + (rem == 0 ? 0 : offsetof(Block, entries_) 
+                            + sizeof(Entry<KT, VT>) * rem);
+  }
+
+  // The comparisons of a lower bound search over `size` keys and of the 
+  // check of the key that it finds
+  static uint32_t search_comparisons(uint32_t size) {
+    return size > 1 ? 34 - __builtin_clz(size - 1) : 2 * size;
+  }
+
+  // User API interfaces. The operations report to the run statistics 
+  // policy `SP`.
+  template<typename SP=NoRunStat>
   ResultIterator<KT, VT> find(KT key) {
-    if (model_ != nullptr) {
-      uint32_t idx = std::min(std::max(model_->predict(key), 0L), 
-                              static_cast<int64_t>(capacity_ - 1));
+    SP::visit();
+    if (!is_dense()) {
+      SP::predict();
+      uint32_t idx = predict_slot(key);
       uint8_t type = entry_type(idx);
-      if (type == kData && compare(entries_[idx].kv_.first, key)) {
-        return {&entries_[idx].kv_};
+      if (type == kNode) {
+        return entry(idx).child_->template find<SP>(key);
       } else if (type == kBucket) {
-        return entries_[idx].bucket_->find(key);
-      } else if (type == kNode) {
-        return entries_[idx].child_->find(key);
+        SP::reach(kQuery, IndexStats::kBucketSlot);
+        return entry(idx).bucket_->template find<SP>(key);
+      }
+      SP::reach(kQuery, IndexStats::kModelSlot);
+      SP::compare(type == kData);
+      if (type == kData && compare(entry(idx).kv_.first, key)) {
+        return {&entry(idx).kv_};
       } else {
         return {};
       }
     } else {
-      uint32_t idx = std::lower_bound(entries_, entries_ + size_, key, 
-                      [](const Entry<KT, VT>& kk, const KT k) {
-                        return kk.kv_.first < k;
-                      }) - entries_;
-      if (idx < size_ && compare(entries_[idx].kv_.first, key)) {
-        return {&entries_[idx].kv_};
+      SP::reach(kQuery, IndexStats::kDenseSlot);
+      SP::compare(search_comparisons(size_));
+      uint32_t idx = branchless_lower_bound(keys_, size_, key);
+      if (idx < size_ && compare(keys_[idx], key)) {
+        return {&keys_[idx], &values_[idx]};
       } else {
         return {};
       }
     }
   }
 
+  template<typename SP=NoRunStat>
   bool update(KVT kv) {
-    if (model_ != nullptr) {
-      uint32_t idx = std::min(std::max(model_->predict(kv.first), 0L), 
-                              static_cast<int64_t>(size_ - 1));
+    if (!is_dense()) {
+      SP::predict();
+      uint32_t idx = predict_slot(kv.first);
       uint8_t type = entry_type(idx);
-      if (type == kData && compare(entries_[idx].kv_.first, kv.first)) {
-        entries_[idx].kv_ = kv;
-        return true;
+      if (type == kNode) {
+        return entry(idx).child_->template update<SP>(kv);
       } else if (type == kBucket) {
-        return entries_[idx].bucket_->update(kv);
-      } else if (type == kNode) {
-        return entries_[idx].child_->update(kv);
+        SP::reach(kUpdate, IndexStats::kBucketSlot);
+        return entry(idx).bucket_->template update<SP>(kv);
+      }
+      SP::reach(kUpdate, IndexStats::kModelSlot);
+      SP::compare(type == kData);
+      if (type == kData && compare(entry(idx).kv_.first, kv.first)) {
+        entry(idx).kv_ = kv;
+        return true;
       } else {
         return false;
       }
     } else {
-      uint32_t idx = std::lower_bound(entries_, entries_ + size_, kv.first, 
-                      [](const Entry<KT, VT>& kk, const KT k) {
-                        return kk.kv_.first < k;
-                      }) - entries_;
-      if (idx < size_ && compare(entries_[idx].kv_.first, kv.first)) {
-        entries_[idx].kv_ = kv;
+      SP::reach(kUpdate, IndexStats::kDenseSlot);
+      SP::compare(search_comparisons(size_));
+      uint32_t idx = branchless_lower_bound(keys_, size_, kv.first);
+      if (idx < size_ && compare(keys_[idx], kv.first)) {
+        values_[idx] = kv.second;
         return true;
       } else {
         return false;
@@ -158,76 +273,113 @@ public:
     }
   }
 
-  uint32_t remove(KT key) {
-    if (model_ != nullptr) {
-      uint32_t idx = std::min(std::max(model_->predict(key), 0L), 
-                              static_cast<int64_t>(size_ - 1));
+  template<typename SP=NoRunStat>
+  uint32_t remove(KT key, uint32_t depth, const HyperParameter& hyper_para) {
+    const GrowthPolicy& growth = hyper_para.growth_;
+    uint32_t res = 0;
+    if (!is_dense()) {
+      SP::predict();
+      uint32_t idx = predict_slot(key);
       uint8_t type = entry_type(idx);
-      if (type == kData && compare(entries_[idx].kv_.first, key)) {
+      SP::compare(type == kData);
+      if (type == kData && compare(entry(idx).kv_.first, key)) {
         set_entry_type(idx, kNone);
         size_ --;
-        size_sub_tree_ --;
-        return 1;
+        res = 1;
+        count_data(IndexStats::kModelSlot, depth, -1, hyper_para);
       } else if (type == kBucket) {
-        uint32_t res = entries_[idx].bucket_->remove(key);
-        size_sub_tree_ -= res;
-        return res;
+        Bucket<KT, VT>* bucket = entry(idx).bucket_;
+        res = bucket->template remove<SP>(key);
+        count_data(IndexStats::kBucketSlot, depth, 
+                    -static_cast<int64_t>(res), hyper_para);
+        if (res > 0 && growth.contract_ && bucket->size_ <= 1) {
+          // Collapse the bucket into the slot
+          KVT kv = bucket->size_ > 0 ? bucket->kv(0) : KVT();
+          set_entry_type(idx, kNone);
+          count_buckets(-1, hyper_para);
+          count_data(IndexStats::kBucketSlot, depth, -bucket->size_, 
+                      hyper_para);
+          set_pairs(idx, &kv, bucket->size_, depth, hyper_para);
+          delete_bucket(bucket, hyper_para);
+        }
       } else if (type == kNode) {
-        uint32_t res = entries_[idx].child_->remove(key);
-        size_sub_tree_ -= res;
-        return res;
-      } else {
-        return 0;
+        TNode<KT, VT>* child = entry(idx).child_;
+        res = child->template remove<SP>(key, depth + 1, hyper_para);
+        if (res > 0 && growth.contract_ 
+            && child->size_sub_tree_ <= hyper_para.max_bucket_size_) {
+          SP::rebuild(child->size_sub_tree_);
+          log_event(kChildMerge, depth, child->size_sub_tree_, hyper_para);
+          merge_child(idx, depth, hyper_para);
+        }
+      }
+      add_size_sub_tree(-static_cast<int32_t>(res));
+      if (res > 0 && growth.contract_ 
+          && size_sub_tree_ < capacity_ * growth.shrink_ratio_) {
+        SP::rebuild(size_sub_tree_);
+        log_event(kNodeShrink, depth, size_sub_tree_, hyper_para);
+        rebuild_sub_tree(depth, hyper_para);
       }
     } else {
-      uint32_t idx = std::lower_bound(entries_, entries_ + size_, key, 
-                      [](const Entry<KT, VT>& kk, const KT k) {
-                        return kk.kv_.first < k;
-                      }) - entries_;
-      if (idx < size_ && compare(entries_[idx].kv_.first, key)) {
-        if (size_ > 1) {
-          for (uint32_t i = idx; i < size_ - 1; ++ i) {
-            if (entries_[i].kv_.first != key) {
-              break;
-            }
-            entries_[i].kv_ = entries_[i + 1].kv_;
-          }
+      SP::compare(search_comparisons(size_));
+      uint32_t idx = branchless_lower_bound(keys_, size_, key);
+      if (idx < size_ && compare(keys_[idx], key)) {
+        for (uint32_t i = idx; i + 1 < size_; ++ i) {
+          keys_[i] = keys_[i + 1];
+          values_[i] = values_[i + 1];
         }
         size_ --;
-        size_sub_tree_ --;
-        return 1;
-      } else {
-        return 0;
+        add_size_sub_tree(-1);
+        res = 1;
+        count_data(IndexStats::kDenseSlot, depth, -1, hyper_para);
+        uint32_t shrunk_capacity = size_ + std::max(hyper_para.max_bucket_size_,
+                                                    growth.dense_slack(size_));
+        if (growth.contract_ && size_ < capacity_ * growth.shrink_ratio_ 
+            && shrunk_capacity < capacity_) {
+          SP::rebuild(size_);
+          log_event(kDenseRebuild, depth, size_, hyper_para);
+          resize_dense_node(shrunk_capacity, depth, hyper_para);
+        }
       }
     }
+    return res;
   }
 
+  template<typename SP=NoRunStat>
   void insert(KVT kv, uint32_t depth, const HyperParameter& hyper_para) {
+    retrain_if_degraded<SP>(depth, hyper_para);
     size_sub_tree_ ++;
-    if (model_ != nullptr) {
-      uint32_t idx = std::min(std::max(model_->predict(kv.first), 0L), 
-                              static_cast<int64_t>(capacity_ - 1));
+    if (!is_dense()) {
+      SP::predict();
+      uint32_t idx = predict_slot(kv.first);
       uint8_t type = entry_type(idx);
       if (type == kNone) {
+        SP::reach(kInsert, IndexStats::kModelSlot);
         set_entry_type(idx, kData);
-        entries_[idx].kv_ = kv;
+        entry(idx).kv_ = kv;
         size_ ++;
+        count_data(IndexStats::kModelSlot, depth, 1, hyper_para);
       } else if (type == kData || type == kBucket) {
+        SP::reach(kInsert, IndexStats::kBucketSlot);
         if (type == kData) {
           set_entry_type(idx, kBucket);
-          KVT stored_kv = entries_[idx].kv_;
-          entries_[idx].bucket_ = new Bucket<KT, VT>(&stored_kv, 1, 
-                                                  hyper_para.max_bucket_size_);
+          KVT stored_kv = entry(idx).kv_;
+          entry(idx).bucket_ = new_bucket(&stored_kv, 1, hyper_para);
           size_ --;
+          count_data(IndexStats::kModelSlot, depth, -1, hyper_para);
+          count_buckets(1, hyper_para);
+          count_data(IndexStats::kBucketSlot, depth, 1, hyper_para);
+          log_event(kBucketCreate, depth, 2, hyper_para);
         }
-        bool success = entries_[idx].bucket_->insert(kv, 
+        bool success = entry(idx).bucket_->template insert<SP>(kv, 
                                                   hyper_para.max_bucket_size_);
-        if (!success) {
+        if (success) {
+          count_data(IndexStats::kBucketSlot, depth, 1, hyper_para);
+        } else {
           // Copy data for rebuilding
-          uint32_t bucket_size = entries_[idx].bucket_->size_;
-          KVT* kvs = new KVT[bucket_size + 1];
+          uint32_t bucket_size = entry(idx).bucket_->size_;
+          KVT* kvs = pool_new_array<KVT>(hyper_para.pool_, bucket_size + 1);
           for (uint32_t i = 0; i < bucket_size; ++ i) {
-            kvs[i] = entries_[idx].bucket_->data_[i];
+            kvs[i] = entry(idx).bucket_->kv(i);
           }
           kvs[bucket_size] = kv;
           std::sort(kvs, kvs + bucket_size + 1, 
@@ -235,113 +387,232 @@ public:
               return a.first < b.first;
             });
           // Clear entry
-          delete entries_[idx].bucket_;
+          count_buckets(-1, hyper_para);
+          count_data(IndexStats::kBucketSlot, depth, 
+                      -static_cast<int64_t>(bucket_size), hyper_para);
+          delete_bucket(entry(idx).bucket_, hyper_para);
           // Create child node
+          SP::rebuild(bucket_size + 1);
+          log_event(kBucketSplit, depth, bucket_size + 1, hyper_para);
           set_entry_type(idx, kNode);
-          entries_[idx].child_ = new TNode<KT, VT>();
-          entries_[idx].child_->build(kvs, bucket_size + 1, depth + 1, 
+          entry(idx).child_ = pool_new<TNode<KT, VT>>(hyper_para.pool_);
+          entry(idx).child_->build(kvs, bucket_size + 1, depth + 1, 
                                       hyper_para);
-          delete[] kvs;
+          pool_delete_array(hyper_para.pool_, kvs, bucket_size + 1);
         }
       } else {
-        entries_[idx].child_->insert(kv, depth + 1, hyper_para);
+        entry(idx).child_->template insert<SP>(kv, depth + 1, hyper_para);
+        return;
+      }
+      num_inserts_ ++;
+      const GrowthPolicy& growth = hyper_para.growth_;
+      if (growth.expand_ratio_ > 0 && capacity_ < growth.max_expand_capacity_
+          && num_inserts_ >= capacity_ * growth.expand_ratio_) {
+        SP::rebuild(size_);
+        log_event(kNodeExpand, depth, size_, hyper_para);
+        expand(depth, hyper_para);
       }
     } else {
+      SP::reach(kInsert, IndexStats::kDenseSlot);
+      SP::compare(search_comparisons(size_));
       if (size_ < capacity_) {
-        uint32_t idx = std::lower_bound(entries_, entries_ + size_, kv.first, 
-                    [](const Entry<KT, VT>& kk, KT k) {
-                      return kk.kv_.first < k;
-                    }) - entries_;
-        for (int32_t i = size_; i > idx; -- i) {
-          entries_[i].kv_ = entries_[i - 1].kv_;
+        uint32_t idx = branchless_lower_bound(keys_, size_, kv.first);
+        for (uint32_t i = size_; i > idx; -- i) {
+          keys_[i] = keys_[i - 1];
+          values_[i] = values_[i - 1];
         }
-        entries_[idx].kv_ = kv;
+        keys_[idx] = kv.first;
+        values_[idx] = kv.second;
         size_ ++;
+        count_data(IndexStats::kDenseSlot, depth, 1, hyper_para);
       } else {
-        // Copy data for rebuilding
+        // Copy data for rebuilding. The keys are sorted, so the pair is 
+        // copied into its position.
         uint32_t node_size = size_;
-        KVT* kvs = new KVT[node_size + 1];
-        for (uint32_t i = 0; i < size_; ++ i) {
-          kvs[i] = entries_[i].kv_;
+        uint32_t idx = branchless_lower_bound(keys_, size_, kv.first);
+        KVT* kvs = pool_new_array<KVT>(hyper_para.pool_, node_size + 1);
+        for (uint32_t i = 0; i < node_size; ++ i) {
+          kvs[i + (i >= idx)] = {keys_[i], values_[i]};
         }
-        kvs[node_size] = kv;
-        std::sort(kvs, kvs + node_size + 1, 
-          [](auto const& a, auto const& b) {
-            return a.first < b.first;
-          });
+        kvs[idx] = kv;
         // Clear entry
-        destory_self();
-        // Create child node
-        build(kvs, node_size + 1, depth, hyper_para);
-        delete[] kvs;
+        SP::rebuild(node_size + 1);
+        log_event(kDenseRebuild, depth, node_size + 1, hyper_para);
+        destory_self(depth, hyper_para);
+        // Rebuild the node. If it is dense again, it gets room for a number 
+        // of insertions that grows with its size.
+        build(kvs, node_size + 1, depth, hyper_para, 
+              hyper_para.growth_.dense_slack(node_size));
+        pool_delete_array(hyper_para.pool_, kvs, node_size + 1);
       }
     }
   }
 
-  void destory_self() {    
-    if (model_ != nullptr) {
-      delete model_;
-      model_ = nullptr;
+  // Insert the `n` pairs of `kvs`, which are sorted by key. The pairs that
+  // are predicted to the same slot are inserted together: a run that goes to 
+  // a child node takes one traversal, and a run that overflows its slot is 
+  // merged with the pairs of the slot into one child node.
+  template<typename SP=NoRunStat>
+  void insert_batch(const KVT* kvs, uint32_t n, uint32_t depth, 
+                    const HyperParameter& hyper_para) {
+    retrain_if_degraded<SP>(depth, hyper_para);
+    size_sub_tree_ += n;
+    if (is_dense()) {
+      insert_dense_run<SP>(kvs, n, depth, hyper_para);
+      return;
+    }
+    // The model is monotone, so the runs of a slot are contiguous
+    uint32_t idx = predict_slot(kvs[0].first);
+    for (uint32_t i = 0, j = 0; i < n; i = j) {
+      uint32_t next = idx;
+      for (j = i + 1; j < n; ++ j) {
+        next = predict_slot(kvs[j].first);
+        if (next != idx) {
+          break;
+        }
+      }
+      SP::predict(j - i);
+      insert_slot_run<SP>(idx, kvs + i, j - i, depth, hyper_para);
+      idx = next;
+    }
+    const GrowthPolicy& growth = hyper_para.growth_;
+    if (growth.expand_ratio_ > 0 && capacity_ < growth.max_expand_capacity_
+        && num_inserts_ >= capacity_ * growth.expand_ratio_) {
+      SP::rebuild(size_);
+      log_event(kNodeExpand, depth, size_, hyper_para);
+      expand(depth, hyper_para);
+    }
+  }
+
+  // Rebuild the degraded sub-trees of the node at `depth` with fresh models,
+  // as long as they fit in the `budget` pairs, which is reduced by the 
+  // rebuilt pairs. The children are retrained first, and the node itself if
+  // it has outgrown its model, or if its pairs still lie deeper than 
+  // `retrain_depth_` levels on average. Return the sum of the levels of the 
+  // pairs below the slots of the node.
+  template<typename SP=NoRunStat>
+  uint64_t retrain(uint32_t depth, uint64_t& budget, 
+                    const HyperParameter& hyper_para) {
+    if (is_dense()) {
+      return 0;
+    }
+    const GrowthPolicy& growth = hyper_para.growth_;
+    uint64_t levels = 0;
+    if (!degraded(growth) || size_sub_tree_ > budget) {
+      for_each_slot(true, [&](uint32_t i) {
+        if (entry_type(i) == kBucket) {
+          levels += entry(i).bucket_->size_;
+        } else if (!(i > 0 && entry_type(i - 1) == kNode 
+                      && entry(i - 1).child_ == entry(i).child_)) {
+          TNode<KT, VT>* child = entry(i).child_;
+          levels += child->template retrain<SP>(depth + 1, budget, 
+                                                hyper_para) 
+                    + child->size_sub_tree_;
+        }
+      });
+      bool deep = growth.retrain_ratio_ > 0 
+                  && size_sub_tree_ >= 2 * static_cast<uint64_t>(fitted_size_)
+                  && levels > size_sub_tree_ * growth.retrain_depth_;
+      if (!deep || size_sub_tree_ > budget) {
+        return levels;
+      }
+    }
+    budget -= size_sub_tree_;
+    SP::rebuild(size_sub_tree_);
+    log_event(kSubtreeRetrain, depth, size_sub_tree_, hyper_para);
+    rebuild_sub_tree(depth, hyper_para);
+    // The fresh sub-tree is not degraded, so this only counts its levels
+    return retrain<SP>(depth, budget, hyper_para);
+  }
+
+  // Release the node at `depth` and its sub-tree with the pool in 
+  // `hyper_para`
+  void destory_self(uint32_t depth, const HyperParameter& hyper_para) {
+    MemoryPool* pool = hyper_para.pool_;
+    count_self(depth, -1, hyper_para);
+    if (!is_dense()) {
       for (uint32_t i = 0; i < capacity_; ++ i) {
         uint8_t type_i = entry_type(i);
         if (type_i == kBucket) {
-          delete entries_[i].bucket_;
+          delete_bucket(entry(i).bucket_, hyper_para);
         } else if (type_i == kNode) {
           uint32_t j = i;
           for (; j < capacity_; ++ j) {
             uint8_t type_j = entry_type(j);
-            if (type_j != kNode || entries_[j].child_ != entries_[i].child_) {
+            if (type_j != kNode || entry(j).child_ != entry(i).child_) {
               break;
             }
           }
-          delete entries_[i].child_;
+          entry(i).child_->destory_self(depth + 1, hyper_para);
+          pool_delete(pool, entry(i).child_);
           i = j - 1;
         }
       }
-      delete[] bitmap0_;
-      bitmap0_ = nullptr;
-      delete[] bitmap1_;
-      bitmap1_ = nullptr;
+      pool_delete_array(pool, reinterpret_cast<char*>(blocks_), 
+                        slot_bytes(capacity_));
+      blocks_ = nullptr;
     }
-    if (entries_ != nullptr) {
-      delete[] entries_;
-      entries_ = nullptr;
+    if (keys_ != nullptr) {
+      pool_delete_array(pool, keys_, capacity_);
+      keys_ = nullptr;
+      pool_delete_array(pool, values_, capacity_);
+      values_ = nullptr;
     }
     size_ = 0;
     capacity_ = 0;
     size_sub_tree_ = 0;
+    num_inserts_ = 0;
+    fitted_size_ = 0;
   }
 
   void build_dense_node(const KVT* kvs, uint32_t size, uint32_t depth, 
-                        uint32_t capacity) {
-    model_ = nullptr;
+                        uint32_t capacity, const HyperParameter& hyper_para) {
+    blocks_ = nullptr;
     size_ = size;
     capacity_ = capacity;
     size_sub_tree_ = size;
-    entries_ = new Entry<KT, VT>[capacity_];
+    fitted_size_ = size;
+    keys_ = pool_new_array<KT>(hyper_para.pool_, capacity_);
+    values_ = pool_new_array<VT>(hyper_para.pool_, capacity_);
     for (uint32_t i = 0; i < size; ++ i) {
-      entries_[i].kv_ = kvs[i];
+      keys_[i] = kvs[i].first;
+      values_[i] = kvs[i].second;
     }
+    count_self(depth, 1, hyper_para);
   }
 
+  // A dense node gets room for `dense_slack` insertions, and at least for
+  // the pairs of a bucket
   void build(const KVT* kvs, uint32_t size, uint32_t depth, 
-              const HyperParameter& hyper_para) {
-    ConflictsInfo* ci = build_linear_model(kvs, size, model_, 
+              const HyperParameter& hyper_para, uint32_t dense_slack=0) {
+    LinearModel<KT>* model = &model_;
+    ConflictsInfo* ci = build_linear_model(kvs, size, model, 
                                           hyper_para.kSizeAmplification);
     if (ci == nullptr) {
-      build_dense_node(kvs, size, depth, size + hyper_para.max_bucket_size_);
+      build_dense_node(kvs, size, depth, 
+                        size + std::max(hyper_para.max_bucket_size_, 
+                                        dense_slack), 
+                        hyper_para);
     } else {
       // Allocate memory for the node
-      uint32_t bit_len = BIT_LEN(ci->max_size_);
       capacity_ = ci->max_size_;
       size_ = 0;
       size_sub_tree_ = size;
-      bitmap0_ = new BIT_TYPE[bit_len];
-      bitmap1_ = new BIT_TYPE[bit_len];
-      entries_ = new Entry<KT, VT>[ci->max_size_];
-      memset(bitmap0_, 0, sizeof(BIT_TYPE) * bit_len);
-      memset(bitmap1_, 0, sizeof(BIT_TYPE) * bit_len);
-      // Recursively build the node
+      num_inserts_ = 0;
+      fitted_size_ = size;
+      blocks_ = allocate_blocks(capacity_, hyper_para);
+      // Recursively build the node. The children of a large node are built 
+      // in parallel once all the slots are set.
+      bool parallel = size >= hyper_para.kParallelBuildSize;
+      std::vector<PendingChild> pending;
+      auto build_child = [&](TNode<KT, VT>* child, const KVT* child_kvs, 
+                              uint32_t child_size) {
+        if (parallel) {
+          pending.push_back({child, child_kvs, child_size});
+        } else {
+          child->build(child_kvs, child_size, depth + 1, hyper_para);
+        }
+      };
       for (uint32_t i = 0, j = 0; i < ci->num_conflicts_; ++ i) {
         uint32_t p = ci->positions_[i];
         uint32_t c = ci->conflicts_[i];
@@ -349,13 +620,12 @@ public:
           continue;
         } else if (c == 1) {
           set_entry_type(p, kData);
-          entries_[p].kv_ = kvs[j];
+          entry(p).kv_ = kvs[j];
           size_ ++;
           j = j + c;
         } else if (c <= hyper_para.max_bucket_size_) {
           set_entry_type(p, kBucket);
-          entries_[p].bucket_ = new Bucket<KT, VT>(kvs + j, c, 
-                                                  hyper_para.max_bucket_size_);
+          entry(p).bucket_ = new_bucket(kvs + j, c, hyper_para);
           j = j + c;
         } else {
           uint32_t k = i + 1;
@@ -375,18 +645,19 @@ public:
               uint32_t p_k = ci->positions_[u];
               uint32_t c_k = ci->conflicts_[u];
               set_entry_type(p_k, kNode);
-              entries_[p_k].child_ = new TNode<KT, VT>();
-              entries_[p_k].child_->build(kvs + j, c_k, depth + 1, hyper_para);
+              entry(p_k).child_ = pool_new<TNode<KT, VT>>(
+                                        hyper_para.pool_);
+              build_child(entry(p_k).child_, kvs + j, c_k);
               j = j + c_k;
             }
           } else {
             set_entry_type(p, kNode);
-            entries_[p].child_ = new TNode<KT, VT>();
-            entries_[p].child_->build(kvs + j, seg_size, depth + 1, hyper_para);
+            entry(p).child_ = pool_new<TNode<KT, VT>>(hyper_para.pool_);
+            build_child(entry(p).child_, kvs + j, seg_size);
             for (uint32_t u = i; u < k; ++ u) {
               uint32_t p_k = ci->positions_[u];
               set_entry_type(p_k, kNode);
-              entries_[p_k].child_ = entries_[p].child_;
+              entry(p_k).child_ = entry(p).child_;
             }
             j = j + seg_size;
           }
@@ -394,9 +665,533 @@ public:
         }
       }
       delete ci;
+      count_self(depth, 1, hyper_para);
+      if (parallel) {
+        build_children(pending, depth + 1, hyper_para);
+      }
+    }
+  }
+
+  // Write the sub-tree in pre-order: the type words, the pairs of the data
+  // slots, and then the bucket or the child node of each slot that refers to
+  // one, in slot order. Empty slots take no space.
+  void save(BinaryWriter& out) {
+    out.write<uint8_t>(is_dense());
+    out.write(size_);
+    out.write(capacity_);
+    out.write(size_sub_tree_);
+    if (is_dense()) {
+      out.write_array(keys_, size_);
+      out.write_array(values_, size_);
+      return;
+    }
+    out.write(model_.slope_);
+    out.write(model_.intercept_);
+    out.write(model_.base_);
+    for (uint32_t b = 0; b * kSlotsPerBlock < capacity_; ++ b) {
+      out.write(blocks_[b].types_);
+    }
+    for_each_slot(false, [&](uint32_t i) {
+      out.write(entry(i).kv_);
+    });
+    for_each_slot(true, [&](uint32_t i) {
+      if (entry_type(i) == kBucket) {
+        Bucket<KT, VT>* bucket = entry(i).bucket_;
+        out.write(bucket->size_);
+        out.write_array(bucket->keys_, bucket->size_);
+        out.write_array(bucket->values_, bucket->size_);
+      } else {
+        // The child of an aggregated segment is written at its first slot
+        uint8_t shared = i > 0 && entry_type(i - 1) == kNode 
+                          && entry(i - 1).child_ == entry(i).child_;
+        out.write(shared);
+        if (!shared) {
+          entry(i).child_->save(out);
+        }
+      }
+    });
+  }
+
+  // Restore a sub-tree written by `save` into this empty node at `depth`
+  void load(BinaryReader& in, uint32_t depth, 
+            const HyperParameter& hyper_para) {
+    bool dense = in.read<uint8_t>();
+    size_ = in.read<uint32_t>();
+    capacity_ = in.read<uint32_t>();
+    size_sub_tree_ = in.read<uint32_t>();
+    fitted_size_ = size_sub_tree_;
+    assert_p(size_ <= capacity_, "The snapshot is corrupted");
+    if (dense) {
+      keys_ = pool_new_array<KT>(hyper_para.pool_, capacity_);
+      values_ = pool_new_array<VT>(hyper_para.pool_, capacity_);
+      in.read_array(keys_, size_);
+      in.read_array(values_, size_);
+      count_self(depth, 1, hyper_para);
+      return;
+    }
+    model_.slope_ = in.read<double>();
+    model_.intercept_ = in.read<double>();
+    model_.base_ = in.read<KT>();
+    blocks_ = reinterpret_cast<SlotBlock<KT, VT>*>(
+                pool_new_array<char>(hyper_para.pool_, slot_bytes(capacity_)));
+    for (uint32_t b = 0; b * kSlotsPerBlock < capacity_; ++ b) {
+      blocks_[b].types_ = in.read<uint64_t>();
+    }
+    for_each_slot(false, [&](uint32_t i) {
+      in.read_array(&entry(i).kv_, 1);
+    });
+    for_each_slot(true, [&](uint32_t i) {
+      if (entry_type(i) == kBucket) {
+        Bucket<KT, VT>* bucket = pool_new<Bucket<KT, VT>>(hyper_para.pool_);
+        bucket->size_ = in.read<uint8_t>();
+        assert_p(bucket->size_ <= kMaxBucketSize, "The snapshot is corrupted");
+        in.read_array(bucket->keys_, bucket->size_);
+        in.read_array(bucket->values_, bucket->size_);
+        entry(i).bucket_ = bucket;
+      } else if (in.read<uint8_t>()) {
+        entry(i).child_ = entry(i - 1).child_;
+      } else {
+        entry(i).child_ = pool_new<TNode<KT, VT>>(hyper_para.pool_);
+        entry(i).child_->load(in, depth + 1, hyper_para);
+      }
+    });
+    count_self(depth, 1, hyper_para);
+  }
+
+  // Add the node, the pairs in its slots and its buckets to the counters of
+  // `hyper_para`, or remove them if `sign` is -1. The children are not
+  // included, they count themselves.
+  void count_self(uint32_t depth, int64_t sign, 
+                  const HyperParameter& hyper_para) {
+    IndexStats* stats = hyper_para.stats_;
+    if (stats == nullptr) {
+      return;
+    }
+    int64_t node_bytes = sizeof(TNode<KT, VT>);
+    if (is_dense()) {
+      stats->add_nodes(IndexStats::kDenseNode, depth, sign, sign * node_bytes,
+                        sign * (node_bytes + static_cast<int64_t>(
+                                (sizeof(KT) + sizeof(VT)) * capacity_)));
+      stats->add_data(IndexStats::kDenseSlot, depth, sign * size_);
+      return;
+    }
+    stats->add_nodes(IndexStats::kModelNode, depth, sign, sign * node_bytes, 
+                      sign * (node_bytes + static_cast<int64_t>(
+                                            slot_bytes(capacity_))));
+    stats->add_data(IndexStats::kModelSlot, depth, sign * size_);
+    int64_t num_buckets = 0;
+    int64_t num_bucket_data = 0;
+    for_each_slot(true, [&](uint32_t i) {
+      if (entry_type(i) == kBucket) {
+        num_buckets ++;
+        num_bucket_data += entry(i).bucket_->size_;
+      }
+    });
+    count_buckets(sign * num_buckets, hyper_para);
+    count_data(IndexStats::kBucketSlot, depth, sign * num_bucket_data, 
+                hyper_para);
+  }
+
+  // Count `n` pairs added to (or removed from, if negative) the slots at 
+  // `location` of a node at `depth`
+  static inline void count_data(IndexStats::DataLocation location, 
+                                uint32_t depth, int64_t n, 
+                                const HyperParameter& hyper_para) {
+    if (hyper_para.stats_ != nullptr) {
+      // The pairs of a bucket are one level below its node
+      hyper_para.stats_->add_data(location, 
+                          depth + (location == IndexStats::kBucketSlot), n);
     }
   }
 
+  static inline void count_buckets(int64_t n, 
+                                    const HyperParameter& hyper_para) {
+    if (hyper_para.stats_ != nullptr) {
+      int64_t bytes = sizeof(Bucket<KT, VT>);
+      int64_t data_bytes = (sizeof(KT) + sizeof(VT)) * kMaxBucketSize;
+      hyper_para.stats_->add_nodes(IndexStats::kBucketNode, 0, n, 
+                                    n * (bytes - data_bytes), n * bytes);
+    }
+  }
+
+  // Record a modification of a node at `depth` that moves `num_keys` pairs
+  static inline void log_event(StructureEvent type, uint32_t depth, 
+                                uint32_t num_keys, 
+                                const HyperParameter& hyper_para) {
+    if (hyper_para.events_ != nullptr) {
+      hyper_para.events_->record(type, depth, num_keys);
+    }
+  }
+
+private:
+  // Allocate the slots of a model node with `capacity` slots. All the types
+  // start as kNone. The pool hands out zeroed memory without touching fresh 
+  // pages, while heap memory is cleared a word at a time.
+  static SlotBlock<KT, VT>* allocate_blocks(uint32_t capacity, 
+                                            const HyperParameter& hyper_para) {
+    SlotBlock<KT, VT>* blocks;
+    if (hyper_para.pool_ != nullptr) {
+      blocks = reinterpret_cast<SlotBlock<KT, VT>*>(
+                  hyper_para.pool_->allocate_array<char>(
+                    slot_bytes(capacity), true));
+    } else {
+      blocks = reinterpret_cast<SlotBlock<KT, VT>*>(
+                  new char[slot_bytes(capacity)]);
+      for (uint32_t b = 0; b * kSlotsPerBlock < capacity; ++ b) {
+        blocks[b].types_ = 0;
+      }
+    }
+    return blocks;
+  }
+
+  // Double the slots of a model node and scale its model by two. The scaled
+  // model predicts the keys of slot i to slot 2i or 2i+1, so the data and the
+  // buckets of a slot are split between the two slots, and a child node is
+  // shared by both. The children are not rebuilt, and the cost is linear in
+  // the capacity, which the insertions since the last resize pay for.
+  void expand(uint32_t depth, const HyperParameter& hyper_para) {
+    count_self(depth, -1, hyper_para);
+    uint32_t old_capacity = capacity_;
+    SlotBlock<KT, VT>* new_blocks = allocate_blocks(old_capacity * 2, 
+                                                    hyper_para);
+    auto set_slot = [new_blocks](uint32_t p, uint8_t type) -> Entry<KT, VT>& {
+      SlotBlock<KT, VT>& block = new_blocks[p / kSlotsPerBlock];
+      block.types_ |= static_cast<uint64_t>(type) << (p % kSlotsPerBlock * 2);
+      return block.entries_[p % kSlotsPerBlock];
+    };
+    // Place the `n` sorted pairs of a bucket that are predicted to slot `p`
+    auto set_pairs = [&](uint32_t p, const KVT* kvs, uint32_t n) {
+      if (n == 1) {
+        set_slot(p, kData).kv_ = kvs[0];
+        size_ ++;
+      } else if (n > 1) {
+        set_slot(p, kBucket).bucket_ = new_bucket(kvs, n, hyper_para);
+      }
+    };
+    // The old slots are read through `entry` until the blocks are replaced
+    capacity_ = old_capacity * 2;
+    model_.slope_ *= 2;
+    model_.intercept_ *= 2;
+    size_ = 0;
+    num_inserts_ = 0;
+    for (uint32_t i = 0; i < old_capacity; ++ i) {
+      uint8_t type = entry_type(i);
+      if (type == kData) {
+        KVT kv = entry(i).kv_;
+        uint32_t p = predict_slot(kv.first) == 2 * i ? 2 * i : 2 * i + 1;
+        set_slot(p, kData).kv_ = kv;
+        size_ ++;
+      } else if (type == kBucket) {
+        Bucket<KT, VT>* bucket = entry(i).bucket_;
+        KVT kvs[kMaxBucketSize];
+        uint32_t n = bucket->size_;
+        uint32_t split = 0;
+        for (uint32_t j = 0; j < n; ++ j) {
+          kvs[j] = bucket->kv(j);
+          split += predict_slot(kvs[j].first) == 2 * i;
+        }
+        delete_bucket(bucket, hyper_para);
+        set_pairs(2 * i, kvs, split);
+        set_pairs(2 * i + 1, kvs + split, n - split);
+      } else if (type == kNode) {
+        set_slot(2 * i, kNode).child_ = entry(i).child_;
+        set_slot(2 * i + 1, kNode).child_ = entry(i).child_;
+      }
+    }
+    pool_delete_array(hyper_para.pool_, reinterpret_cast<char*>(blocks_), 
+                      slot_bytes(old_capacity));
+    blocks_ = new_blocks;
+    count_self(depth, 1, hyper_para);
+  }
+
+  // Rebuild a degraded sub-tree that is small enough to be rebuilt by an 
+  // insertion. The insertions since its model was fitted pay for it.
+  template<typename SP>
+  inline void retrain_if_degraded(uint32_t depth, 
+                                  const HyperParameter& hyper_para) {
+    const GrowthPolicy& growth = hyper_para.growth_;
+    if (size_sub_tree_ <= growth.max_retrain_size_ && degraded(growth)) {
+      SP::rebuild(size_sub_tree_);
+      log_event(kSubtreeRetrain, depth, size_sub_tree_, hyper_para);
+      rebuild_sub_tree(depth, hyper_para);
+    }
+  }
+
+  // Place `n` pairs that are predicted to the empty slot `p`: one pair as a
+  // data slot, and more in a bucket
+  void set_pairs(uint32_t p, const KVT* kvs, uint32_t n, uint32_t depth, 
+                  const HyperParameter& hyper_para) {
+    if (n == 1) {
+      set_entry_type(p, kData);
+      entry(p).kv_ = kvs[0];
+      size_ ++;
+      count_data(IndexStats::kModelSlot, depth, 1, hyper_para);
+    } else if (n > 1) {
+      set_entry_type(p, kBucket);
+      entry(p).bucket_ = new_bucket(kvs, n, hyper_para);
+      count_buckets(1, hyper_para);
+      count_data(IndexStats::kBucketSlot, depth, n, hyper_para);
+    }
+  }
+
+  // Insert the `n` sorted pairs that are predicted to the slot `idx`
+  template<typename SP>
+  void insert_slot_run(uint32_t idx, const KVT* kvs, uint32_t n, 
+                        uint32_t depth, const HyperParameter& hyper_para) {
+    uint8_t type = entry_type(idx);
+    if (type == kNode) {
+      entry(idx).child_->template insert_batch<SP>(kvs, n, depth + 1, 
+                                                    hyper_para);
+      return;
+    }
+    num_inserts_ += n;
+    uint32_t max_bucket_size = hyper_para.max_bucket_size_;
+    if (type == kNone && n <= max_bucket_size) {
+      SP::reach(kInsert, n == 1 ? IndexStats::kModelSlot 
+                                : IndexStats::kBucketSlot, n);
+      set_pairs(idx, kvs, n, depth, hyper_para);
+      if (n > 1) {
+        log_event(kBucketCreate, depth, n, hyper_para);
+      }
+      return;
+    }
+    SP::reach(kInsert, IndexStats::kBucketSlot, n);
+    Bucket<KT, VT>* bucket = type == kBucket ? entry(idx).bucket_ : nullptr;
+    if (bucket != nullptr && bucket->size_ + n <= max_bucket_size) {
+      for (uint32_t i = 0; i < n; ++ i) {
+        bucket->template insert<SP>(kvs[i], max_bucket_size);
+      }
+      count_data(IndexStats::kBucketSlot, depth, n, hyper_para);
+      return;
+    }
+    // Merge the pairs of the slot with the run
+    uint32_t num_stored = type == kData ? 1 : bucket != nullptr ? bucket->size_
+                          : 0;
+    uint32_t size = num_stored + n;
+    // The pairs that fit in a bucket are merged on the stack
+    KVT buffer[kMaxBucketSize];
+    KVT* merged = size <= max_bucket_size ? buffer
+                  : pool_new_array<KVT>(hyper_para.pool_, size);
+    KVT stored[kMaxBucketSize];
+    if (type == kData) {
+      stored[0] = entry(idx).kv_;
+      size_ --;
+      count_data(IndexStats::kModelSlot, depth, -1, hyper_para);
+    } else if (bucket != nullptr) {
+      for (uint32_t i = 0; i < num_stored; ++ i) {
+        stored[i] = bucket->kv(i);
+      }
+      count_buckets(-1, hyper_para);
+      count_data(IndexStats::kBucketSlot, depth, 
+                  -static_cast<int64_t>(num_stored), hyper_para);
+      delete_bucket(bucket, hyper_para);
+    }
+    SP::compare(size);
+    std::merge(stored, stored + num_stored, kvs, kvs + n, merged,
+                [](const KVT& a, const KVT& b) {
+                  return a.first < b.first;
+                });
+    set_entry_type(idx, kNone);
+    if (size <= max_bucket_size) {
+      log_event(kBucketCreate, depth, size, hyper_para);
+      set_pairs(idx, merged, size, depth, hyper_para);
+    } else {
+      SP::rebuild(size);
+      log_event(kBucketSplit, depth, size, hyper_para);
+      set_entry_type(idx, kNode);
+      entry(idx).child_ = pool_new<TNode<KT, VT>>(hyper_para.pool_);
+      entry(idx).child_->build(merged, size, depth + 1, hyper_para);
+      pool_delete_array(hyper_para.pool_, merged, size);
+    }
+  }
+
+  // Merge `n` sorted pairs into a dense node, or rebuild the node if they do
+  // not fit
+  template<typename SP>
+  void insert_dense_run(const KVT* kvs, uint32_t n, uint32_t depth, 
+                        const HyperParameter& hyper_para) {
+    SP::reach(kInsert, IndexStats::kDenseSlot, n);
+    SP::compare(size_ + n);
+    uint32_t node_size = size_;
+    if (node_size + n <= capacity_) {
+      // Merge from the back, in place
+      int64_t i = static_cast<int64_t>(node_size) - 1;
+      for (int64_t j = n - 1, w = node_size + n - 1; j >= 0; -- w) {
+        if (i >= 0 && kvs[j].first < keys_[i]) {
+          keys_[w] = keys_[i];
+          values_[w] = values_[i];
+          i --;
+        } else {
+          keys_[w] = kvs[j].first;
+          values_[w] = kvs[j].second;
+          j --;
+        }
+      }
+      size_ += n;
+      count_data(IndexStats::kDenseSlot, depth, n, hyper_para);
+      return;
+    }
+    uint32_t size = node_size + n;
+    KVT* merged = pool_new_array<KVT>(hyper_para.pool_, size);
+    for (uint32_t i = 0, j = 0, w = 0; w < size; ++ w) {
+      if (j == n || (i < node_size && !(kvs[j].first < keys_[i]))) {
+        merged[w] = {keys_[i], values_[i]};
+        i ++;
+      } else {
+        merged[w] = kvs[j ++];
+      }
+    }
+    SP::rebuild(size);
+    log_event(kDenseRebuild, depth, size, hyper_para);
+    destory_self(depth, hyper_para);
+    build(merged, size, depth, hyper_para, 
+          hyper_para.growth_.dense_slack(node_size));
+    pool_delete_array(hyper_para.pool_, merged, size);
+  }
+
+  // Copy the pairs of the sub-tree to `kvs` in key order and return their
+  // number
+  uint32_t collect(KVT* kvs) {
+    if (is_dense()) {
+      for (uint32_t i = 0; i < size_; ++ i) {
+        kvs[i] = {keys_[i], values_[i]};
+      }
+      return size_;
+    }
+    uint32_t num = 0;
+    for (uint32_t i = 0; i < capacity_; ++ i) {
+      uint8_t type = entry_type(i);
+      if (type == kData) {
+        kvs[num ++] = entry(i).kv_;
+      } else if (type == kBucket) {
+        Bucket<KT, VT>* bucket = entry(i).bucket_;
+        for (uint32_t j = 0; j < bucket->size_; ++ j) {
+          kvs[num ++] = bucket->kv(j);
+        }
+      } else if (type == kNode && !(i > 0 && entry_type(i - 1) == kNode 
+                                    && entry(i - 1).child_ == entry(i).child_)) {
+        num += entry(i).child_->collect(kvs + num);
+      }
+    }
+    return num;
+  }
+
+  // Replace the child node at slot `idx`, whose pairs fit in a bucket, with 
+  // the pairs. A child shared by a range of slots is spread over the range.
+  void merge_child(uint32_t idx, uint32_t depth, 
+                    const HyperParameter& hyper_para) {
+    TNode<KT, VT>* child = entry(idx).child_;
+    uint32_t l = idx;
+    uint32_t r = idx;
+    while (l > 0 && entry_type(l - 1) == kNode && entry(l - 1).child_ == child) {
+      l --;
+    }
+    while (r + 1 < capacity_ && entry_type(r + 1) == kNode 
+            && entry(r + 1).child_ == child) {
+      r ++;
+    }
+    KVT kvs[kMaxBucketSize];
+    uint32_t n = child->collect(kvs);
+    child->destory_self(depth + 1, hyper_para);
+    pool_delete(hyper_para.pool_, child);
+    for (uint32_t i = l; i <= r; ++ i) {
+      set_entry_type(i, kNone);
+    }
+    // The pairs are sorted, so the pairs of a slot are consecutive
+    for (uint32_t i = 0, j = 0; i < n; i = j) {
+      uint32_t p = std::min(std::max(predict_slot(kvs[i].first), l), r);
+      while (j < n && std::min(std::max(predict_slot(kvs[j].first), l), r) 
+                      == p) {
+        j ++;
+      }
+      set_pairs(p, kvs + i, j - i, depth, hyper_para);
+    }
+  }
+
+  // Rebuild the node from the pairs of its sub-tree with a fresh model
+  void rebuild_sub_tree(uint32_t depth, const HyperParameter& hyper_para) {
+    uint32_t size = size_sub_tree_;
+    KVT* kvs = pool_new_array<KVT>(hyper_para.pool_, std::max(size, 1u));
+    collect(kvs);
+    destory_self(depth, hyper_para);
+    if (size == 0) {
+      build_dense_node(kvs, 0, depth, hyper_para.max_bucket_size_, hyper_para);
+    } else {
+      build(kvs, size, depth, hyper_para, 
+            hyper_para.growth_.dense_slack(size));
+    }
+    pool_delete_array(hyper_para.pool_, kvs, std::max(size, 1u));
+  }
+
+  // Move the pairs of a dense node at `depth` to arrays of `capacity`
+  void resize_dense_node(uint32_t capacity, uint32_t depth, 
+                          const HyperParameter& hyper_para) {
+    count_self(depth, -1, hyper_para);
+    KT* keys = pool_new_array<KT>(hyper_para.pool_, capacity);
+    VT* values = pool_new_array<VT>(hyper_para.pool_, capacity);
+    std::copy(keys_, keys_ + size_, keys);
+    std::copy(values_, values_ + size_, values);
+    pool_delete_array(hyper_para.pool_, keys_, capacity_);
+    pool_delete_array(hyper_para.pool_, values_, capacity_);
+    keys_ = keys;
+    values_ = values;
+    capacity_ = capacity;
+    count_self(depth, 1, hyper_para);
+  }
+
+  // Call `func(slot)` for the data slots, or with `pointers` for the slots 
+  // that refer to a bucket or a child node, in slot order
+  template<typename Func>
+  void for_each_slot(bool pointers, Func func) {
+    const uint64_t kLowBits = 0x5555555555555555ULL;
+    for (uint32_t b = 0; b * kSlotsPerBlock < capacity_; ++ b) {
+      uint64_t w = blocks_[b].types_;
+      // The high bit of a 2-bit type is set for kBucket and kNode
+      w = pointers ? (w >> 1) & kLowBits : w & ~(w >> 1) & kLowBits;
+      while (w != 0) {
+        func(b * kSlotsPerBlock + (__builtin_ctzll(w) >> 1));
+        w &= w - 1;
+      }
+    }
+  }
+
+  struct PendingChild {
+    TNode<KT, VT>*  node_;
+    const KVT*      kvs_;
+    uint32_t        size_;
+  };
+
+  // Build the children as OpenMP tasks, each covering consecutive children
+  // with at least kParallelBuildSize pairs in total. Outside a parallel region
+  // the tasks run one after another in the calling thread.
+  static void build_children(const std::vector<PendingChild>& children, 
+                              uint32_t depth, const HyperParameter& hyper_para) {
+    for (size_t b = 0; b < children.size(); ) {
+      size_t e = b;
+      uint64_t batch_size = 0;
+      while (e < children.size() 
+              && batch_size < hyper_para.kParallelBuildSize) {
+        batch_size += children[e ++].size_;
+      }
+#pragma omp task firstprivate(b, e) shared(children, hyper_para)
+      for (size_t i = b; i < e; ++ i) {
+        children[i].node_->build(children[i].kvs_, children[i].size_, depth,
+                                  hyper_para);
+      }
+      b = e;
+    }
+#pragma omp taskwait
+  }
+
+  static Bucket<KT, VT>* new_bucket(const KVT* kvs, uint32_t size, 
+                                    const HyperParameter& hyper_para) {
+    return pool_new<Bucket<KT, VT>>(hyper_para.pool_, kvs, size);
+  }
+
+  static void delete_bucket(Bucket<KT, VT>* bucket, 
+                            const HyperParameter& hyper_para) {
+    pool_delete(hyper_para.pool_, bucket);
+  }
 };
 
 }
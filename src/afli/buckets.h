@@ -3,66 +3,74 @@
 
 #include "afli/iterator.h"
 #include "util/common.h"
+#include "util/key_search.h"
 
 namespace nfl {
 
+// The largest number of pairs in a bucket
+const uint32_t kMaxBucketSize = 6;
+
+// Keys and values are stored in separate fixed arrays inside the bucket, so
+// that a lookup compares the keys with one unrolled kernel and touches only the
+// value it returns.
 template<typename KT, typename VT>
 class Bucket {
 typedef std::pair<KT, VT> KVT;
 public:
-  KVT* data_;
+  KT keys_[kMaxBucketSize];
+  VT values_[kMaxBucketSize];
   uint8_t size_;
 
 public:
-  Bucket() : data_(nullptr), size_(0) { }
+  Bucket() : keys_(), size_(0) { }
 
-  Bucket(const KVT* kvs, uint32_t size, const uint8_t capacity) 
-        : size_(size) {
-    data_ = new KVT[capacity];
+  Bucket(const KVT* kvs, uint32_t size) : keys_(), size_(size) {
     for (uint32_t i = 0; i < size; ++ i) {
-      data_[i] = kvs[i];
-    }
-  }
-
-  ~Bucket() {
-    if (data_ != nullptr) {
-      delete[] data_;
-      data_ = nullptr;
+      keys_[i] = kvs[i].first;
+      values_[i] = kvs[i].second;
     }
   }
 
   inline uint8_t size() const { return size_; }
 
+  inline KVT kv(uint32_t pos) const { return {keys_[pos], values_[pos]}; }
+
+  // The position of `key`, or kMaxBucketSize if it is not in the bucket
+  inline uint32_t position(KT key) const {
+    return FixedKeySearch<KT, kMaxBucketSize>::find(keys_, size_, key);
+  }
+
+  // The kernels compare `key` with all the keys of the bucket
+  template<typename SP=NoRunStat>
   ResultIterator<KT, VT> find(KT key) {
-    for (uint32_t i = 0; i < size_; ++ i) {
-      if (compare(data_[i].first, key)) {
-        return {&data_[i]};
-      }
+    SP::compare(size_);
+    uint32_t pos = position(key);
+    if (pos < kMaxBucketSize) {
+      return {&keys_[pos], &values_[pos]};
     }
     return {};
   }
 
+  template<typename SP=NoRunStat>
   bool update(KVT kv) {
-    for (uint8_t i = 0; i < size_; ++ i) {
-      if (compare(data_[i].first, kv.first)) {
-        data_[i] = kv;
-        return true;
-      }
+    SP::compare(size_);
+    uint32_t pos = position(kv.first);
+    if (pos < kMaxBucketSize) {
+      values_[pos] = kv.second;
+      return true;
     }
     return false;
   }
 
+  template<typename SP=NoRunStat>
   uint32_t remove(KT key) {
-    bool copy = false;
-    for (uint8_t i = 0; i < size_; ++ i) {
-      if (compare(data_[i].first, key)) {
-        copy = true;
+    SP::compare(size_);
+    uint32_t pos = position(key);
+    if (pos < kMaxBucketSize) {
+      for (uint32_t i = pos; i + 1 < size_; ++ i) {
+        keys_[i] = keys_[i + 1];
+        values_[i] = values_[i + 1];
       }
-      if (copy && i + 1 < size_) {
-        data_[i] = data_[i + 1];
-      }
-    }
-    if (copy) {
       size_ --;
       return 1;
     } else {
@@ -70,9 +78,18 @@ public:
     }
   }
 
+  template<typename SP=NoRunStat>
   bool insert(KVT kv, const uint8_t capacity) {
     if (size_ < capacity) {
-      data_[size_] = kv;
+      // Keep the pairs ordered for range scans
+      uint8_t i = size_;
+      for (; i > 0 && kv.first < keys_[i - 1]; -- i) {
+        keys_[i] = keys_[i - 1];
+        values_[i] = values_[i - 1];
+      }
+      SP::compare(size_ - i + (i > 0));
+      keys_[i] = kv.first;
+      values_[i] = kv.second;
       size_ ++;
       return true;
     } else {
@@ -83,4 +100,4 @@ public:
 
 }
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,396 @@
+#ifndef CONCURRENT_AFLI_H
+#define CONCURRENT_AFLI_H
+
+#include "afli/afli.h"
+#include "util/common.h"
+#include "util/epoch.h"
+#include "util/version_lock.h"
+
+namespace nfl {
+
+// AFLI that serves find, update, insert and remove from many threads at once.
+// Readers do not take locks. They record the version of every node on the
+// path and validate it after reading, and restart if the node has changed in
+// between. A writer locks the node it modifies, plus the parent if the node is
+// replaced. Nodes are never rebuilt in place: a full dense node is replaced by a
+// newly built node, and an overflowing bucket by a new child node. The
+// replaced nodes and buckets are reclaimed once no reader can reach them.
+// The restarted traversals are not counted by the run statistics policy `SP`.
+template<typename KT, typename VT, typename SP=NoRunStat>
+class ConcurrentAFLI : private AFLI<KT, VT, SP> {
+typedef std::pair<KT, VT> KVT;
+typedef AFLI<KT, VT, SP> Base;
+private:
+  static constexpr uint32_t kMaxPathLength = 64;
+
+  // The leaf position of a key found by a traversal
+  struct Position {
+    TNode<KT, VT>*  path_[kMaxPathLength];  // The model nodes on the path
+    uint32_t        depth_;
+    TNode<KT, VT>*  parent_;
+    uint64_t        parent_version_;        // The version of the root lock if
+                                            // the node is the root
+    uint32_t        parent_slot_;
+    TNode<KT, VT>*  node_;
+    uint64_t        version_;
+    uint32_t        slot_;                  // The slot in a model node or the
+                                            // lower bound in a dense node
+    uint8_t         type_;
+  };
+
+  VersionLock   root_lock_;   // Protects the root pointer.
+  EpochManager  epoch_;
+
+public:
+  // The replaced nodes and buckets are freed one by one by the epoch manager, 
+  // so the index is allocated from the heap rather than a memory pool.
+  ConcurrentAFLI() : Base(false) {
+    this->hyper_para_.growth_.contract_ = false;
+    this->stats_.shared_ = true;
+  }
+
+  using Base::bulk_load;
+  using Base::index_stats;
+  using Base::stats;
+  // The tree walk takes no locks, so it must not run with writers
+  using Base::collect_stats;
+  using Base::print_stats;
+  using Base::run_stats;
+  using Base::set_event_log;
+  using Base::model_size;
+  using Base::index_size;
+
+  // Readers may still be reading a bucket or a node that a contraction would
+  // free, so the nodes are never contracted
+  void set_growth_policy(const GrowthPolicy& growth) {
+    Base::set_growth_policy(growth);
+    this->hyper_para_.growth_.contract_ = false;
+  }
+
+  bool find(KT key, VT* value) {
+    EpochGuard guard(epoch_);
+    while (true) {
+      Position pos;
+      if (!locate(key, pos)) {
+        continue;
+      }
+      TNode<KT, VT>* node = pos.node_;
+      bool found = false;
+      if (node->is_dense()) {
+        if (pos.slot_ < node->size_ && compare(node->keys_[pos.slot_], key)) {
+          *value = node->values_[pos.slot_];
+          found = true;
+        }
+      } else if (pos.type_ == kData) {
+        KVT kv = node->entry(pos.slot_).kv_;
+        if (compare(kv.first, key)) {
+          *value = kv.second;
+          found = true;
+        }
+      } else if (pos.type_ == kBucket) {
+        Bucket<KT, VT>* bucket = node->entry(pos.slot_).bucket_;
+        if (!node->lock_.validate(pos.version_)) {
+          continue;
+        }
+        // The kernel reads only the fixed slots of the bucket, so a
+        // concurrent insertion cannot make it read out of bounds
+        uint32_t i = bucket->position(key);
+        if (i < kMaxBucketSize) {
+          *value = bucket->values_[i];
+          found = true;
+        }
+      }
+      if (node->lock_.validate(pos.version_)) {
+        count_query(key, pos);
+        return found;
+      }
+    }
+  }
+
+  bool update(KVT kv) {
+    EpochGuard guard(epoch_);
+    while (true) {
+      Position pos;
+      if (!locate(kv.first, pos) || !pos.node_->lock_.upgrade(pos.version_)) {
+        continue;
+      }
+      // The locked node is a leaf for the key, so it never descends
+      SP::request(kUpdate);
+      SP::predict(pos.depth_);
+      bool res = pos.node_->template update<SP>(kv);
+      pos.node_->lock_.write_unlock();
+      return res;
+    }
+  }
+
+  uint32_t remove(KT key) {
+    EpochGuard guard(epoch_);
+    while (true) {
+      Position pos;
+      if (!locate(key, pos) || !pos.node_->lock_.upgrade(pos.version_)) {
+        continue;
+      }
+      SP::request(kDelete);
+      SP::predict(pos.depth_);
+      uint32_t res = pos.node_->template remove<SP>(key, pos.depth_ + 1, 
+                                                    this->hyper_para_);
+      pos.node_->lock_.write_unlock();
+      if (res > 0) {
+        update_path_size(pos, -1);
+      }
+      return res;
+    }
+  }
+
+  void insert(KVT kv) {
+    EpochGuard guard(epoch_);
+    while (true) {
+      Position pos;
+      if (locate(kv.first, pos) && try_insert(kv, pos)) {
+        SP::request(kInsert);
+        SP::predict(pos.depth_ + !pos.node_->is_dense());
+        return;
+      }
+    }
+  }
+
+private:
+  // Count a query that has been located and validated at `pos`
+  void count_query(KT key, const Position& pos) {
+    SP::request(kQuery);
+    SP::visit(pos.depth_ + 1);
+    TNode<KT, VT>* node = pos.node_;
+    if (node->is_dense()) {
+      SP::reach(kQuery, IndexStats::kDenseSlot);
+      SP::compare(TNode<KT, VT>::search_comparisons(node->size_));
+      SP::predict(pos.depth_);
+    } else {
+      bool bucket = pos.type_ == kBucket;
+      SP::reach(kQuery, bucket ? IndexStats::kBucketSlot 
+                                : IndexStats::kModelSlot);
+      SP::compare(bucket ? node->entry(pos.slot_).bucket_->size_ 
+                          : pos.type_ == kData);
+      SP::predict(pos.depth_ + 1);
+    }
+  }
+
+  // Traverse to the dense node or the slot of a model node that covers `key`.
+  // Return false if the traversal has to restart.
+  bool locate(KT key, Position& pos) {
+    bool restart = false;
+    uint64_t root_version = root_lock_.read_lock(restart);
+    TNode<KT, VT>* node = this->root_;
+    uint64_t version = node->lock_.read_lock(restart);
+    if (restart || !root_lock_.validate(root_version)) {
+      return false;
+    }
+    pos.depth_ = 0;
+    pos.parent_ = nullptr;
+    pos.parent_version_ = root_version;
+    pos.parent_slot_ = 0;
+    while (true) {
+      if (node->is_dense()) {
+        uint32_t size = std::min(node->size_, node->capacity_);
+        pos.slot_ = branchless_lower_bound(node->keys_, size, key);
+        pos.type_ = kNone;
+        break;
+      }
+      uint32_t idx = node->predict_slot(key);
+      uint8_t type = node->entry_type(idx);
+      if (type != kNode) {
+        pos.slot_ = idx;
+        pos.type_ = type;
+        break;
+      }
+      TNode<KT, VT>* child = node->entry(idx).child_;
+      if (!node->lock_.validate(version)) {
+        return false;
+      }
+      uint64_t child_version = child->lock_.read_lock(restart);
+      if (restart || !node->lock_.validate(version)) {
+        return false;
+      }
+      if (pos.depth_ < kMaxPathLength) {
+        pos.path_[pos.depth_] = node;
+      }
+      pos.depth_ ++;
+      pos.parent_ = node;
+      pos.parent_version_ = version;
+      pos.parent_slot_ = idx;
+      node = child;
+      version = child_version;
+    }
+    pos.node_ = node;
+    pos.version_ = version;
+    return node->lock_.validate(version);
+  }
+
+  // Return false if the insertion has to restart.
+  bool try_insert(KVT kv, Position& pos) {
+    typedef TNode<KT, VT> Node;
+    TNode<KT, VT>* node = pos.node_;
+    const HyperParameter& hyper_para = this->hyper_para_;
+    uint32_t depth = pos.depth_ + 1;
+    if (node->is_dense()) {
+      if (node->size_ < node->capacity_) {
+        if (!node->lock_.upgrade(pos.version_)) {
+          return false;
+        }
+        SP::reach(kInsert, IndexStats::kDenseSlot);
+        SP::compare(Node::search_comparisons(node->size_));
+        for (uint32_t i = node->size_; i > pos.slot_; -- i) {
+          node->keys_[i] = node->keys_[i - 1];
+          node->values_[i] = node->values_[i - 1];
+        }
+        node->keys_[pos.slot_] = kv.first;
+        node->values_[pos.slot_] = kv.second;
+        node->size_ ++;
+        node->add_size_sub_tree(1);
+        node->lock_.write_unlock();
+        Node::count_data(IndexStats::kDenseSlot, depth, 1, hyper_para);
+      } else if (!replace_dense_node(kv, pos)) {
+        return false;
+      }
+    } else if (pos.type_ == kBucket) {
+      Bucket<KT, VT>* bucket = node->entry(pos.slot_).bucket_;
+      if (!node->lock_.upgrade(pos.version_)) {
+        return false;
+      }
+      SP::reach(kInsert, IndexStats::kBucketSlot);
+      if (bucket->template insert<SP>(kv, hyper_para.max_bucket_size_)) {
+        Node::count_data(IndexStats::kBucketSlot, depth, 1, hyper_para);
+      } else {
+        // Replace the bucket with a child node
+        uint32_t bucket_size = bucket->size_;
+        SP::rebuild(bucket_size + 1);
+        Node::log_event(kBucketSplit, depth, bucket_size + 1, hyper_para);
+        Node::count_buckets(-1, hyper_para);
+        Node::count_data(IndexStats::kBucketSlot, depth, 
+                          -static_cast<int64_t>(bucket_size), hyper_para);
+        KVT* kvs = new KVT[bucket_size + 1];
+        uint32_t j = 0;
+        for (; j < bucket_size && bucket->keys_[j] < kv.first; ++ j) {
+          kvs[j] = bucket->kv(j);
+        }
+        kvs[j] = kv;
+        for (; j < bucket_size; ++ j) {
+          kvs[j + 1] = bucket->kv(j);
+        }
+        TNode<KT, VT>* child = new TNode<KT, VT>();
+        child->build(kvs, bucket_size + 1, pos.depth_ + 2, hyper_para);
+        delete[] kvs;
+        node->entry(pos.slot_).child_ = child;
+        node->set_entry_type(pos.slot_, kNode);
+        epoch_.retire(bucket);
+      }
+      node->add_size_sub_tree(1);
+      node->lock_.write_unlock();
+    } else {
+      if (!node->lock_.upgrade(pos.version_)) {
+        return false;
+      }
+      if (pos.type_ == kNone) {
+        SP::reach(kInsert, IndexStats::kModelSlot);
+        node->entry(pos.slot_).kv_ = kv;
+        node->set_entry_type(pos.slot_, kData);
+        node->size_ ++;
+        Node::count_data(IndexStats::kModelSlot, depth, 1, hyper_para);
+      } else {
+        SP::reach(kInsert, IndexStats::kBucketSlot);
+        KVT stored_kv = node->entry(pos.slot_).kv_;
+        Bucket<KT, VT>* bucket = new Bucket<KT, VT>(&stored_kv, 1);
+        if (bucket->template insert<SP>(kv, hyper_para.max_bucket_size_)) {
+          node->entry(pos.slot_).bucket_ = bucket;
+          node->set_entry_type(pos.slot_, kBucket);
+          Node::count_buckets(1, hyper_para);
+          Node::count_data(IndexStats::kBucketSlot, depth, 2, hyper_para);
+          Node::log_event(kBucketCreate, depth, 2, hyper_para);
+        } else {
+          // The buckets hold a single pair, so the two pairs go to a child
+          SP::rebuild(2);
+          Node::log_event(kBucketSplit, depth, 2, hyper_para);
+          KVT kvs[2] = {stored_kv, kv};
+          if (kv.first < stored_kv.first) {
+            std::swap(kvs[0], kvs[1]);
+          }
+          TNode<KT, VT>* child = new TNode<KT, VT>();
+          child->build(kvs, 2, pos.depth_ + 2, hyper_para);
+          delete bucket;
+          node->entry(pos.slot_).child_ = child;
+          node->set_entry_type(pos.slot_, kNode);
+        }
+        node->size_ --;
+        Node::count_data(IndexStats::kModelSlot, depth, -1, hyper_para);
+      }
+      node->add_size_sub_tree(1);
+      node->lock_.write_unlock();
+    }
+    update_path_size(pos, 1);
+    return true;
+  }
+
+  // Replace a full dense node with a node built from its pairs and `kv`. Both
+  // the node and the parent (or the root pointer) are locked.
+  bool replace_dense_node(KVT kv, Position& pos) {
+    TNode<KT, VT>* node = pos.node_;
+    TNode<KT, VT>* parent = pos.parent_;
+    VersionLock& parent_lock = parent == nullptr ? root_lock_ : parent->lock_;
+    if (!parent_lock.upgrade(pos.parent_version_)) {
+      return false;
+    }
+    if (!node->lock_.upgrade(pos.version_)) {
+      parent_lock.write_unlock();
+      return false;
+    }
+    uint32_t node_size = node->size_;
+    SP::reach(kInsert, IndexStats::kDenseSlot);
+    SP::rebuild(node_size + 1);
+    TNode<KT, VT>::log_event(kDenseRebuild, pos.depth_ + 1, node_size + 1, 
+                              this->hyper_para_);
+    KVT* kvs = new KVT[node_size + 1];
+    for (uint32_t i = 0, j = 0; i <= node_size; ++ i) {
+      if (i == pos.slot_) {
+        kvs[i] = kv;
+      } else {
+        kvs[i] = {node->keys_[j], node->values_[j]};
+        j ++;
+      }
+    }
+    TNode<KT, VT>* new_node = new TNode<KT, VT>();
+    new_node->build(kvs, node_size + 1, pos.depth_ + 1, this->hyper_para_,
+                    this->hyper_para_.growth_.dense_slack(node_size));
+    delete[] kvs;
+    if (parent == nullptr) {
+      this->root_ = new_node;
+    } else {
+      // The node may be shared by the consecutive slots of an aggregated
+      // segment
+      uint32_t l = pos.parent_slot_;
+      while (l > 0 && parent->entry_type(l - 1) == kNode
+            && parent->entry(l - 1).child_ == node) {
+        l --;
+      }
+      for (uint32_t i = l; i < parent->capacity_
+            && parent->entry_type(i) == kNode
+            && parent->entry(i).child_ == node; ++ i) {
+        parent->entry(i).child_ = new_node;
+      }
+    }
+    node->count_self(pos.depth_ + 1, -1, this->hyper_para_);
+    node->lock_.write_unlock_obsolete();
+    parent_lock.write_unlock();
+    epoch_.retire(node);
+    return true;
+  }
+
+  void update_path_size(const Position& pos, int32_t delta) {
+    uint32_t depth = std::min(pos.depth_, kMaxPathLength);
+    for (uint32_t i = 0; i < depth; ++ i) {
+      pos.path_[i]->add_size_sub_tree(delta);
+    }
+  }
+};
+
+}
+
+#endif
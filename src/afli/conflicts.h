@@ -1,11 +1,44 @@
 #ifndef CONFLICTS_H
 #define CONFLICTS_H
 
+#include <omp.h>
+
 #include "util/common.h"
 #include "models/linear_model.h"
 
 namespace nfl {
 
+// Inputs larger than this are fitted and counted in chunks of this size by
+// OpenMP tasks. The chunks are merged in order, so the model and the conflicts
+// do not depend on the number of threads.
+const uint32_t kParallelChunkSize = 1 << 16;
+
+// The models are picked for the tail conflicts at this percentile, that of
+// the tail conflicts of AFLI and NFL. The conflicts are counted up to 
+// kMaxCountedConflict keys in a slot.
+const double kModelTailPercent = 0.99;
+const uint32_t kMaxCountedConflict = 255;
+
+// Inputs of more than twice kCostSampleSize keys are scored on kCostWindows
+// windows of consecutive keys spread over them, kCostSampleSize keys in all.
+// A conflict is a run of neighbouring keys, so that the windows see the same
+// conflicts as the whole input.
+const uint32_t kCostWindows = 32;
+const uint32_t kCostSampleSize = 1 << 16;
+
+// The conflicts of a model: its tail conflict, and the pairs of keys that 
+// share a slot, which grow with the square of the conflicts and break the 
+// ties
+struct ConflictCost {
+  uint32_t tail_;
+  uint64_t cost_;
+
+  bool operator<(const ConflictCost& other) const {
+    return tail_ < other.tail_ 
+          || (tail_ == other.tail_ && cost_ < other.cost_);
+  }
+};
+
 struct ConflictsInfo {
   uint32_t* conflicts_;
   uint32_t* positions_;
@@ -32,77 +65,308 @@ struct ConflictsInfo {
   }
 };
 
+// The keys are fitted by their offsets from `min_key`, the base of the model
 template<typename KT, typename VT>
-ConflictsInfo* build_linear_model(const std::pair<KT, VT>* kvs, uint32_t size,
-                                  LinearModel<KT>*& model, 
-                                  double size_amp) {
+void fit_chunk(const std::pair<KT, VT>* kvs, uint32_t lo, uint32_t hi, 
+                KT min_key, LinearModelBuilder<double>& builder) {
+  for (uint32_t i = lo; i < hi; ++ i) {
+    double x = key_offset(kvs[i].first, min_key);
+    // double y = max_size * (key - min_key) / key_space;
+    double y = i;
+    builder.add(x, y);
+  }
+}
+
+// Pass the runs of equal predicted positions of kvs[lo, hi) to `add` as 
+// (position, conflict) pairs. The first pair is placed at `first_pos`.
+template<typename KT, typename VT, typename AddFunc>
+void count_chunk(const std::pair<KT, VT>* kvs, uint32_t lo, uint32_t hi, 
+                  const LinearModel<KT>& model, uint32_t max_size, 
+                  uint32_t first_pos, AddFunc add) {
+  uint32_t p_last = first_pos;
+  uint32_t conflict = 1;
+  for (uint32_t i = lo + 1; i < hi; ++ i) {
+    uint32_t p = std::min(std::max(model.predict(kvs[i].first), 0L), 
+                                  static_cast<int64_t>(max_size - 1));
+    if (p == p_last) {
+      conflict ++;
+    } else {
+      add(p_last, conflict);
+      p_last = p;
+      conflict = 1;
+    }
+  }
+  add(p_last, conflict);
+}
+
+// The conflicts of `model` over kvs[0, size) with `max_size` slots. Large 
+// inputs are counted by chunks, or by the windows of a sample, and a run of 
+// a slot that crosses a chunk boundary is counted as two.
+template<typename KT, typename VT>
+ConflictCost conflict_cost(const std::pair<KT, VT>* kvs, uint32_t size, 
+                            const LinearModel<KT>& model, uint32_t max_size) {
+  const uint32_t kCounts = kMaxCountedConflict + 1;
+  bool sample = size > 2 * kCostSampleSize;
+  uint32_t num_chunks = sample ? kCostWindows 
+                        : (size + kParallelChunkSize - 1) / kParallelChunkSize;
+  uint32_t chunk_size = sample ? kCostSampleSize / kCostWindows 
+                        : kParallelChunkSize;
+  uint32_t stride = sample ? size / kCostWindows : kParallelChunkSize;
+  double last_slot = max_size - 1;
+  uint64_t cost = 0;
+  // The numbers of slots of each conflict per chunk. A key that shares the 
+  // slot of the last one is counted at 0, so that there is no branch.
+  uint32_t single_counts[kCounts] = {};
+  std::vector<uint32_t> chunk_counts(num_chunks > 1 ? num_chunks * kCounts 
+                                      : 0, 0);
+  uint32_t* counts = num_chunks > 1 ? chunk_counts.data() : single_counts;
+#pragma omp taskloop grainsize(1) reduction(+: cost) shared(counts) \
+  if(num_chunks > 1)
+  for (uint32_t c = 0; c < num_chunks; ++ c) {
+    uint32_t lo = c * stride;
+    uint32_t hi = std::min(size, lo + chunk_size);
+    uint32_t* count = counts + c * kCounts;
+    // The positions are clamped before they are rounded, which truncates the
+    // same as the floor of the model for positions at least 0
+    uint32_t p_last = static_cast<uint32_t>(std::min(std::max(
+                        model.predict_double(kvs[lo].first), 0.), last_slot));
+    // The k-th key of a slot shares it with k - 1 keys, without a branch on 
+    // the slot changes
+    uint64_t conflict = 1;
+    uint64_t chunk_cost = 0;
+    for (uint32_t i = lo + 1; i < hi; ++ i) {
+      uint32_t p = static_cast<uint32_t>(std::min(std::max(
+                      model.predict_double(kvs[i].first), 0.), last_slot));
+      bool same = p == p_last;
+      count[same ? 0 : std::min<uint64_t>(conflict, kMaxCountedConflict)] ++;
+      conflict = conflict * same + 1;
+      chunk_cost += conflict - 1;
+      p_last = p;
+    }
+    count[std::min<uint64_t>(conflict, kMaxCountedConflict)] ++;
+    cost += chunk_cost;
+  }
+  // The tail conflict is selected as in compute_tail_conflicts
+  uint64_t num_slots = 0;
+  for (uint32_t i = 0; i < num_chunks * kCounts; ++ i) {
+    num_slots += i % kCounts == 0 ? 0 : counts[i];
+  }
+  uint64_t rank = std::max<int64_t>(0, 
+                    static_cast<int64_t>(num_slots * kModelTailPercent) - 1);
+  uint64_t seen = 0;
+  for (uint32_t k = 1; k < kMaxCountedConflict; ++ k) {
+    for (uint32_t c = 0; c < num_chunks; ++ c) {
+      seen += counts[c * kCounts + k];
+    }
+    if (seen > rank) {
+      return {k, cost};
+    }
+  }
+  return {kMaxCountedConflict, cost};
+}
+
+// The first of the `size - t` consecutive keys of the smallest span, the 
+// window of a trim of `t` keys that a linear map spreads the most
+template<typename KT, typename VT>
+uint32_t shortest_window(const std::pair<KT, VT>* kvs, uint32_t size, 
+                          uint32_t t) {
+  uint32_t last = size - 1 - t;
+  uint32_t first = 0;
+  double span = key_offset(kvs[last].first, kvs[0].first);
+  for (uint32_t i = 1; i <= t; ++ i) {
+    double s = key_offset(kvs[i + last].first, kvs[i].first);
+    if (s < span) {
+      span = s;
+      first = i;
+    }
+  }
+  return first;
+}
+
+// Replace the least squares fit in `model`, which uses `fitted_size` slots, 
+// with the model of the lowest tail conflict within `max_size` slots, and 
+// return the number of slots it uses. The candidates map the shortest window
+// of the keys without `t` of them linearly onto `fitted_size` or `max_size`
+// slots, and the keys out of the window are clamped into the first and the
+// last slot, where their child nodes fit them again. The trims are searched
+// as fractions 1 / d of the keys, first for d on a grid of powers of 16 and 
+// then at the powers of 4 next to the best one. Trims above 1 / 32 of the 
+// keys leave deep child nodes at the ends that the percentile does not see.
+template<typename KT, typename VT>
+uint32_t minimize_conflicts(const std::pair<KT, VT>* kvs, uint32_t size,
+                            uint32_t fitted_size, uint32_t max_size, 
+                            LinearModel<KT>* model) {
+  const uint32_t kMinTrimDivisor = 32;
+  ConflictCost best_cost = conflict_cost(kvs, size, *model, fitted_size);
+  uint32_t best_size = fitted_size;
+  if (best_cost.cost_ == 0) {
+    // No key shares a slot
+    return best_size;
+  }
+  KT min_key = kvs[0].first;
+  LinearModel<KT> candidate;
+  candidate.base_ = min_key;
+  uint32_t slots[] = {fitted_size, max_size};
+  ConflictCost best_trim_cost = {std::numeric_limits<uint32_t>::max(), 0};
+  uint64_t best_divisor = 0;
+  std::vector<uint32_t> tried;
+  auto try_trim = [&](uint64_t d) {
+    uint32_t t = d == 0 ? 0 : size / d;
+    if (std::find(tried.begin(), tried.end(), t) != tried.end()) {
+      return;
+    }
+    tried.push_back(t);
+    uint32_t first = shortest_window(kvs, size, t);
+    double span = key_offset(kvs[first + size - 1 - t].first, 
+                              kvs[first].first);
+    if (!(span > 0)) {
+      return;
+    }
+    for (uint32_t s = 0; s < 2; ++ s) {
+      if (s > 0 && slots[s] == slots[0]) {
+        continue;
+      }
+      candidate.slope_ = (slots[s] - 1) / span;
+      candidate.intercept_ = 0.5 - candidate.slope_ 
+                                  * key_offset(kvs[first].first, min_key);
+      ConflictCost cost = conflict_cost(kvs, size, candidate, slots[s]);
+      if (cost < best_trim_cost) {
+        best_trim_cost = cost;
+        best_divisor = d;
+      }
+      if (cost < best_cost) {
+        best_cost = cost;
+        best_size = slots[s];
+        *model = candidate;
+      }
+    }
+  };
+  try_trim(0);
+  for (uint64_t d = kMinTrimDivisor; d <= size; d *= 16) {
+    try_trim(d);
+  }
+  if (best_divisor > 0) {
+    uint64_t d = best_divisor;
+    try_trim(d * 4);
+    if (d / 4 >= kMinTrimDivisor) {
+      try_trim(d / 4);
+    }
+  }
+  return best_size;
+}
+
+// build_linear_model with the tasks of the team of the caller
+template<typename KT, typename VT>
+ConflictsInfo* build_linear_model_tasks(const std::pair<KT, VT>* kvs, 
+                                        uint32_t size, 
+                                        LinearModel<KT>*& model, 
+                                        double size_amp) {
   if (model != nullptr) {
     model->slope_ = model->intercept_ = 0;
   } else {
     model = new LinearModel<KT>();
   }
-  // OPT: Find a linear regression model that has the minimum conflict degree
-  // The heuristics below is a simple method that scales the positions
   KT min_key = kvs[0].first;
   KT max_key = kvs[size - 1].first;
-  KT key_space = max_key - min_key;
   if (compare(min_key, max_key)) {
-    delete model;
-    model = nullptr;
     return nullptr;
   }
   uint32_t max_size = static_cast<uint32_t>(size * size_amp);
-  LinearModelBuilder<KT> builder;
-  uint32_t j = 0;
-  for (uint32_t i = 0; i < size; ++ i) {
-    KT key = kvs[i].first;
-    // double y = max_size * (key - min_key) / key_space;
-    double y = i;
-    builder.add(key, y);
+  uint32_t num_chunks = (size + kParallelChunkSize - 1) / kParallelChunkSize;
+  LinearModelBuilder<double> builder;
+  if (num_chunks == 1) {
+    fit_chunk(kvs, 0, size, min_key, builder);
+  } else {
+    std::vector<LinearModelBuilder<double>> partial(num_chunks);
+#pragma omp taskloop grainsize(1) shared(partial)
+    for (uint32_t c = 0; c < num_chunks; ++ c) {
+      fit_chunk(kvs, c * kParallelChunkSize, 
+                std::min(size, (c + 1) * kParallelChunkSize), min_key, 
+                partial[c]);
+    }
+    for (uint32_t c = 0; c < num_chunks; ++ c) {
+      builder.merge(partial[c]);
+    }
   }
   builder.build(model);
+  model->base_ = min_key;
   if (compare(model->slope_, 0.)) {
     // Fail to build a linear model
-    delete model;
-    model = nullptr;
     return nullptr;
   } else {
-    model->intercept_ = -model->slope_ * (min_key) + 0.5;
+    // The least squares fit of the ranks, shifted to start at the first slot
+    model->intercept_ = 0.5;
+    uint32_t fitted_size = max_size;
     int64_t predicted_size = model->predict(max_key) + 1;
     if (predicted_size > 1) {
-      max_size = std::min(predicted_size, static_cast<int64_t>(max_size));
+      fitted_size = std::min(predicted_size, static_cast<int64_t>(max_size));
     }
-    uint32_t first_pos = std::min(std::max(model->predict(min_key), 0L), 
-                                  static_cast<int64_t>(max_size - 1));
     uint32_t last_pos = std::min(std::max(model->predict(max_key), 0L), 
-                                  static_cast<int64_t>(max_size - 1));
-    if (last_pos == first_pos) {
+                                  static_cast<int64_t>(fitted_size - 1));
+    if (last_pos == 0) {
       // Model fails to predict since all predicted positions are rounded to the 
       // same one
-      model->slope_ = size / (max_key - min_key);
-      model->intercept_ = -model->slope_ * (min_key) + 0.5;
+      model->slope_ = size / key_offset(max_key, min_key);
+      model->intercept_ = 0.5;
     }
+    max_size = minimize_conflicts(kvs, size, fitted_size, max_size, model);
+    uint32_t first_pos = std::min(std::max(model->predict(min_key), 0L), 
+                                  static_cast<int64_t>(max_size - 1));
     ConflictsInfo* ci = new ConflictsInfo(size, max_size);
-    uint32_t p_last = first_pos;
-    uint32_t conflict = 1;
-    for (uint32_t i = 1; i < size; ++ i) {
-      uint32_t p = std::min(std::max(model->predict(kvs[i].first), 0L), 
+    if (num_chunks == 1) {
+      count_chunk(kvs, 0, size, *model, max_size, first_pos, 
+                  [ci](uint32_t p, uint32_t c) { ci->add_conflict(p, c); });
+    } else {
+      // A run of equal positions that crosses a chunk boundary is joined when 
+      // the runs of the chunks are concatenated
+      std::vector<std::vector<std::pair<uint32_t, uint32_t>>> runs(num_chunks);
+#pragma omp taskloop grainsize(1) shared(runs)
+      for (uint32_t c = 0; c < num_chunks; ++ c) {
+        uint32_t lo = c * kParallelChunkSize;
+        uint32_t hi = std::min(size, lo + kParallelChunkSize);
+        uint32_t first = c == 0 ? first_pos 
+                          : std::min(std::max(model->predict(kvs[lo].first), 
+                                              0L), 
                                     static_cast<int64_t>(max_size - 1));
-      if (p == p_last) {
-        conflict ++;
-      } else {
-        ci->add_conflict(p_last, conflict);
-        p_last = p;
-        conflict = 1;
+        std::vector<std::pair<uint32_t, uint32_t>>& chunk_runs = runs[c];
+        count_chunk(kvs, lo, hi, *model, max_size, first,
+                    [&chunk_runs](uint32_t p, uint32_t conflict) {
+                      chunk_runs.push_back({p, conflict});
+                    });
+      }
+      for (uint32_t c = 0; c < num_chunks; ++ c) {
+        for (auto& run : runs[c]) {
+          uint32_t n = ci->num_conflicts_;
+          if (n > 0 && ci->positions_[n - 1] == run.first) {
+            ci->conflicts_[n - 1] += run.second;
+          } else {
+            ci->add_conflict(run.first, run.second);
+          }
+        }
       }
-    }
-    if (conflict > 0) {
-      ci->add_conflict(p_last, conflict);
     }
     return ci;
   }
 }
 
+// Return nullptr if no model can be built. The model is then left for the 
+// caller to release. Outside a parallel region, a team is started for the 
+// tasks of the chunks: libgomp hangs in later parallel regions after a 
+// taskloop reduction that has no team.
+template<typename KT, typename VT>
+ConflictsInfo* build_linear_model(const std::pair<KT, VT>* kvs, uint32_t size,
+                                  LinearModel<KT>*& model, 
+                                  double size_amp) {
+  if (omp_in_parallel()) {
+    return build_linear_model_tasks(kvs, size, model, size_amp);
+  }
+  ConflictsInfo* ci = nullptr;
+#pragma omp parallel if(size > kParallelChunkSize)
+#pragma omp single
+  ci = build_linear_model_tasks(kvs, size, model, size_amp);
+  return ci;
+}
+
 template<typename KT, typename VT>
 uint32_t compute_tail_conflicts(const std::pair<KT, VT>* kvs, uint32_t size, 
                                 double size_amp, float kTailPercent=0.99) {
@@ -111,12 +375,19 @@ uint32_t compute_tail_conflicts(const std::pair<KT, VT>* kvs, uint32_t size,
   ConflictsInfo* ci = build_linear_model<KT, VT>(kvs, size, model, size_amp);
   delete model;
 
-  if (ci->num_conflicts_ == 0) {
+  if (ci == nullptr) {
+    // No model, e.g. for a single key
+    return 0;
+  } else if (ci->num_conflicts_ == 0) {
     delete ci;
     return 0;
   } else {
-    std::sort(ci->conflicts_, ci->conflicts_ + ci->num_conflicts_);
-    uint32_t tail_conflicts = ci->conflicts_[std::max(0, int(ci->num_conflicts_ * kTailPercent) - 1)];
+    // Only the percentile is needed, so select it rather than sorting all
+    uint32_t* tail = ci->conflicts_ 
+                    + std::max(0, int(ci->num_conflicts_ * kTailPercent) - 1);
+    std::nth_element(ci->conflicts_, tail, 
+                      ci->conflicts_ + ci->num_conflicts_);
+    uint32_t tail_conflicts = *tail;
     delete ci;
     return tail_conflicts - 1;
   }
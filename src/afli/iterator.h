@@ -9,26 +9,31 @@ template<typename KT, typename VT>
 class ResultIterator {
 typedef std::pair<KT, VT> KVT;
 private:
-  KVT* kv_;
+  // The key and the value are apart if the pair is in a bucket or a dense node
+  KT* key_;
+  VT* value_;
 
 public:
-  ResultIterator() : kv_(nullptr) { }
+  ResultIterator() : key_(nullptr), value_(nullptr) { }
 
-  ResultIterator(KVT* kv) : kv_(kv) { }
+  ResultIterator(KVT* kv) : key_(&kv->first), value_(&kv->second) { }
 
-  bool is_end() { return kv_ == nullptr; }
+  ResultIterator(KT* key, VT* value) : key_(key), value_(value) { }
 
-  KT key() { return kv_->first; }
+  bool is_end() { return value_ == nullptr; }
 
-  VT value() { return kv_->second; }
+  KT key() { return *key_; }
 
-  VT* value_addr() { return &kv_->second; }
+  VT value() { return *value_; }
 
-  KVT* kv() { return kv_; }
+  VT* value_addr() { return value_; }
+
+  KVT kv() { return {*key_, *value_}; }
 
   ResultIterator<KT, VT>& operator=(const ResultIterator<KT, VT>& other) {
     if (this != &other) {
-      kv_ = other.kv_;
+      key_ = other.key_;
+      value_ = other.value_;
     }
     return *this;
   }
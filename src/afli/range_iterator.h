@@ -0,0 +1,199 @@
+#ifndef RANGE_ITERATOR_H
+#define RANGE_ITERATOR_H
+
+#include "afli/afli_nodes.h"
+#include "util/common.h"
+
+namespace nfl {
+
+// Forward iterator that visits the key-value pairs of a tree in key order.
+// The position is kept as a path of (node, slot) frames from the root, plus the
+// position inside a bucket if the current pair is stored in a bucket.
+template<typename KT, typename VT>
+class RangeIterator {
+typedef std::pair<KT, VT> KVT;
+private:
+  struct Frame {
+    TNode<KT, VT>*  node_;
+    uint32_t        idx_;       // The slot in a model node or the position in
+                                // a dense node.
+  };
+  std::vector<Frame>  path_;
+  Bucket<KT, VT>*     bucket_;
+  uint32_t            bucket_pos_;
+  KT*                 key_;
+  VT*                 value_;
+
+public:
+  RangeIterator() 
+    : bucket_(nullptr), bucket_pos_(0), key_(nullptr), value_(nullptr) { }
+
+  // Position the iterator at the first pair whose key is not less than `key`.
+  // If `key` is null, position it at the smallest pair.
+  RangeIterator(TNode<KT, VT>* root, const KT* key)
+    : bucket_(nullptr), bucket_pos_(0), key_(nullptr), value_(nullptr) {
+    if (root != nullptr) {
+      enter(root, key);
+    }
+  }
+
+  bool is_end() { return value_ == nullptr; }
+
+  KT key() { return *key_; }
+
+  VT value() { return *value_; }
+
+  VT* value_addr() { return value_; }
+
+  KVT kv() { return {*key_, *value_}; }
+
+  void next() {
+    if (bucket_ != nullptr) {
+      if (++ bucket_pos_ < bucket_->size_) {
+        set(&bucket_->keys_[bucket_pos_], &bucket_->values_[bucket_pos_]);
+        return;
+      }
+      bucket_ = nullptr;
+    }
+    while (!path_.empty()) {
+      uint32_t level = path_.size() - 1;
+      TNode<KT, VT>* node = path_[level].node_;
+      if (node->is_dense()) {
+        // Dense node
+        uint32_t pos = ++ path_[level].idx_;
+        if (pos < node->size_) {
+          set(&node->keys_[pos], &node->values_[pos]);
+          return;
+        }
+      } else {
+        // Model node
+        uint32_t idx = next_slot(node, path_[level].idx_);
+        while (idx < node->capacity_) {
+          path_[level].idx_ = idx;
+          if (enter_slot(level, nullptr)) {
+            return;
+          }
+          idx = next_slot(node, idx);
+        }
+      }
+      path_.pop_back();
+    }
+    set(nullptr, nullptr);
+  }
+
+  RangeIterator<KT, VT>& operator++() {
+    next();
+    return *this;
+  }
+
+private:
+  inline void set(KT* key, VT* value) {
+    key_ = key;
+    value_ = value;
+  }
+
+  // Push the frame of `node` and move to the first pair in its sub-tree whose
+  // key is not less than `key`. The frame is popped if there is no such pair.
+  bool enter(TNode<KT, VT>* node, const KT* key) {
+    if (node->is_dense()) {
+      uint32_t pos = 0;
+      if (key != nullptr) {
+        pos = branchless_lower_bound(node->keys_, node->size_, *key);
+      }
+      if (pos < node->size_) {
+        path_.push_back({node, pos});
+        set(&node->keys_[pos], &node->values_[pos]);
+        return true;
+      }
+      return false;
+    }
+    uint32_t idx = 0;
+    if (key != nullptr) {
+      idx = node->predict_slot(*key);
+    } else {
+      idx = next_occupied(node, 0);
+    }
+    uint32_t level = path_.size();
+    path_.push_back({node, idx});
+    while (idx < node->capacity_) {
+      path_[level].idx_ = idx;
+      if (enter_slot(level, key)) {
+        return true;
+      }
+      // All the keys in the following slots are larger than the predicted one
+      key = nullptr;
+      idx = next_slot(node, idx);
+    }
+    path_.pop_back();
+    return false;
+  }
+
+  bool enter_slot(uint32_t level, const KT* key) {
+    TNode<KT, VT>* node = path_[level].node_;
+    uint32_t idx = path_[level].idx_;
+    uint8_t type = node->entry_type(idx);
+    if (type == kData) {
+      if (key == nullptr || !(node->entry(idx).kv_.first < *key)) {
+        set(&node->entry(idx).kv_.first, &node->entry(idx).kv_.second);
+        return true;
+      }
+    } else if (type == kBucket) {
+      Bucket<KT, VT>* bucket = node->entry(idx).bucket_;
+      uint32_t pos = 0;
+      if (key != nullptr) {
+        while (pos < bucket->size_ && bucket->keys_[pos] < *key) {
+          pos ++;
+        }
+      }
+      if (pos < bucket->size_) {
+        bucket_ = bucket;
+        bucket_pos_ = pos;
+        set(&bucket->keys_[pos], &bucket->values_[pos]);
+        return true;
+      }
+    } else if (type == kNode) {
+      return enter(node->entry(idx).child_, key);
+    }
+    return false;
+  }
+
+  // The next occupied slot after `idx`. The duplicated pointers of an
+  // aggregated child node are skipped so that the child is visited only once.
+  uint32_t next_slot(TNode<KT, VT>* node, uint32_t idx) {
+    uint32_t start = idx + 1;
+    if (node->entry_type(idx) == kNode) {
+      TNode<KT, VT>* child = node->entry(idx).child_;
+      while (start < node->capacity_ && node->entry_type(start) == kNode
+            && node->entry(start).child_ == child) {
+        start ++;
+      }
+    }
+    return next_occupied(node, start);
+  }
+
+  // The first slot not before `start` whose type is not kNone, scanning the
+  // type words a block at a time.
+  uint32_t next_occupied(TNode<KT, VT>* node, uint32_t start) {
+    const uint64_t kLowBits = 0x5555555555555555ULL;
+    if (start >= node->capacity_) {
+      return node->capacity_;
+    }
+    uint32_t block = start / kSlotsPerBlock;
+    uint64_t word = node->blocks_[block].types_;
+    uint64_t mask = (word | (word >> 1)) & kLowBits 
+                    & (~0ULL << (start % kSlotsPerBlock * 2));
+    while (mask == 0) {
+      if (++ block * kSlotsPerBlock >= node->capacity_) {
+        return node->capacity_;
+      }
+      word = node->blocks_[block].types_;
+      mask = (word | (word >> 1)) & kLowBits;
+    }
+    return std::min(static_cast<uint32_t>(block * kSlotsPerBlock
+                                          + __builtin_ctzll(mask) / 2),
+                    node->capacity_);
+  }
+};
+
+}
+#endif
@@ -0,0 +1,312 @@
+#ifndef STRING_AFLI_H
+#define STRING_AFLI_H
+
+#include "afli/afli.h"
+#include "util/common.h"
+
+namespace nfl {
+
+template<typename VT>
+class StringAFLI;
+
+// The keys that are mapped to the same prefix, sorted. A group that grows
+// beyond kMaxGroupSize keys is moved to a nested index, which takes the
+// prefixes from the bytes that follow the prefix its own keys share.
+template<typename VT>
+struct StringGroup {
+  std::vector<std::pair<std::string, VT>> kvs_;
+  StringAFLI<VT>*                         child_;
+
+  StringGroup() : child_(nullptr) { }
+
+  ~StringGroup() {
+    if (child_ != nullptr) {
+      delete child_;
+    }
+  }
+};
+
+// AFLI over variable-length string keys. A key is mapped to a 64-bit prefix
+// that preserves the order of the keys: the 8 bytes that follow the prefix
+// shared by all the bulk loaded keys, read in big-endian order. The learned
+// index is built over the prefixes. The full keys are kept out of line in a
+// group per prefix, where the keys of the same prefix are told apart by full
+// comparisons.
+template<typename VT>
+class StringAFLI {
+typedef std::pair<std::string, VT> KVT;
+typedef StringGroup<VT> Group;
+typedef std::pair<uint64_t, Group*> PKVT;
+typedef typename std::vector<KVT>::iterator GroupIterator;
+private:
+  AFLI<uint64_t, Group*> index_;
+  std::string common_prefix_;   // Shared by all the bulk loaded keys
+  uint32_t num_groups_;
+  uint32_t num_children_;       // The groups moved to nested indexes
+  uint64_t size_;               // The number of keys
+  uint64_t group_bytes_;        // The bytes of the groups and the nested
+                                // indexes
+
+  static constexpr uint32_t kPrefixBytes = sizeof(uint64_t);
+  static constexpr uint32_t kMaxGroupSize = 64;
+
+public:
+  explicit StringAFLI(bool use_pool=true, bool huge_pages=false)
+    : index_(use_pool, huge_pages), num_groups_(0), num_children_(0), 
+      size_(0), group_bytes_(0) { }
+
+  // The groups are allocated apart from the index
+  ~StringAFLI() {
+    if (num_groups_ > 0) {
+      for (auto it = index_.begin(); !it.is_end(); it.next()) {
+        delete it.value();
+      }
+    }
+  }
+
+  // The keys must be sorted and unique
+  void bulk_load(const KVT* kvs, uint32_t size, int32_t bucket_size=-1,
+                  uint32_t aggregate_size=0) {
+    assert_p(size > 0, "No keys to bulk load");
+    const std::string& first = kvs[0].first;
+    const std::string& last = kvs[size - 1].first;
+    size_t len = 0;
+    while (len < first.size() && len < last.size()
+            && first[len] == last[len]) {
+      len ++;
+    }
+    common_prefix_ = first.substr(0, len);
+    std::vector<PKVT> pkvs;
+    for (uint32_t i = 0, j = 0; i < size; i = j) {
+      uint64_t prefix = encode(kvs[i].first);
+      for (j = i + 1; j < size && encode(kvs[j].first) == prefix; ++ j) { }
+      Group* group = new Group();
+      if (j - i > kMaxGroupSize 
+          && separable(kvs[i].first, kvs[j - 1].first)) {
+        group->child_ = new StringAFLI<VT>(false);
+        group->child_->bulk_load(kvs + i, j - i);
+        num_children_ ++;
+      } else {
+        group->kvs_.assign(kvs + i, kvs + j);
+      }
+      group_bytes_ += group_bytes(group);
+      pkvs.push_back({prefix, group});
+    }
+    num_groups_ = pkvs.size();
+    size_ = size;
+    index_.bulk_load(pkvs.data(), pkvs.size(), bucket_size, aggregate_size);
+  }
+
+  uint64_t size() const { return size_; }
+
+  void set_growth_policy(const GrowthPolicy& growth) {
+    index_.set_growth_policy(growth);
+  }
+
+  // The prefix of `key` that the learned index is built over. Keys below the
+  // common prefix map to 0 and keys above it to the largest prefix.
+  uint64_t encode(const std::string& key) const {
+    size_t len = common_prefix_.size();
+    int cmp = key.compare(0, len, common_prefix_);
+    if (cmp != 0) {
+      return cmp < 0 ? 0 : std::numeric_limits<uint64_t>::max();
+    }
+    uint64_t prefix = 0;
+    for (size_t i = len; i < len + kPrefixBytes; ++ i) {
+      uint8_t byte = i < key.size() ? static_cast<uint8_t>(key[i]) : 0;
+      prefix = (prefix << 8) | byte;
+    }
+    return prefix;
+  }
+
+  bool find(const std::string& key, VT* value) {
+    Group* group = find_group(key);
+    if (group == nullptr) {
+      return false;
+    } else if (group->child_ != nullptr) {
+      return group->child_->find(key, value);
+    }
+    GroupIterator it = group_lower_bound(group, key);
+    if (it != group->kvs_.end() && it->first == key) {
+      *value = it->second;
+      return true;
+    }
+    return false;
+  }
+
+  bool update(const KVT& kv) {
+    Group* group = find_group(kv.first);
+    if (group == nullptr) {
+      return false;
+    } else if (group->child_ != nullptr) {
+      return group->child_->update(kv);
+    }
+    GroupIterator it = group_lower_bound(group, kv.first);
+    if (it != group->kvs_.end() && it->first == kv.first) {
+      it->second = kv.second;
+      return true;
+    }
+    return false;
+  }
+
+  // The value is replaced if the key exists
+  void insert(const KVT& kv) {
+    uint64_t prefix = encode(kv.first);
+    auto res = index_.find(prefix);
+    if (res.is_end()) {
+      Group* group = new Group();
+      group->kvs_.push_back(kv);
+      index_.insert({prefix, group});
+      num_groups_ ++;
+      size_ ++;
+      group_bytes_ += group_bytes(group);
+      return;
+    }
+    Group* group = res.value();
+    group_bytes_ -= group_bytes(group);
+    if (group->child_ != nullptr) {
+      uint64_t child_size = group->child_->size();
+      group->child_->insert(kv);
+      size_ += group->child_->size() - child_size;
+    } else {
+      GroupIterator it = group_lower_bound(group, kv.first);
+      if (it != group->kvs_.end() && it->first == kv.first) {
+        it->second = kv.second;
+      } else {
+        group->kvs_.insert(it, kv);
+        size_ ++;
+      }
+      if (group->kvs_.size() > kMaxGroupSize 
+          && separable(group->kvs_.front().first, group->kvs_.back().first)) {
+        group->child_ = new StringAFLI<VT>(false);
+        group->child_->bulk_load(group->kvs_.data(), group->kvs_.size());
+        std::vector<KVT>().swap(group->kvs_);
+        num_children_ ++;
+      }
+    }
+    group_bytes_ += group_bytes(group);
+  }
+
+  uint32_t remove(const std::string& key) {
+    uint64_t prefix = encode(key);
+    auto res = index_.find(prefix);
+    if (res.is_end()) {
+      return 0;
+    }
+    Group* group = res.value();
+    uint64_t bytes = group_bytes(group);
+    if (group->child_ != nullptr) {
+      if (group->child_->remove(key) == 0) {
+        return 0;
+      }
+    } else {
+      GroupIterator it = group_lower_bound(group, key);
+      if (it == group->kvs_.end() || it->first != key) {
+        return 0;
+      }
+      group->kvs_.erase(it);
+    }
+    size_ --;
+    group_bytes_ -= bytes;
+    if (group->kvs_.empty() 
+        && (group->child_ == nullptr || group->child_->size() == 0)) {
+      index_.remove(prefix);
+      num_children_ -= group->child_ != nullptr;
+      delete group;
+      num_groups_ --;
+    } else {
+      group_bytes_ += group_bytes(group);
+    }
+    return 1;
+  }
+
+  // Copy at most `limit` pairs with keys in [lo, hi] into `results` in key
+  // order and return the number of copied pairs
+  uint32_t scan(const std::string& lo, const std::string& hi, uint32_t limit,
+                KVT* results) {
+    uint32_t num = 0;
+    // The keys of the prefixes beyond the prefix of `hi` are all larger
+    uint64_t hi_prefix = encode(hi);
+    for (auto it = index_.lower_bound(encode(lo)); num < limit
+          && !it.is_end() && it.key() <= hi_prefix; it.next()) {
+      Group* group = it.value();
+      if (group->child_ != nullptr) {
+        num += group->child_->scan(lo, hi, limit - num, results + num);
+        continue;
+      }
+      for (GroupIterator g = group_lower_bound(group, lo); 
+            g != group->kvs_.end(); ++ g) {
+        if (num == limit || hi < g->first) {
+          return num;
+        }
+        results[num ++] = *g;
+      }
+    }
+    return num;
+  }
+
+  uint64_t model_size() {
+    return index_.model_size();
+  }
+
+  // The full keys are counted by their lengths
+  uint64_t index_size() {
+    return index_.index_size() + sizeof(StringAFLI<VT>) 
+          + common_prefix_.size() + group_bytes_;
+  }
+
+  void print_stats() {
+    index_.print_stats();
+    std::cout << "Common Prefix Length\t" << common_prefix_.size()
+              << "\nNumber of String Keys\t" << size_
+              << "\nNumber of Prefixes\t" << num_groups_
+              << "\nNumber of Nested Indexes\t" << num_children_ << std::endl;
+  }
+
+private:
+  // Whether a nested index of the sorted keys from `first` to `last` maps
+  // them to more than one prefix. Keys that differ only by trailing zero 
+  // bytes are not, and stay in one group.
+  static bool separable(const std::string& first, const std::string& last) {
+    size_t len = 0;
+    while (len < first.size() && len < last.size() 
+            && first[len] == last[len]) {
+      len ++;
+    }
+    for (size_t i = len; i < len + kPrefixBytes && i < last.size(); ++ i) {
+      if (i < first.size() || last[i] != 0) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // A group holds at most kMaxGroupSize keys, or a nested index whose size
+  // is kept by the index itself
+  static uint64_t group_bytes(Group* group) {
+    uint64_t size = sizeof(Group);
+    if (group->child_ != nullptr) {
+      return size + group->child_->index_size();
+    }
+    for (const KVT& kv : group->kvs_) {
+      size += sizeof(KVT) + kv.first.size();
+    }
+    return size;
+  }
+
+  Group* find_group(const std::string& key) {
+    auto res = index_.find(encode(key));
+    return res.is_end() ? nullptr : res.value();
+  }
+
+  GroupIterator group_lower_bound(Group* group, const std::string& key) {
+    return std::lower_bound(group->kvs_.begin(), group->kvs_.end(), key,
+                            [](const KVT& kv, const std::string& k) {
+                              return kv.first < k;
+                            });
+  }
+};
+
+}
+
+#endif
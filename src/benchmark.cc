@@ -21,6 +21,22 @@ int main(int argc, char* argv[]) {
     Benchmark<double, long long> benchmark;
     benchmark.run_workload(index_name, batch_size, workload_path, 
                                 config_path, show_inc_thro != "");
+  } else if (key_type == "float32") {
+    Benchmark<float, long long> benchmark;
+    benchmark.run_workload(index_name, batch_size, workload_path, 
+                                config_path, show_inc_thro != "");
+  } else if (key_type == "uint64") {
+    Benchmark<uint64_t, long long> benchmark;
+    benchmark.run_workload(index_name, batch_size, workload_path, 
+                                config_path, show_inc_thro != "");
+  } else if (key_type == "int64") {
+    Benchmark<int64_t, long long> benchmark;
+    benchmark.run_workload(index_name, batch_size, workload_path, 
+                                config_path, show_inc_thro != "");
+  } else if (key_type == "uint32") {
+    Benchmark<uint32_t, long long> benchmark;
+    benchmark.run_workload(index_name, batch_size, workload_path, 
+                                config_path, show_inc_thro != "");
   } else {
     std::cout << "Unsupported key type [" << key_type << "]" << std::endl;
     exit(-1);
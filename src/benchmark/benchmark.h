@@ -3,19 +3,46 @@
 
 #include "benchmark/workload.h"
 #include "util/common.h"
+#include "util/event_log.h"
 
 #include "afli/afli.h"
+#include "afli/concurrent_afli.h"
 #include "nfl/nfl.h"
 
+#include <array>
+#include <atomic>
+#include <thread>
+
 namespace nfl {
 
+// The operations of AFLI are counted and shown with the results if the 
+// benchmark is built with NFL_RUN_STATS
+#ifdef NFL_RUN_STATS
+typedef CountRunStat BenchmarkRunStat;
+#else
+typedef NoRunStat BenchmarkRunStat;
+#endif
+
 struct AFLIConfig {
   int bucket_size;
   int aggregate_size;
+  int num_threads;
+  bool use_pool;
+  bool huge_pages;
+  std::string snapshot_path;  // Load the index from it if it exists, and
+                              // save the bulk loaded index to it otherwise
+  std::string event_log_path; // Write the batches joined with the structural
+                              // modifications during them to it
+  GrowthPolicy growth;
 
   AFLIConfig(std::string path) {
     bucket_size = -1;
     aggregate_size = 0;
+    num_threads = std::max(1u, std::thread::hardware_concurrency());
+    use_pool = true;
+    huge_pages = false;
+    snapshot_path = "";
+    event_log_path = "";
     if (path != "") {
       std::ifstream in(path, std::ios::in);
       if (in.is_open()) {
@@ -30,6 +57,28 @@ struct AFLIConfig {
               bucket_size = std::stoi(val);
             } else if (key == "aggregate_size") {
               aggregate_size = std::stoi(val);
+            } else if (key == "num_threads") {
+              num_threads = std::stoi(val);
+            } else if (key == "use_pool") {
+              use_pool = std::stoi(val) != 0;
+            } else if (key == "huge_pages") {
+              huge_pages = std::stoi(val) != 0;
+            } else if (key == "snapshot_path") {
+              snapshot_path = val;
+            } else if (key == "event_log_path") {
+              event_log_path = val;
+            } else if (key == "expand_ratio") {
+              growth.expand_ratio_ = std::stod(val);
+            } else if (key == "max_expand_capacity") {
+              growth.max_expand_capacity_ = std::stoul(val);
+            } else if (key == "dense_growth") {
+              growth.dense_growth_ = std::stod(val);
+            } else if (key == "retrain_ratio") {
+              growth.retrain_ratio_ = std::stod(val);
+            } else if (key == "retrain_depth") {
+              growth.retrain_depth_ = std::stod(val);
+            } else if (key == "max_retrain_size") {
+              growth.max_retrain_size_ = std::stoul(val);
             }
           }
         }
@@ -39,15 +88,44 @@ struct AFLIConfig {
   }
 };
 
+// The time span of a batch of requests, which the structural modifications
+// recorded during it are attributed to
+struct BatchSpan {
+  uint64_t  start_;     // EventLog::now() at the start and the end
+  uint64_t  end_;
+  double    latency_;
+  uint16_t  thread_;    // EventLog::thread_id() of the running thread
+};
+
 struct NFLConfig {
   int bucket_size;
   int aggregate_size;
   std::string weights_path;
+  std::string snapshot_path;  // Load the NFL from it if it exists, and save
+                              // the bulk loaded NFL to it otherwise
+  bool float_flow;            // Try the flow in float, see NFL::set_float_flow
+  double float_tolerance;
+  bool compiled_flow;         // Try a table of the flow, see 
+                              // NFL::set_compiled_flow
+  double compiled_tolerance;
+  bool ordered_flow;          // Keep only a flow that keeps the keys in 
+                              // order, see NFL::set_ordered_flow
+  bool pipeline;              // Transform the next batch on a helper thread,
+                              // see NFL::start_pipeline
+  GrowthPolicy growth;
 
   NFLConfig(std::string path) {
     bucket_size = -1;
     aggregate_size = 0;
     weights_path = "";
+    snapshot_path = "";
+    float_flow = false;
+    float_tolerance = 0.1;
+    compiled_flow = false;
+    compiled_tolerance = 0;
+    // The workloads have no range requests
+    ordered_flow = false;
+    pipeline = false;
     if (path != "") {
       std::ifstream in(path, std::ios::in);
       if (in.is_open()) {
@@ -64,6 +142,32 @@ struct NFLConfig {
               aggregate_size = std::stoi(val);
             } else if (key == "weights_path") {
               weights_path = val;
+            } else if (key == "snapshot_path") {
+              snapshot_path = val;
+            } else if (key == "float_flow") {
+              float_flow = std::stoi(val) != 0;
+            } else if (key == "float_tolerance") {
+              float_tolerance = std::stod(val);
+            } else if (key == "compiled_flow") {
+              compiled_flow = std::stoi(val) != 0;
+            } else if (key == "compiled_tolerance") {
+              compiled_tolerance = std::stod(val);
+            } else if (key == "ordered_flow") {
+              ordered_flow = std::stoi(val) != 0;
+            } else if (key == "pipeline") {
+              pipeline = std::stoi(val) != 0;
+            } else if (key == "expand_ratio") {
+              growth.expand_ratio_ = std::stod(val);
+            } else if (key == "max_expand_capacity") {
+              growth.max_expand_capacity_ = std::stoul(val);
+            } else if (key == "dense_growth") {
+              growth.dense_growth_ = std::stod(val);
+            } else if (key == "retrain_ratio") {
+              growth.retrain_ratio_ = std::stod(val);
+            } else if (key == "retrain_depth") {
+              growth.retrain_depth_ = std::stod(val);
+            } else if (key == "max_retrain_size") {
+              growth.max_retrain_size_ = std::stoul(val);
             }
           }
         }
@@ -131,6 +235,8 @@ public:
     ExperimentalResults exp_res(batch_size);
     if (start_with(index_name, "afli")) {
       run_afli(batch_size, exp_res, config_path, show_stat);
+    } else if (start_with(index_name, "cafli")) {
+      run_cafli(batch_size, exp_res, config_path, show_stat);
     } else if (start_with(index_name, "nfl")) {
       run_nfl(batch_size, exp_res, config_path, show_stat);
     } else {
@@ -152,45 +258,86 @@ public:
     AFLIConfig config(config_path);
     // Start to bulk load
     auto bulk_load_start = std::chrono::high_resolution_clock::now();
-    AFLI<KT, VT> afli;
-    afli.bulk_load(init_data.data(), init_data.size());
+    AFLI<KT, VT, BenchmarkRunStat> afli(config.use_pool, config.huge_pages);
+    afli.set_growth_policy(config.growth);
+    bool restore = config.snapshot_path != "" 
+                  && std::filesystem::exists(config.snapshot_path);
+    if (restore) {
+      afli.load(config.snapshot_path);
+    } else {
+      afli.bulk_load(init_data.data(), init_data.size());
+    }
     auto bulk_load_end = std::chrono::high_resolution_clock::now();
     exp_res.bulk_load_index_time = 
       std::chrono::duration_cast<std::chrono::nanoseconds>(bulk_load_end 
                                                     - bulk_load_start).count();
+    if (config.snapshot_path != "" && !restore) {
+      afli.save(config.snapshot_path);
+    }
     if (show_stat) {
       afli.print_stats();
     }
+    BenchmarkRunStat::reset();
+    bool log_events = config.event_log_path != "";
+    EventLog events;
+    std::vector<EventRecord> event_records;
+    std::vector<BatchSpan> spans;
+    uint64_t event_pos = 0;
+    uint64_t num_lost_events = 0;
+    if (log_events) {
+      afli.set_event_log(&events);
+    }
 
     std::vector<KVT> batch_data;
+    std::vector<KT> batch_keys;
+    std::vector<ResultIterator<KT, VT>> batch_results(batch_size);
     batch_data.reserve(batch_size);
+    batch_keys.reserve(batch_size);
     // Perform requests in batch
     int num_batches = std::ceil(requests.size() * 1. / batch_size);
     exp_res.latencies.reserve(num_batches * 3);
     exp_res.need_compute.reserve(num_batches * 3);
     for (int batch_idx = 0; batch_idx < num_batches; ++ batch_idx) {
       batch_data.clear();
+      batch_keys.clear();
       int l = batch_idx * batch_size;
       int r = std::min((batch_idx + 1) * batch_size, 
                         static_cast<int>(requests.size()));
       for (int i = l; i < r; ++ i) {
         batch_data.push_back(requests[i].kv);
+        batch_keys.push_back(requests[i].kv.first);
       }
 
       VT val_sum = 0;
       // Perform requests
+      uint64_t span_start = log_events ? EventLog::now() : 0;
       auto start = std::chrono::high_resolution_clock::now();
       for (int i = l; i < r; ++ i) {
         int data_idx = i - l;
         if (requests[i].op == kQuery) {
-          auto it = afli.find(batch_data[data_idx].first);
-          if (!it.is_end()) {
-            val_sum += it.value();
+          // Interleave the run of consecutive queries
+          int j = i + 1;
+          while (j < r && requests[j].op == kQuery) {
+            j ++;
+          }
+          afli.find_batch(batch_keys.data() + data_idx, j - i, 
+                          batch_results.data());
+          for (int k = 0; k < j - i; ++ k) {
+            if (!batch_results[k].is_end()) {
+              val_sum += batch_results[k].value();
+            }
           }
+          i = j - 1;
         } else if (requests[i].op == kUpdate) {
           bool res = afli.update(batch_data[data_idx]);
         } else if (requests[i].op == kInsert) {
-          afli.insert(batch_data[data_idx]);
+          // Insert the run of consecutive insertions at once
+          int j = i + 1;
+          while (j < r && requests[j].op == kInsert) {
+            j ++;
+          }
+          afli.insert_batch(batch_data.data() + data_idx, j - i);
+          i = j - 1;
         } else if (requests[i].op == kDelete) {
           int res = afli.remove(batch_data[data_idx].first);
         }
@@ -201,24 +348,285 @@ public:
       exp_res.num_requests += batch_data.size();
       exp_res.latencies.push_back({0, time});
       exp_res.step();
+      if (log_events) {
+        spans.push_back({span_start, EventLog::now(), time, 
+                          EventLog::thread_id()});
+        event_pos = events.read(event_pos, event_records, num_lost_events);
+      }
+    }
+    if (log_events) {
+      afli.set_event_log(nullptr);
+      report_events(config.event_log_path, spans, event_records, 
+                    num_lost_events);
     }
     exp_res.model_size = afli.model_size();
     exp_res.index_size = afli.index_size();
     if (show_stat) {
       afli.print_stats();
     }
+    if (BenchmarkRunStat::kEnabled) {
+      afli.run_stats().show();
+    }
+  }
+
+  // Evaluate the concurrent AFLI with 1, 2, 4, ... up to the configured number 
+  // of threads. The throughput of each thread count is printed, and the 
+  // results of the largest one are kept in `exp_res`.
+  void run_cafli(int batch_size, ExperimentalResults& exp_res, 
+                std::string config_path, bool show_stat=false) {
+    AFLIConfig config(config_path);
+    std::vector<int> thread_counts;
+    for (int t = 1; t < config.num_threads; t *= 2) {
+      thread_counts.push_back(t);
+    }
+    thread_counts.push_back(config.num_threads);
+    std::cout << "Threads\tThroughput (million ops/sec)" << std::endl;
+    for (int num_threads : thread_counts) {
+      ExperimentalResults thread_res(batch_size);
+      ExperimentalResults& res = num_threads == config.num_threads ? exp_res 
+                                                                : thread_res;
+      // The events are reported for the largest number of threads
+      run_cafli_threads(batch_size, num_threads, res, show_stat, 
+                        num_threads == config.num_threads 
+                        ? config.event_log_path : "");
+      std::cout << num_threads << "\t" 
+                << res.num_requests * 1e3 / res.sum_indexing_time << std::endl;
+    }
+  }
+
+  void run_cafli_threads(int batch_size, int num_threads, 
+                        ExperimentalResults& exp_res, bool show_stat=false,
+                        std::string event_log_path="") {
+    // Start to bulk load
+    auto bulk_load_start = std::chrono::high_resolution_clock::now();
+    ConcurrentAFLI<KT, VT, BenchmarkRunStat> cafli;
+    cafli.bulk_load(init_data.data(), init_data.size());
+    auto bulk_load_end = std::chrono::high_resolution_clock::now();
+    exp_res.bulk_load_index_time = 
+      std::chrono::duration_cast<std::chrono::nanoseconds>(bulk_load_end 
+                                                    - bulk_load_start).count();
+    if (show_stat) {
+      cafli.print_stats();
+    }
+    BenchmarkRunStat::reset();
+    bool log_events = event_log_path != "";
+    EventLog events;
+    std::vector<EventRecord> event_records;
+    std::vector<std::vector<BatchSpan>> thread_spans(num_threads);
+    uint64_t event_pos = 0;
+    uint64_t num_lost_events = 0;
+    std::atomic<int> num_finished(0);
+    if (log_events) {
+      cafli.set_event_log(&events);
+    }
+
+    // The threads take batches from a shared counter
+    int num_batches = std::ceil(requests.size() * 1. / batch_size);
+    std::atomic<int> next_batch(0);
+    std::vector<std::vector<double>> thread_latencies(num_threads);
+    auto worker = [&](int tid) {
+      VT val_sum = 0;
+      thread_latencies[tid].reserve(num_batches / num_threads + 1);
+      for (int batch_idx = next_batch.fetch_add(1); batch_idx < num_batches; 
+            batch_idx = next_batch.fetch_add(1)) {
+        int l = batch_idx * batch_size;
+        int r = std::min((batch_idx + 1) * batch_size, 
+                          static_cast<int>(requests.size()));
+        uint64_t span_start = log_events ? EventLog::now() : 0;
+        auto start = std::chrono::high_resolution_clock::now();
+        for (int i = l; i < r; ++ i) {
+          if (requests[i].op == kQuery) {
+            VT val;
+            if (cafli.find(requests[i].kv.first, &val)) {
+              val_sum += val;
+            }
+          } else if (requests[i].op == kUpdate) {
+            bool res = cafli.update(requests[i].kv);
+          } else if (requests[i].op == kInsert) {
+            cafli.insert(requests[i].kv);
+          } else if (requests[i].op == kDelete) {
+            int res = cafli.remove(requests[i].kv.first);
+          }
+        }
+        auto end = std::chrono::high_resolution_clock::now();
+        double time = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                        end - start).count();
+        thread_latencies[tid].push_back(time);
+        if (log_events) {
+          thread_spans[tid].push_back({span_start, EventLog::now(), time, 
+                                        EventLog::thread_id()});
+        }
+      }
+      num_finished ++;
+    };
+    auto start = std::chrono::high_resolution_clock::now();
+    std::vector<std::thread> threads;
+    for (int t = 0; t < num_threads; ++ t) {
+      threads.emplace_back(worker, t);
+    }
+    // Drain the events while the workers run, before the ring wraps around
+    while (log_events && num_finished.load() < num_threads) {
+      event_pos = events.read(event_pos, event_records, num_lost_events);
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    for (auto& thread : threads) {
+      thread.join();
+    }
+    auto end = std::chrono::high_resolution_clock::now();
+    if (log_events) {
+      cafli.set_event_log(nullptr);
+      events.read(event_pos, event_records, num_lost_events);
+      std::vector<BatchSpan> spans;
+      for (auto& t_spans : thread_spans) {
+        spans.insert(spans.end(), t_spans.begin(), t_spans.end());
+      }
+      report_events(event_log_path, spans, event_records, num_lost_events);
+    }
+    // The overall throughput is based on the wall-clock time
+    exp_res.sum_indexing_time = 
+      std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count();
+    exp_res.num_requests = requests.size();
+    exp_res.latencies.reserve(num_batches);
+    exp_res.need_compute.reserve(num_batches);
+    for (int t = 0; t < num_threads; ++ t) {
+      for (double time : thread_latencies[t]) {
+        exp_res.latencies.push_back({0, time});
+        exp_res.need_compute.push_back(false);
+      }
+    }
+    exp_res.model_size = cafli.model_size();
+    exp_res.index_size = cafli.index_size();
+    if (show_stat) {
+      cafli.print_stats();
+    }
+    if (BenchmarkRunStat::kEnabled) {
+      cafli.run_stats().show();
+    }
+  }
+
+  // Attribute each structural modification to the batch of the same thread
+  // whose span covers it. Write the batches with their modifications to 
+  // `path` in the order they ran, and show the modifications in the batches
+  // at the tail latencies.
+  void report_events(std::string path, std::vector<BatchSpan>& spans,
+                      const std::vector<EventRecord>& events, 
+                      uint64_t num_lost) {
+    std::sort(spans.begin(), spans.end(), [](auto const& a, auto const& b) {
+      return a.thread_ < b.thread_ 
+            || (a.thread_ == b.thread_ && a.start_ < b.start_);
+    });
+    std::vector<std::array<uint32_t, kNumStructureEvents>> counts(spans.size());
+    std::vector<uint64_t> keys_moved(spans.size(), 0);
+    uint64_t num_unattributed = 0;
+    for (const EventRecord& event : events) {
+      auto it = std::upper_bound(spans.begin(), spans.end(), event,
+                  [](const EventRecord& e, const BatchSpan& span) {
+                    return e.thread_ < span.thread_ 
+                          || (e.thread_ == span.thread_ 
+                              && e.time_ < span.start_);
+                  });
+      if (it == spans.begin() || (it - 1)->thread_ != event.thread_ 
+          || (it - 1)->end_ < event.time_) {
+        num_unattributed ++;
+        continue;
+      }
+      size_t idx = it - 1 - spans.begin();
+      counts[idx][event.type_] ++;
+      keys_moved[idx] += event.num_keys_;
+    }
+    // Write the batches in the order they started
+    std::vector<uint32_t> order(spans.size());
+    for (uint32_t i = 0; i < spans.size(); ++ i) {
+      order[i] = i;
+    }
+    std::sort(order.begin(), order.end(), [&spans](uint32_t a, uint32_t b) {
+      return spans[a].start_ < spans[b].start_;
+    });
+    uint64_t first_start = spans.empty() ? 0 : spans[order[0]].start_;
+    std::ofstream out(path, std::ios::out);
+    assert_p(out.is_open(), "Failed to open " + path + " for writing");
+    out << "batch\tthread\tstart (ns)\tlatency (ns)";
+    for (uint32_t t = 0; t < kNumStructureEvents; ++ t) {
+      out << "\t" << kStructureEventNames[t];
+    }
+    out << "\tkeys moved" << std::endl;
+    for (uint32_t b = 0; b < order.size(); ++ b) {
+      const BatchSpan& span = spans[order[b]];
+      out << b << "\t" << span.thread_ << "\t" << span.start_ - first_start 
+          << "\t" << std::fixed << std::setprecision(0) << span.latency_;
+      for (uint32_t t = 0; t < kNumStructureEvents; ++ t) {
+        out << "\t" << counts[order[b]][t];
+      }
+      out << "\t" << keys_moved[order[b]] << std::endl;
+    }
+    out.close();
+    // The batches at or above each tail percentile of the latencies
+    std::vector<double> latencies(spans.size());
+    for (uint32_t i = 0; i < spans.size(); ++ i) {
+      latencies[i] = spans[i].latency_;
+    }
+    std::sort(latencies.begin(), latencies.end());
+    std::cout << std::string(10, '#') << "Structural Modifications" 
+              << std::string(10, '#') << std::endl;
+    std::cout << "Number of Events\t" << events.size() << "\tLost [" 
+              << num_lost << "] Unattributed [" << num_unattributed << "]" 
+              << std::endl;
+    for (double percent : {0.99, 0.9999}) {
+      if (latencies.empty()) {
+        break;
+      }
+      double threshold = latencies[std::max(0, 
+                          static_cast<int>(latencies.size() * percent) - 1)];
+      uint32_t num_tail = 0;
+      uint32_t num_modified = 0;
+      std::array<uint64_t, kNumStructureEvents> tail_counts = {};
+      for (uint32_t i = 0; i < spans.size(); ++ i) {
+        if (spans[i].latency_ < threshold) {
+          continue;
+        }
+        num_tail ++;
+        bool modified = false;
+        for (uint32_t t = 0; t < kNumStructureEvents; ++ t) {
+          tail_counts[t] += counts[i][t];
+          modified |= counts[i][t] > 0;
+        }
+        num_modified += modified;
+      }
+      std::cout << "Batches at P" << percent * 100 << "\t" << num_tail 
+                << "\tModified [" << num_modified << "]";
+      for (uint32_t t = 0; t < kNumStructureEvents; ++ t) {
+        std::cout << " " << kStructureEventNames[t] << " [" << tail_counts[t] 
+                  << "]";
+      }
+      std::cout << std::endl;
+    }
+    std::cout << std::string(44, '#') << std::endl;
   }
 
   void run_nfl(int batch_size, ExperimentalResults& exp_res, 
                 std::string config_path, bool show_stat=false) {
     NFLConfig config(config_path);
     // Start to bulk load
+    bool restore = config.snapshot_path != "" 
+                  && std::filesystem::exists(config.snapshot_path);
     auto bulk_load_start = std::chrono::high_resolution_clock::now();
-    NFL<KT, VT> nfl(config.weights_path, batch_size);
-    uint32_t tail_conflicts = nfl.auto_switch(init_data.data(), 
-                                              init_data.size());
+    NFL<KT, VT>* nfl_ptr = restore ? new NFL<KT, VT>(batch_size) 
+                          : new NFL<KT, VT>(config.weights_path, batch_size);
+    NFL<KT, VT>& nfl = *nfl_ptr;
+    nfl.set_growth_policy(config.growth);
+    nfl.set_float_flow(config.float_flow, config.float_tolerance);
+    nfl.set_compiled_flow(config.compiled_flow, config.compiled_tolerance);
+    nfl.set_ordered_flow(config.ordered_flow);
+    uint32_t tail_conflicts = 0;
+    if (!restore) {
+      tail_conflicts = nfl.auto_switch(init_data.data(), init_data.size());
+    }
     auto bulk_load_mid = std::chrono::high_resolution_clock::now();
-    nfl.bulk_load(init_data.data(), init_data.size(), tail_conflicts);
+    if (restore) {
+      nfl.load(config.snapshot_path);
+    } else {
+      nfl.bulk_load(init_data.data(), init_data.size(), tail_conflicts);
+    }
     auto bulk_load_end = std::chrono::high_resolution_clock::now();
     exp_res.bulk_load_trans_time = 
       std::chrono::duration_cast<std::chrono::nanoseconds>(bulk_load_mid 
@@ -226,29 +634,59 @@ public:
     exp_res.bulk_load_index_time = 
       std::chrono::duration_cast<std::chrono::nanoseconds>(bulk_load_end 
                                                       - bulk_load_mid).count();
+    if (config.snapshot_path != "" && !restore) {
+      nfl.save(config.snapshot_path);
+    }
     if (show_stat) {
       nfl.print_stats();
     }
 
-    std::vector<KVT> batch_data;
-    batch_data.reserve(batch_size);
+    // Double buffered batches, so that the pipeline transforms the next 
+    // batch while the requests of the current one run
+    std::vector<KVT> batch_data[2];
+    batch_data[0].reserve(batch_size);
+    batch_data[1].reserve(batch_size);
     // Perform requests in batch
     int num_batches = std::ceil(requests.size() * 1. / batch_size);
     exp_res.latencies.reserve(num_batches * 3);
     exp_res.need_compute.reserve(num_batches * 3);
+    exp_res.pipelined = config.pipeline;
+    if (config.pipeline && num_batches > 0) {
+      nfl.start_pipeline();
+      fill_batch(0, batch_size, batch_data[0]);
+      nfl.transform_async(batch_data[0].data(), batch_data[0].size());
+    }
     for (int batch_idx = 0; batch_idx < num_batches; ++ batch_idx) {
-      batch_data.clear();
+      std::vector<KVT>& batch = batch_data[batch_idx % 2];
+      std::vector<KVT>& next = batch_data[(batch_idx + 1) % 2];
       int l = batch_idx * batch_size;
       int r = std::min((batch_idx + 1) * batch_size, 
                         static_cast<int>(requests.size()));
-      for (int i = l; i < r; ++ i) {
-        batch_data.push_back(requests[i].kv);
+      if (!config.pipeline) {
+        fill_batch(batch_idx, batch_size, batch);
+      } else if (batch_idx + 1 < num_batches) {
+        // The previous batch is done with the buffer
+        fill_batch(batch_idx + 1, batch_size, next);
       }
 
       VT val_sum = 0;
       // Perform requests
       auto start = std::chrono::high_resolution_clock::now();
-      nfl.transform(batch_data.data(), batch_data.size());
+      if (config.pipeline) {
+        // The time of the transform that is not hidden behind the requests
+        // of the previous batch is the wait for it
+        uint64_t transform_time = nfl.next_batch();
+        double wait_time = std::chrono::duration_cast<
+                            std::chrono::nanoseconds>(
+                            std::chrono::high_resolution_clock::now() 
+                            - start).count();
+        exp_res.sum_overlap_time += std::max(0., transform_time - wait_time);
+        if (batch_idx + 1 < num_batches) {
+          nfl.transform_async(next.data(), next.size());
+        }
+      } else {
+        nfl.transform(batch.data(), batch.size());
+      }
       auto mid = std::chrono::high_resolution_clock::now();
       for (int i = l; i < r; ++ i) {
         int data_idx = i - l;
@@ -260,7 +698,13 @@ public:
         } else if (requests[i].op == kUpdate) {
           bool res = nfl.update(data_idx);
         } else if (requests[i].op == kInsert) {
-          nfl.insert(data_idx);
+          // Insert the run of consecutive insertions at once
+          int j = i + 1;
+          while (j < r && requests[j].op == kInsert) {
+            j ++;
+          }
+          nfl.insert_batch(data_idx, j - i);
+          i = j - 1;
         } else if (requests[i].op == kDelete) {
           int res = nfl.remove(data_idx);
         }
@@ -272,15 +716,29 @@ public:
                                                               - mid).count();
       exp_res.sum_transform_time += time1;
       exp_res.sum_indexing_time += time2;
-      exp_res.num_requests += batch_data.size();
+      exp_res.num_requests += r - l;
       exp_res.latencies.push_back({time1, time2});
       exp_res.step();
     }
+    nfl.stop_pipeline();
     exp_res.model_size = nfl.model_size();
     exp_res.index_size = nfl.index_size();
     if (show_stat) {
       nfl.print_stats();
     }
+    delete nfl_ptr;
+  }
+
+private:
+  // The pairs of the requests of the `batch_idx`-th batch
+  void fill_batch(int batch_idx, int batch_size, std::vector<KVT>& batch) {
+    batch.clear();
+    int l = batch_idx * batch_size;
+    int r = std::min((batch_idx + 1) * batch_size, 
+                      static_cast<int>(requests.size()));
+    for (int i = l; i < r; ++ i) {
+      batch.push_back(requests[i].kv);
+    }
   }
 };
 
@@ -1,50 +1,98 @@
 #ifndef BNAF_H
 #define BNAF_H
 
+#include "models/flow_kernels.h"
 #include "util/common.h"
 
+#ifdef NFL_USE_MKL
 #include <mkl.h>
 #include <mkl_cblas.h>
+#endif
 
 namespace nfl {
 
-template<typename KT, typename VT>
+// The integer type of the shapes of the flow, which are written to snapshots
+#ifdef NFL_USE_MKL
+typedef MKL_INT FlowInt;
+
+// The row-major products C [m * n] = A [m * k] * B [k * n] and the tanh of
+// `n` values in either precision
+inline void flow_gemm(FlowInt m, FlowInt n, FlowInt k, const double* a, 
+                      const double* b, double* c) {
+  cblas_dgemm(CblasRowMajor, CblasNoTrans, CblasNoTrans, m, n, k, 
+              1, a, k, b, n, 0, c, n);
+}
+
+inline void flow_gemm(FlowInt m, FlowInt n, FlowInt k, const float* a, 
+                      const float* b, float* c) {
+  cblas_sgemm(CblasRowMajor, CblasNoTrans, CblasNoTrans, m, n, k, 
+              1, a, k, b, n, 0, c, n);
+}
+
+inline void flow_tanh_array(FlowInt n, const double* a, double* y) {
+  vdTanh(n, a, y);
+}
+
+inline void flow_tanh_array(FlowInt n, const float* a, float* y) {
+  vsTanh(n, a, y);
+}
+#else
+typedef int FlowInt;
+#endif
+
+// The flow computed in the precision FT, double or float. The features of
+// the keys are expanded in double precision for both.
+template<typename KT, typename VT, typename FT=double>
 class BNAF_Infer {
 typedef std::pair<KT, VT> KVT;
-typedef std::pair<KT, KVT> KKVT;
+typedef std::pair<double, KVT> KKVT;  // The transformed key of any key type
+                                      // is a double
+typedef typename std::conditional<std::is_same<FT, double>::value, 
+                                  FlowSimd, FlowSimdF>::type Simd;
 public:
   int num_layers_;
-  MKL_INT batch_size_;
-  MKL_INT in_dim_;
-  MKL_INT hidden_dim_;
-  double** weights_;
+  FlowInt batch_size_;
+  FlowInt in_dim_;
+  FlowInt hidden_dim_;
+  FT** weights_;
   // 1: in_dim_ * hidden_dim_
   // 2: hidden_dim_ * hidden_dim_
   // ....
   // n: hidden_dim_ * in_dim_
-  double* inputs_;
-  double* outputs_[2];
+  // The features of the keys in rows with MKL. With the portable kernels, one
+  // key per slot for doubles and a plane per feature for floats, padded to a
+  // multiple of Simd::kLanes.
+  FT* inputs_;
+  FT* outputs_[2];
+  bool owns_weights_;   // False for the flows that borrow the weights
 public:
-  BNAF_Infer() : inputs_(nullptr), weights_(nullptr) {
+  BNAF_Infer() : inputs_(nullptr), weights_(nullptr), owns_weights_(true) {
     outputs_[0] = nullptr;
     outputs_[1] = nullptr;
   }
 
+  // A flow with its own buffers of `batch_size` keys that borrows the weights
+  // of `flow`, so that the threads transform keys at the same time. `flow` 
+  // must outlive it.
+  BNAF_Infer(const BNAF_Infer<KT, VT, FT>& flow, uint32_t batch_size)
+    : num_layers_(flow.num_layers_), in_dim_(flow.in_dim_), 
+      hidden_dim_(flow.hidden_dim_), weights_(flow.weights_), 
+      inputs_(nullptr), owns_weights_(false) {
+    outputs_[0] = nullptr;
+    outputs_[1] = nullptr;
+    set_batch_size(batch_size);
+  }
+
   ~BNAF_Infer() {
-    for (int i = 0; i < num_layers_; ++ i) {
-      if (weights_[i] != nullptr) {
-        mkl_free(weights_[i]);
+    if (weights_ != nullptr && owns_weights_) {
+      for (int i = 0; i < num_layers_; ++ i) {
+        if (weights_[i] != nullptr) {
+          flow_free(weights_[i]);
+        }
       }
+      delete[] weights_;
     }
-    if (inputs_ != nullptr) {
-      mkl_free(inputs_);
-    }
-    if (outputs_[0] != nullptr) {
-      mkl_free(outputs_[0]);
-    }
-    if (outputs_[1] != nullptr) {
-      mkl_free(outputs_[1]);
-    }
+    free_buffers();
   }
 
   uint64_t model_size() {
@@ -52,32 +100,63 @@ public:
   }
 
   uint64_t size() {
-    return sizeof(BNAF_Infer<KT, VT>) + sizeof(double*) * num_layers_ 
-          + sizeof(double) * (batch_size_ * in_dim_ + batch_size_ * hidden_dim_ * 2)
-          + sizeof(double) * (in_dim_ * hidden_dim_ * 2 + (num_layers_ - 2) * hidden_dim_ * hidden_dim_);
+#ifdef NFL_USE_MKL
+    uint64_t buffers = batch_size_ * in_dim_ + batch_size_ * hidden_dim_ * 2;
+#else
+    uint64_t buffers = padded_batch_size() * num_planes();
+#endif
+    return sizeof(BNAF_Infer<KT, VT, FT>) + sizeof(FT*) * num_layers_ 
+          + sizeof(FT) * buffers
+          + sizeof(FT) * (in_dim_ * hidden_dim_ * 2 + (num_layers_ - 2) * hidden_dim_ * hidden_dim_);
   }
 
   void set_batch_size(uint32_t batch_size) {
     batch_size_ = batch_size;
-    if (inputs_ != nullptr) {
-      mkl_free(inputs_);
-    }
-    if (outputs_[0] != nullptr) {
-      mkl_free(outputs_[0]);
-    }
-    if (outputs_[1] != nullptr) {
-      mkl_free(outputs_[1]);
-    }
-    inputs_= (double*)mkl_calloc(batch_size_ * in_dim_, sizeof(double), 64);
-    outputs_[0] = (double*)mkl_calloc(batch_size_ * hidden_dim_, sizeof(double), 64);
-    outputs_[1] = (double*)mkl_calloc(batch_size_ * hidden_dim_, sizeof(double), 64);
+    free_buffers();
+#ifdef NFL_USE_MKL
+    inputs_ = flow_alloc<FT>(batch_size_ * in_dim_);
+    outputs_[0] = flow_alloc<FT>(batch_size_ * hidden_dim_);
+    outputs_[1] = flow_alloc<FT>(batch_size_ * hidden_dim_);
+#else
+    assert_p(in_dim_ == 1 || in_dim_ == 2 || in_dim_ == 4,
+              "Unsupported dimensions\t" + std::to_string(in_dim_));
+    assert_p(hidden_dim_ <= kMaxFlowHiddenDim, 
+              "Unsupported hidden dimensions\t" + std::to_string(hidden_dim_));
+    inputs_ = flow_alloc<FT>(padded_batch_size() * num_planes());
+#endif
   }
 
   void transform(KKVT* tran_kvs, uint32_t size) {
     prepare_inputs(tran_kvs, size);
-    forward();
+    forward(size);
     prepare_outputs(tran_kvs, size);
   }
+
+  // The flow of one normalized key, as `transform` computes it. The portable
+  // kernels run on the lanes of one value in registers, with no buffer and no
+  // padding to a block of lanes. MKL keeps its products of one row, which are
+  // not rounded as a matrix-vector product in registers would be.
+  double transform_key(double x) {
+#ifdef NFL_USE_MKL
+    KKVT t_kv;
+    t_kv.first = x;
+    transform(&t_kv, 1);
+    return t_kv.first;
+#else
+    typedef typename std::conditional<std::is_same<FT, double>::value, 
+                                      FlowScalar, FlowScalarF>::type Scalar;
+    FT features[4];
+    if constexpr (std::is_same<FT, double>::value) {
+      features[0] = x;
+    } else {
+      KKVT t_kv;
+      t_kv.first = x;
+      prepare_features<true>(&t_kv, 1, 1, features);
+    }
+    forward_lanes<Scalar>(features, 1, 1);
+    return features[0];
+#endif
+  }
   void print_parameters() {
     std::cout << "Layers\t" << num_layers_ << std::endl;
     std::cout << "Input Dim\t" << in_dim_ << std::endl;
@@ -88,89 +167,176 @@ public:
   }
 
 private:
-  void prepare_inputs(const KKVT* tran_kvs, uint32_t size) {
-    if (in_dim_ == 1) {
-      for (uint32_t i = 0; i < size; ++ i) {
-        inputs_[i] = tran_kvs[i].first;
+  uint32_t padded_batch_size() {
+    return (batch_size_ + Simd::kLanes - 1) / Simd::kLanes * Simd::kLanes;
+  }
+
+  // The planes of the portable inputs
+  uint32_t num_planes() {
+    return std::is_same<FT, double>::value ? 1 : in_dim_;
+  }
+
+  void free_buffers() {
+    FT** buffers[] = {&inputs_, &outputs_[0], &outputs_[1]};
+    for (FT** buffer : buffers) {
+      if (*buffer != nullptr) {
+        flow_free(*buffer);
+        *buffer = nullptr;
       }
-    } else if (in_dim_ == 2) {
-      for (uint32_t i = 0; i < size; ++ i) {
-        inputs_[2 * i] = tran_kvs[i].first;
-        inputs_[2 * i + 1] = tran_kvs[i].first - std::floor(inputs_[2 * i]);
+    }
+  }
+
+  // Expand the input features of the keys, in rows of `kIn` features or in
+  // `kIn` planes of `stride` values
+  template<int kIn, bool kPlanes>
+  void expand_features(const KKVT* tran_kvs, uint32_t size, uint32_t stride,
+                        FT* inputs) {
+    for (uint32_t i = 0; i < size; ++ i) {
+      double x = tran_kvs[i].first;
+      double f[kIn];
+      f[0] = x;
+      if constexpr (kIn == 2) {
+        f[1] = x - std::floor(x);
+      } else if constexpr (kIn == 4) {
+        f[1] = std::floor(x);
+        double tmp = (x - f[1]) * 1000000;
+        f[2] = std::floor(tmp);
+        f[3] = tmp - f[2];
       }
-    } else if (in_dim_ == 4) {
-      for (uint32_t i = 0; i < size; ++ i) {
-        inputs_[4 * i] = tran_kvs[i].first;
-        inputs_[4 * i + 1] = std::floor(inputs_[2 * i]);
-        double tmp = (tran_kvs[i].first - inputs_[4 * i + 1]) * 1000000;
-        inputs_[4 * i + 2] = std::floor(tmp);
-        inputs_[4 * i + 3] = tmp - inputs_[4 * i + 2];
+      for (int k = 0; k < kIn; ++ k) {
+        inputs[kPlanes ? k * stride + i : i * kIn + k] = f[k];
       }
-    } else {
-      std::cout << "Unsupported dimensions\t" << in_dim_ << std::endl;
-      exit(-1);
     }
   }
 
-  void prepare_outputs(KKVT* tran_kvs, uint32_t size) {
+  template<bool kPlanes>
+  void prepare_features(const KKVT* tran_kvs, uint32_t size, uint32_t stride,
+                        FT* inputs) {
     if (in_dim_ == 1) {
-      for (uint32_t i = 0; i < size; ++ i) {
-        tran_kvs[i] = {inputs_[i], tran_kvs[i].second};
-      }
+      expand_features<1, kPlanes>(tran_kvs, size, stride, inputs);
     } else if (in_dim_ == 2) {
-      for (uint32_t i = 0; i < size; ++ i) {
-        tran_kvs[i] = {inputs_[i * 2] + inputs_[i * 2 + 1], tran_kvs[i].second};
-      }
+      expand_features<2, kPlanes>(tran_kvs, size, stride, inputs);
     } else if (in_dim_ == 4) {
-      for (uint32_t i = 0; i < size; ++ i) {
-        tran_kvs[i] = {inputs_[i * 4] + inputs_[i * 4 + 1] + inputs_[i * 4 + 2] + inputs_[i * 4 + 3], tran_kvs[i].second};
-      }
+      expand_features<4, kPlanes>(tran_kvs, size, stride, inputs);
     } else {
       std::cout << "Unsupported dimensions\t" << in_dim_ << std::endl;
       exit(-1);
     }
   }
 
-  void forward() {
+#ifdef NFL_USE_MKL
+  void prepare_inputs(const KKVT* tran_kvs, uint32_t size) {
+    prepare_features<false>(tran_kvs, size, 0, inputs_);
+  }
+
+  void prepare_outputs(KKVT* tran_kvs, uint32_t size) {
+    for (uint32_t i = 0; i < size; ++ i) {
+      FT out = inputs_[i * in_dim_];
+      for (int k = 1; k < in_dim_; ++ k) {
+        out += inputs_[i * in_dim_ + k];
+      }
+      tran_kvs[i].first = out;
+    }
+  }
+
+  // Only the first `size` rows are multiplied
+  void forward(uint32_t size) {
     // print_outputs(-1, inputs_, batch_size_, in_dim_);
-    // Compute the formula: 
-    //            alpha * mat_a [m * k] * mat_b [k * n] + beta * mat_c [m * n]
-    // cblas_dgemm(layout, trans_a, trans_b, m, n, k, alpha, mat_a, lda, 
-    //              mat_b, ldb, beta, mat_c, ldc)
-    // IN [batch_size_ * in_dim] * W_0 [in_dim * hidden_dim] = 
-    // OUT [batch_size_ * hidden_dim]
-    cblas_dgemm(CblasRowMajor, CblasNoTrans, CblasNoTrans, 
-                batch_size_, hidden_dim_, in_dim_, 
-                1, inputs_, in_dim_, 
-                weights_[0], hidden_dim_, 
-                0, outputs_[0], hidden_dim_);
+    // IN [size * in_dim] * W_0 [in_dim * hidden_dim] = 
+    // OUT [size * hidden_dim]
+    flow_gemm(size, hidden_dim_, in_dim_, inputs_, weights_[0], outputs_[0]);
     // print_weight_matrix(0);
     // print_outputs(0, outputs_[0], batch_size_, hidden_dim_);
-    vdTanh(batch_size_ * hidden_dim_, outputs_[0], outputs_[1]);
+    flow_tanh_array(size * hidden_dim_, outputs_[0], outputs_[1]);
     // print_outputs(0, outputs_[1], batch_size_, hidden_dim_);
     for (int i = 1; i < num_layers_ - 1; ++ i) {
-      // IN [batch_size_ * hidden_dim] * W_i [hidden_dim * hidden_dim] = 
-      // OUT [batch_size_ * hidden_dim]
-      cblas_dgemm(CblasRowMajor, CblasNoTrans, CblasNoTrans, 
-                  batch_size_, hidden_dim_, hidden_dim_, 
-                  1, outputs_[1], hidden_dim_, 
-                  weights_[i], hidden_dim_, 
-                  0, outputs_[0], hidden_dim_);
+      // IN [size * hidden_dim] * W_i [hidden_dim * hidden_dim] = 
+      // OUT [size * hidden_dim]
+      flow_gemm(size, hidden_dim_, hidden_dim_, outputs_[1], weights_[i], 
+                outputs_[0]);
       // print_weight_matrix(i);
       // print_outputs(i, outputs_[0], batch_size_, hidden_dim_);      
-      vdTanh(batch_size_ * hidden_dim_, outputs_[0], outputs_[1]);
+      flow_tanh_array(size * hidden_dim_, outputs_[0], outputs_[1]);
       // print_outputs(i, outputs_[1], batch_size_, hidden_dim_);      
     }
-    // IN [batch_size_ * hidden_dim] * W_L [hidden_dim * in_dim] = 
-    // OUT [batch_size_ * in_dim]
-    cblas_dgemm(CblasRowMajor, CblasNoTrans, CblasNoTrans, 
-                batch_size_, in_dim_, hidden_dim_, 
-                1, outputs_[1], hidden_dim_, 
-                weights_[num_layers_ - 1], in_dim_, 
-                0, inputs_, in_dim_);
+    // IN [size * hidden_dim] * W_L [hidden_dim * in_dim] = 
+    // OUT [size * in_dim]
+    flow_gemm(size, in_dim_, hidden_dim_, outputs_[1], 
+              weights_[num_layers_ - 1], inputs_);
     // print_weight_matrix(num_layers_);
     // print_outputs(num_layers_, inputs_, batch_size_, in_dim_);
   }
+#else
+  // The keys are gathered into a contiguous buffer, where the kernels expand
+  // the features of the keys and transform them in place. Float features lose
+  // too much precision to be expanded from float keys, so they are expanded 
+  // here into planes. The slots past `size` are zeroed so that the last block
+  // only sees finite inputs.
+  void prepare_inputs(const KKVT* tran_kvs, uint32_t size) {
+    uint32_t padded = (size + Simd::kLanes - 1) / Simd::kLanes * Simd::kLanes;
+    uint32_t stride = padded_batch_size();
+    if constexpr (std::is_same<FT, double>::value) {
+      for (uint32_t i = 0; i < size; ++ i) {
+        inputs_[i] = tran_kvs[i].first;
+      }
+    } else {
+      prepare_features<true>(tran_kvs, size, stride, inputs_);
+    }
+    for (uint32_t k = 0; k < num_planes(); ++ k) {
+      for (uint32_t i = size; i < padded; ++ i) {
+        inputs_[k * stride + i] = 0;
+      }
+    }
+  }
+
+  void prepare_outputs(KKVT* tran_kvs, uint32_t size) {
+    for (uint32_t i = 0; i < size; ++ i) {
+      tran_kvs[i].first = inputs_[i];
+    }
+  }
+
+  void forward(uint32_t size) {
+    forward_lanes<Simd>(inputs_, padded_batch_size(), size);
+  }
+
+  // Run the kernels on the lanes of L over `size` keys in planes of `stride`
+  template<typename L>
+  void forward_lanes(FT* inputs, uint32_t stride, uint32_t size) {
+    if (in_dim_ == 1) {
+      forward_hidden<L, 1>(inputs, stride, size);
+    } else if (in_dim_ == 2) {
+      forward_hidden<L, 2>(inputs, stride, size);
+    } else {
+      forward_hidden<L, 4>(inputs, stride, size);
+    }
+  }
+
+  // The common hidden dimensions are unrolled at compile time
+  template<typename L, int kIn>
+  void forward_hidden(FT* inputs, uint32_t stride, uint32_t size) {
+    switch (hidden_dim_) {
+      case 2:
+        flow_forward<L, kIn, 2>(inputs, stride, size, hidden_dim_, 
+                                num_layers_, weights_);
+        break;
+      case 4:
+        flow_forward<L, kIn, 4>(inputs, stride, size, hidden_dim_, 
+                                num_layers_, weights_);
+        break;
+      case 8:
+        flow_forward<L, kIn, 8>(inputs, stride, size, hidden_dim_, 
+                                num_layers_, weights_);
+        break;
+      case 16:
+        flow_forward<L, kIn, 16>(inputs, stride, size, hidden_dim_, 
+                                 num_layers_, weights_);
+        break;
+      default:
+        flow_forward<L, kIn, 0>(inputs, stride, size, hidden_dim_, 
+                                num_layers_, weights_);
+    }
+  }
+#endif
 
   void print_weight_matrix(int l) {
     if (l == 0) {
@@ -200,7 +366,7 @@ private:
     }
   }
 
-  void print_outputs(int idx, double* outputs, int num_rows, int num_columns) {
+  void print_outputs(int idx, FT* outputs, int num_rows, int num_columns) {
     if (idx == -1) {
       std::cout << "Input" << std::endl;
     } else {
@@ -0,0 +1,359 @@
+#ifndef FLOW_KERNELS_H
+#define FLOW_KERNELS_H
+
+#if !defined(NFL_SCALAR_FLOW) \
+    && (defined(__AVX512F__) || (defined(__AVX2__) && defined(__FMA__)))
+#include <immintrin.h>
+#endif
+
+#include <cmath>
+#include <cstdlib>
+
+#include "util/common.h"
+
+namespace nfl {
+
+// Inference kernels of the numerical flow that do not depend on MKL. A block
+// of keys is pushed through all the layers at once, one key per vector lane,
+// so that the activations stay in registers. The vector width is selected at
+// build time: AVX-512 or AVX2 with FMA if the target supports it, and one key
+// at a time otherwise. Define NFL_SCALAR_FLOW to force the scalar kernels.
+
+// Buffers of the flow, aligned for the vector loads and zeroed
+template<typename T>
+T* flow_alloc(size_t n) {
+  size_t bytes = std::max<size_t>((sizeof(T) * n + 63) / 64 * 64, 64);
+  T* data = static_cast<T*>(std::aligned_alloc(64, bytes));
+  assert_p(data != nullptr, "Failed to allocate the buffers of the flow");
+  std::memset(data, 0, bytes);
+  return data;
+}
+
+template<typename T>
+void flow_free(T* data) {
+  std::free(data);
+}
+
+// The lanes of one value, which the single keys use whatever the vector 
+// width. Every operation rounds as one lane of the vectors, so a key is 
+// transformed to the same value either way.
+struct FlowScalar {
+  typedef double T;
+  typedef double V;
+  static constexpr uint32_t kLanes = 1;
+
+  static inline V load(const double* p) { return *p; }
+  static inline void store(double* p, V a) { *p = a; }
+  static inline V set1(double a) { return a; }
+  static inline V add(V a, V b) { return a + b; }
+  static inline V sub(V a, V b) { return a - b; }
+  static inline V mul(V a, V b) { return a * b; }
+  static inline V div(V a, V b) { return a / b; }
+  static inline V fmadd(V a, V b, V c) { return std::fma(a, b, c); }
+  static inline V min(V a, V b) { return std::min(a, b); }
+  static inline V abs(V a) { return std::fabs(a); }
+  static inline V floor(V a) { return std::floor(a); }
+  static inline V copysign(V a, V sign) { return std::copysign(a, sign); }
+  static inline V select_lt(V a, V b, V x, V y) { return a < b ? x : y; }
+
+  static inline V pow2(V n) {
+    uint64_t bits = static_cast<uint64_t>(static_cast<int64_t>(n) + 1023) 
+                    << 52;
+    V r;
+    std::memcpy(&r, &bits, sizeof(r));
+    return r;
+  }
+};
+
+struct FlowScalarF {
+  typedef float T;
+  typedef float V;
+  static constexpr uint32_t kLanes = 1;
+
+  static inline V load(const float* p) { return *p; }
+  static inline void store(float* p, V a) { *p = a; }
+  static inline V set1(float a) { return a; }
+  static inline V add(V a, V b) { return a + b; }
+  static inline V mul(V a, V b) { return a * b; }
+  static inline V div(V a, V b) { return a / b; }
+  static inline V fmadd(V a, V b, V c) { return std::fma(a, b, c); }
+  static inline V min(V a, V b) { return std::min(a, b); }
+  static inline V max(V a, V b) { return std::max(a, b); }
+  static inline V abs(V a) { return std::fabs(a); }
+  static inline V select_lt(V a, V b, V x, V y) { return a < b ? x : y; }
+};
+
+#if !defined(NFL_SCALAR_FLOW) && defined(__AVX512F__)
+struct FlowSimd {
+  typedef double T;
+  typedef __m512d V;
+  static constexpr uint32_t kLanes = 8;
+
+  static inline V load(const double* p) { return _mm512_load_pd(p); }
+  static inline void store(double* p, V a) { _mm512_store_pd(p, a); }
+  static inline V set1(double a) { return _mm512_set1_pd(a); }
+  static inline V add(V a, V b) { return _mm512_add_pd(a, b); }
+  static inline V sub(V a, V b) { return _mm512_sub_pd(a, b); }
+  static inline V mul(V a, V b) { return _mm512_mul_pd(a, b); }
+  static inline V div(V a, V b) { return _mm512_div_pd(a, b); }
+  static inline V fmadd(V a, V b, V c) { return _mm512_fmadd_pd(a, b, c); }
+  static inline V min(V a, V b) { return _mm512_min_pd(a, b); }
+  static inline V abs(V a) { return _mm512_abs_pd(a); }
+
+  static inline V floor(V a) {
+    return _mm512_roundscale_pd(a, _MM_FROUND_TO_NEG_INF | _MM_FROUND_NO_EXC);
+  }
+
+  // The sign of `sign` with the magnitude of `a`, which is not negative
+  static inline V copysign(V a, V sign) {
+    return _mm512_castsi512_pd(_mm512_or_si512(_mm512_castpd_si512(a),
+              _mm512_and_si512(_mm512_castpd_si512(sign),
+                               _mm512_set1_epi64(1LL << 63))));
+  }
+
+  // a < b ? x : y
+  static inline V select_lt(V a, V b, V x, V y) {
+    return _mm512_mask_blend_pd(_mm512_cmp_pd_mask(a, b, _CMP_LT_OQ), y, x);
+  }
+
+  // 2^n for an integral n in [-1022, 1023]. The integer n + 1023 is placed in
+  // the low bits of the mantissa by the addition and shifted to the exponent.
+  static inline V pow2(V n) {
+    V biased = _mm512_add_pd(n, _mm512_set1_pd(4503599627370496.0 + 1023));
+    return _mm512_castsi512_pd(_mm512_slli_epi64(
+              _mm512_castpd_si512(biased), 52));
+  }
+};
+
+// The float lanes of the same instruction set
+struct FlowSimdF {
+  typedef float T;
+  typedef __m512 V;
+  static constexpr uint32_t kLanes = 16;
+
+  static inline V load(const float* p) { return _mm512_load_ps(p); }
+  static inline void store(float* p, V a) { _mm512_store_ps(p, a); }
+  static inline V set1(float a) { return _mm512_set1_ps(a); }
+  static inline V add(V a, V b) { return _mm512_add_ps(a, b); }
+  static inline V mul(V a, V b) { return _mm512_mul_ps(a, b); }
+  static inline V div(V a, V b) { return _mm512_div_ps(a, b); }
+  static inline V fmadd(V a, V b, V c) { return _mm512_fmadd_ps(a, b, c); }
+  static inline V min(V a, V b) { return _mm512_min_ps(a, b); }
+  static inline V max(V a, V b) { return _mm512_max_ps(a, b); }
+  static inline V abs(V a) { return _mm512_abs_ps(a); }
+
+  static inline V select_lt(V a, V b, V x, V y) {
+    return _mm512_mask_blend_ps(_mm512_cmp_ps_mask(a, b, _CMP_LT_OQ), y, x);
+  }
+};
+#elif !defined(NFL_SCALAR_FLOW) && defined(__AVX2__) && defined(__FMA__)
+struct FlowSimd {
+  typedef double T;
+  typedef __m256d V;
+  static constexpr uint32_t kLanes = 4;
+
+  static inline V load(const double* p) { return _mm256_load_pd(p); }
+  static inline void store(double* p, V a) { _mm256_store_pd(p, a); }
+  static inline V set1(double a) { return _mm256_set1_pd(a); }
+  static inline V add(V a, V b) { return _mm256_add_pd(a, b); }
+  static inline V sub(V a, V b) { return _mm256_sub_pd(a, b); }
+  static inline V mul(V a, V b) { return _mm256_mul_pd(a, b); }
+  static inline V div(V a, V b) { return _mm256_div_pd(a, b); }
+  static inline V fmadd(V a, V b, V c) { return _mm256_fmadd_pd(a, b, c); }
+  static inline V min(V a, V b) { return _mm256_min_pd(a, b); }
+
+  static inline V abs(V a) {
+    return _mm256_and_pd(a, _mm256_castsi256_pd(
+                              _mm256_set1_epi64x(0x7fffffffffffffffLL)));
+  }
+
+  static inline V floor(V a) { return _mm256_floor_pd(a); }
+
+  static inline V copysign(V a, V sign) {
+    return _mm256_or_pd(a, _mm256_and_pd(sign, _mm256_set1_pd(-0.0)));
+  }
+
+  static inline V select_lt(V a, V b, V x, V y) {
+    return _mm256_blendv_pd(y, x, _mm256_cmp_pd(a, b, _CMP_LT_OQ));
+  }
+
+  static inline V pow2(V n) {
+    V biased = _mm256_add_pd(n, _mm256_set1_pd(4503599627370496.0 + 1023));
+    return _mm256_castsi256_pd(_mm256_slli_epi64(
+              _mm256_castpd_si256(biased), 52));
+  }
+};
+
+struct FlowSimdF {
+  typedef float T;
+  typedef __m256 V;
+  static constexpr uint32_t kLanes = 8;
+
+  static inline V load(const float* p) { return _mm256_load_ps(p); }
+  static inline void store(float* p, V a) { _mm256_store_ps(p, a); }
+  static inline V set1(float a) { return _mm256_set1_ps(a); }
+  static inline V add(V a, V b) { return _mm256_add_ps(a, b); }
+  static inline V mul(V a, V b) { return _mm256_mul_ps(a, b); }
+  static inline V div(V a, V b) { return _mm256_div_ps(a, b); }
+  static inline V fmadd(V a, V b, V c) { return _mm256_fmadd_ps(a, b, c); }
+  static inline V min(V a, V b) { return _mm256_min_ps(a, b); }
+  static inline V max(V a, V b) { return _mm256_max_ps(a, b); }
+
+  static inline V abs(V a) {
+    return _mm256_and_ps(a, _mm256_castsi256_ps(
+                              _mm256_set1_epi32(0x7fffffff)));
+  }
+
+  static inline V select_lt(V a, V b, V x, V y) {
+    return _mm256_blendv_ps(y, x, _mm256_cmp_ps(a, b, _CMP_LT_OQ));
+  }
+};
+#else
+typedef FlowScalar FlowSimd;
+typedef FlowScalarF FlowSimdF;
+#endif
+
+// tanh(x) within 3 ulp with one division, the most expensive operation of
+// the kernels. Small inputs use the rational approximation of Cephes, the
+// others (e - 1) / (e + 1) with e = exp(2|x|), where |x| is clamped at 20,
+// beyond which tanh rounds to 1. exp is the Pade approximation of Cephes,
+// 2^n (q + p) / (q - p), left as a fraction.
+template<typename S>
+inline typename std::enable_if<std::is_same<typename S::T, double>::value, 
+                               typename S::V>::type flow_tanh(typename S::V x) {
+  typedef typename S::V V;
+  V a = S::abs(x);
+  V y = S::mul(S::min(a, S::set1(20.)), S::set1(2.));
+  V n = S::floor(S::fmadd(y, S::set1(1.4426950408889634073599),
+                          S::set1(0.5)));
+  V r = S::fmadd(n, S::set1(-6.93145751953125E-1), y);
+  r = S::fmadd(n, S::set1(-1.42860682030941723212E-6), r);
+  V rr = S::mul(r, r);
+  V p = S::fmadd(rr, S::set1(1.26177193074810590878E-4),
+                    S::set1(3.02994407707441961300E-2));
+  p = S::mul(r, S::fmadd(rr, p, S::set1(9.99999999999999999910E-1)));
+  V q = S::fmadd(rr, S::set1(3.00198505138664455042E-6),
+                    S::set1(2.52448340349684104192E-3));
+  q = S::fmadd(rr, q, S::set1(2.27265548208155028766E-1));
+  q = S::fmadd(rr, q, S::set1(2.));
+  V e_num = S::mul(S::add(q, p), S::pow2(n));
+  V e_den = S::sub(q, p);
+  V large_num = S::copysign(S::sub(e_num, e_den), x);
+  V large_den = S::add(e_num, e_den);
+  // x + x z P(z) / Q(z), where the division is shared with the large inputs
+  V z = S::mul(x, x);
+  V sp = S::fmadd(z, S::set1(-9.64399179425052238628E-1),
+                     S::set1(-9.92877231001918586564E1));
+  sp = S::fmadd(z, sp, S::set1(-1.61468768441708447952E3));
+  V sq = S::add(z, S::set1(1.12811678491632931402E2));
+  sq = S::fmadd(z, sq, S::set1(2.23548839060100448583E3));
+  sq = S::fmadd(z, sq, S::set1(4.84406305325125486048E3));
+  V small = S::set1(0.625);
+  V base = S::select_lt(a, small, x, S::set1(0.));
+  V num = S::select_lt(a, small, S::mul(S::mul(x, z), sp), large_num);
+  V den = S::select_lt(a, small, sq, large_den);
+  return S::add(base, S::div(num, den));
+}
+
+// tanh(x) of floats within a few ulp, the rational approximation of Eigen
+// over x clamped at +-7.9, where tanh rounds to +-1
+template<typename S>
+inline typename std::enable_if<std::is_same<typename S::T, float>::value, 
+                               typename S::V>::type flow_tanh(typename S::V x) {
+  typedef typename S::V V;
+  V c = S::max(S::min(x, S::set1(7.90531110763549805f)),
+                  S::set1(-7.90531110763549805f));
+  V z = S::mul(c, c);
+  V p = S::fmadd(z, S::set1(-2.76076847742355e-16f),
+                    S::set1(2.00018790482477e-13f));
+  p = S::fmadd(z, p, S::set1(-8.60467152213735e-11f));
+  p = S::fmadd(z, p, S::set1(5.12229709037114e-08f));
+  p = S::fmadd(z, p, S::set1(1.48572235717979e-05f));
+  p = S::fmadd(z, p, S::set1(6.37261928875436e-04f));
+  p = S::fmadd(z, p, S::set1(4.89352455891786e-03f));
+  V q = S::fmadd(z, S::set1(1.19825839466702e-06f),
+                    S::set1(1.18534705686654e-04f));
+  q = S::fmadd(z, q, S::set1(2.26843463243900e-03f));
+  q = S::fmadd(z, q, S::set1(4.89352518554385e-03f));
+  V r = S::div(S::mul(c, p), q);
+  return S::select_lt(S::abs(x), S::set1(0.0004f), x, r);
+}
+
+// The hidden units of a flow whose shape is only known at run time
+const int kMaxFlowHiddenDim = 64;
+
+// Transform `size` keys in place with a flow of `num_layers` layers of
+// `weights`, laid out as for the row-major products of BNAF_Infer, and sum
+// the outputs of the last layer in order. The lanes of S are of doubles or
+// floats:
+// - doubles: `inputs` holds the keys, and their features are expanded in
+//   the registers as in BNAF_Infer.
+// - floats: `inputs` holds the `kIn` features of the keys, which are
+//   expanded beforehand in double precision, in planes of `stride` values.
+// The outputs replace the keys or the first plane. The values are read and
+// written in blocks of S::kLanes, so `inputs` must be aligned and padded to
+// a multiple of that. `kIn` and `kHidden` are the dimensions of the flow,
+// fixed at compile time, or 0 for `hidden_dim` at run time.
+template<typename S, int kIn, int kHidden>
+void flow_forward(typename S::T* inputs, uint32_t stride, uint32_t size, 
+                  int hidden_dim, int num_layers, 
+                  typename S::T* const* weights) {
+  typedef typename S::T T;
+  typedef typename S::V V;
+  static_assert(kIn == 1 || kIn == 2 || kIn == 4, "Unsupported dimensions");
+  const int kH = kHidden > 0 ? kHidden : kMaxFlowHiddenDim;
+  const int hidden = kHidden > 0 ? kHidden : hidden_dim;
+  for (uint32_t i = 0; i < size; i += S::kLanes) {
+    V f[kIn];
+    f[0] = S::load(inputs + i);
+    if constexpr (!std::is_same<T, double>::value) {
+      for (int k = 1; k < kIn; ++ k) {
+        f[k] = S::load(inputs + k * stride + i);
+      }
+    } else if constexpr (kIn == 2) {
+      f[1] = S::sub(f[0], S::floor(f[0]));
+    } else if constexpr (kIn == 4) {
+      f[1] = S::floor(f[0]);
+      V t = S::mul(S::sub(f[0], f[1]), S::set1(1000000.));
+      f[2] = S::floor(t);
+      f[3] = S::sub(t, f[2]);
+    }
+    V h[kH];
+    V g[kH];
+    const T* w = weights[0];
+    for (int j = 0; j < hidden; ++ j) {
+      V acc = S::mul(f[0], S::set1(w[j]));
+      for (int k = 1; k < kIn; ++ k) {
+        acc = S::fmadd(f[k], S::set1(w[k * hidden + j]), acc);
+      }
+      h[j] = flow_tanh<S>(acc);
+    }
+    for (int l = 1; l < num_layers - 1; ++ l) {
+      w = weights[l];
+      for (int j = 0; j < hidden; ++ j) {
+        V acc = S::mul(h[0], S::set1(w[j]));
+        for (int k = 1; k < hidden; ++ k) {
+          acc = S::fmadd(h[k], S::set1(w[k * hidden + j]), acc);
+        }
+        g[j] = flow_tanh<S>(acc);
+      }
+      for (int j = 0; j < hidden; ++ j) {
+        h[j] = g[j];
+      }
+    }
+    w = weights[num_layers - 1];
+    V out;
+    for (int j = 0; j < kIn; ++ j) {
+      V acc = S::mul(h[0], S::set1(w[j]));
+      for (int k = 1; k < hidden; ++ k) {
+        acc = S::fmadd(h[k], S::set1(w[k * kIn + j]), acc);
+      }
+      out = j == 0 ? acc : S::add(out, acc);
+    }
+    S::store(inputs + i, out);
+  }
+}
+
+}
+
+#endif
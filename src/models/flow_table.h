@@ -0,0 +1,82 @@
+#ifndef FLOW_TABLE_H
+#define FLOW_TABLE_H
+
+#include "util/binary_io.h"
+#include "util/common.h"
+
+namespace nfl {
+
+// A piecewise linear approximation of the flow over the normalized keys in
+// [lo, hi], split into segments of equal width. A key is transformed with one
+// probe of the segment it falls in and an interpolation. Keys out of [lo, hi]
+// are extrapolated from the first or the last segment, so the approximation
+// is defined, and deterministic, for any key.
+class FlowTable {
+private:
+  double    lo_;
+  double    scale_;         // The segments per unit of normalized key
+  uint32_t  num_segments_;
+  double*   segments_;      // The value at the start and the slope (per
+                            // segment width) of each segment
+
+public:
+  // `values` holds the flow at the `num_segments` + 1 ends of the segments
+  FlowTable(double lo, double hi, uint32_t num_segments, const double* values)
+    : lo_(lo), scale_(num_segments / (hi - lo)), num_segments_(num_segments) {
+    segments_ = new double[2 * num_segments_];
+    for (uint32_t i = 0; i < num_segments_; ++ i) {
+      segments_[2 * i] = values[i];
+      segments_[2 * i + 1] = values[i + 1] - values[i];
+    }
+  }
+
+  // Restore the table written by `save`
+  explicit FlowTable(BinaryReader& in) {
+    lo_ = in.read<double>();
+    scale_ = in.read<double>();
+    num_segments_ = in.read<uint32_t>();
+    segments_ = new double[2 * num_segments_];
+    in.read_array(segments_, 2 * num_segments_);
+  }
+
+  ~FlowTable() {
+    delete[] segments_;
+  }
+
+  void save(BinaryWriter& out) const {
+    out.write(lo_);
+    out.write(scale_);
+    out.write(num_segments_);
+    out.write_array(segments_, 2 * num_segments_);
+  }
+
+  uint32_t num_segments() const { return num_segments_; }
+
+  uint64_t size() const {
+    return sizeof(FlowTable) + sizeof(double) * 2 * num_segments_;
+  }
+
+  // The most that the table falls below its value at a smaller key in 
+  // [lo, hi], which is at the ends of the segments as they are linear
+  double max_inversion() const {
+    double inversion = 0;
+    double top = segments_[0];
+    for (uint32_t i = 0; i < num_segments_; ++ i) {
+      double end = segments_[2 * i] + segments_[2 * i + 1];
+      inversion = std::max(inversion, top - end);
+      top = std::max(top, end);
+    }
+    return inversion;
+  }
+
+  inline double transform(double x) const {
+    double pos = (x - lo_) * scale_;
+    uint32_t i = static_cast<uint32_t>(std::min(std::max(0., pos),
+                                                num_segments_ - 1.));
+    return segments_[2 * i] + (pos - i) * segments_[2 * i + 1];
+  }
+};
+
+}
+
+#endif
@@ -5,77 +5,123 @@
 
 namespace nfl {
 
+// The distance from `base` to `key` as a double. Integer keys are subtracted
+// exactly before the conversion, so large keys that are close to each other
+// (e.g. 64-bit keys above 2^53) keep their distinct offsets.
+template<typename KT>
+inline double key_offset(KT key, KT base) {
+  if constexpr (std::numeric_limits<KT>::is_integer) {
+    typedef typename std::make_unsigned<KT>::type UKT;
+    return key < base ? -static_cast<double>(static_cast<UKT>(base) 
+                                            - static_cast<UKT>(key))
+                      : static_cast<double>(static_cast<UKT>(key) 
+                                            - static_cast<UKT>(base));
+  } else {
+    return static_cast<double>(key) - static_cast<double>(base);
+  }
+}
+
+// The model is centered at `base_`, usually the smallest key of the node, so
+// it predicts from the offsets of the keys rather than the keys themselves.
 template<class KT>
 class LinearModel {
  public:
   double slope_;
   double intercept_;
+  KT base_;
 
-  LinearModel() : slope_(0), intercept_(0) { }
+  LinearModel() : slope_(0), intercept_(0), base_() { }
 
   inline int64_t predict(KT key) const {
-    return static_cast<int64_t>(std::floor(slope_ * key + intercept_));
+    return static_cast<int64_t>(std::floor(predict_double(key)));
   }
 
   inline double predict_double(KT key) const {
-    return slope_ * static_cast<double>(key) + intercept_;
+    return slope_ * key_offset(key, base_) + intercept_;
   }
 };
 
+// Fits a line to points by least squares. The points are accumulated by their
+// means and their sums of squares and products about the means (Welford), 
+// rather than by raw sums. The slope then keeps its precision when the x 
+// values are large and close together, where n * sum(xx) - sum(x)^2 is the 
+// difference of two nearly equal numbers. Builders are merged exactly, so a 
+// fit over chunks matches a fit of all the points up to rounding.
 template<class KT>
 class LinearModelBuilder {
  public:
-  int count_;
-  double x_sum_;
-  double y_sum_;
-  double xx_sum_;
-  double xy_sum_;
+  uint64_t count_;
+  double x_mean_;
+  double y_mean_;
+  double xx_dev_;     // The sum of (x - x_mean_)^2
+  double xy_dev_;     // The sum of (x - x_mean_) * (y - y_mean_)
   KT x_min_;
   KT x_max_;
   double y_min_;
   double y_max_;
 
-  LinearModelBuilder() : count_(0), x_sum_(0), y_sum_(0), xx_sum_(0), xy_sum_(0), 
-                      x_min_(std::numeric_limits<KT>::max()), 
+  LinearModelBuilder() : count_(0), x_mean_(0), y_mean_(0), xx_dev_(0), 
+                      xy_dev_(0), x_min_(std::numeric_limits<KT>::max()), 
                       x_max_(std::numeric_limits<KT>::lowest()),
                       y_min_(std::numeric_limits<double>::max()), 
                       y_max_(std::numeric_limits<double>::lowest()) { }
 
   inline void add(KT x, double y) {
     count_++;
-    x_sum_ += static_cast<double>(x);
-    y_sum_ += static_cast<double>(y);
-    xx_sum_ += static_cast<double>(x) * x;
-    xy_sum_ += static_cast<double>(x) * y;
+    double dx = static_cast<double>(x) - x_mean_;
+    double dy = y - y_mean_;
+    double inv_count = 1. / count_;
+    x_mean_ += dx * inv_count;
+    y_mean_ += dy * inv_count;
+    // dx is taken about the old mean and the deviation of y about the new
+    xx_dev_ += dx * (static_cast<double>(x) - x_mean_);
+    xy_dev_ += dx * (y - y_mean_);
     x_min_ = std::min(x, x_min_);
     x_max_ = std::max(x, x_max_);
     y_min_ = std::min(y, y_min_);
     y_max_ = std::max(y, y_max_);
   }
 
-  // TODO: the calculated slope or intercept is too small or too large, the 
-  // precision is lost.
-  void build(LinearModel<KT> *lrm) {
+  // Add the points of another builder, e.g. one that fitted another chunk of
+  // the input in parallel
+  inline void merge(const LinearModelBuilder<KT>& other) {
+    if (other.count_ == 0) {
+      return;
+    }
+    uint64_t count = count_ + other.count_;
+    double dx = other.x_mean_ - x_mean_;
+    double dy = other.y_mean_ - y_mean_;
+    double weight = static_cast<double>(count_) * other.count_ / count;
+    xx_dev_ += other.xx_dev_ + dx * dx * weight;
+    xy_dev_ += other.xy_dev_ + dx * dy * weight;
+    x_mean_ += dx * other.count_ / count;
+    y_mean_ += dy * other.count_ / count;
+    count_ = count;
+    x_min_ = std::min(other.x_min_, x_min_);
+    x_max_ = std::max(other.x_max_, x_max_);
+    y_min_ = std::min(other.y_min_, y_min_);
+    y_max_ = std::max(other.y_max_, y_max_);
+  }
+
+  // The points are fitted as given, so a builder of key offsets fills a model
+  // of any key type whose base is set by the caller.
+  template<class MT>
+  void build(LinearModel<MT> *lrm) {
     if (count_ <= 1) {
       lrm->slope_ = 0;
-      lrm->intercept_ = static_cast<double>(y_sum_);
+      lrm->intercept_ = y_mean_;
       return;
     }
 
-    if (static_cast<double>(count_) * xx_sum_ - x_sum_ * x_sum_ == 0) {
+    if (xx_dev_ <= 0) {
       // all values in a bucket have the same key.
       lrm->slope_ = 0;
-      lrm->intercept_ = static_cast<double>(y_sum_) / count_;
+      lrm->intercept_ = y_mean_;
       return;
     }
 
-    auto slope = static_cast<double>(
-        (static_cast<double>(count_) * xy_sum_ - x_sum_ * y_sum_) /
-        (static_cast<double>(count_) * xx_sum_ - x_sum_ * x_sum_));
-    auto intercept = static_cast<double>(
-        (y_sum_ - static_cast<double>(slope) * x_sum_) / count_);
-    lrm->slope_ = slope;
-    lrm->intercept_ = intercept;
+    lrm->slope_ = xy_dev_ / xx_dev_;
+    lrm->intercept_ = y_mean_ - lrm->slope_ * x_mean_;
 
     // If floating point precision errors, fit spline
     if (lrm->slope_ <= 0) {
@@ -2,6 +2,8 @@
 #define NUMERICAL_FLOW_H
 
 #include "models/bnaf.h"
+#include "models/flow_table.h"
+#include "util/binary_io.h"
 #include "util/common.h"
 
 namespace nfl {
@@ -9,48 +11,247 @@ namespace nfl {
 template<typename KT, typename VT>
 class NumericalFlow {
 typedef std::pair<KT, VT> KVT;
-typedef std::pair<KT, KVT> KKVT;
+typedef std::pair<double, KVT> KKVT;
 public:
   double mean_;
   double var_;
-  MKL_INT batch_size_;
+  FlowInt batch_size_;
   BNAF_Infer<KT, VT> model_;
+  BNAF_Infer<KT, VT, float>* float_model_;  // The flow in float, which is used
+                                            // instead of model_ if it is set
+  FlowTable* table_;                        // The approximation of the flow,
+                                            // used instead of both if it is set
 
 public:
   explicit NumericalFlow(std::string weight_path, uint32_t batch_size) 
-    : batch_size_(batch_size) {
+    : batch_size_(batch_size), float_model_(nullptr), table_(nullptr) {
     load(weight_path);
     model_.set_batch_size(batch_size);
   }
 
+  // Restore the flow written by `save`
+  explicit NumericalFlow(BinaryReader& in, uint32_t batch_size) 
+    : batch_size_(batch_size), float_model_(nullptr), table_(nullptr) {
+    mean_ = in.read<double>();
+    var_ = in.read<double>();
+    model_.in_dim_ = in.read<FlowInt>();
+    model_.hidden_dim_ = in.read<FlowInt>();
+    model_.num_layers_ = in.read<int>();
+    model_.weights_ = new double*[model_.num_layers_];
+    for (int w = 0; w < model_.num_layers_; ++ w) {
+      uint32_t n, m;
+      layer_shape(w, n, m);
+      model_.weights_[w] = flow_alloc<double>(n * m);
+      in.read_array(model_.weights_[w], n * m);
+    }
+    model_.set_batch_size(batch_size);
+  }
+
+  void save(BinaryWriter& out) {
+    out.write(mean_);
+    out.write(var_);
+    out.write(model_.in_dim_);
+    out.write(model_.hidden_dim_);
+    out.write(model_.num_layers_);
+    for (int w = 0; w < model_.num_layers_; ++ w) {
+      uint32_t n, m;
+      layer_shape(w, n, m);
+      out.write_array(model_.weights_[w], n * m);
+    }
+  }
+
+  ~NumericalFlow() {
+    if (float_model_ != nullptr) {
+      delete float_model_;
+    }
+    if (table_ != nullptr) {
+      delete table_;
+    }
+  }
+
   uint64_t size() {
-    return sizeof(NumericalFlow<KT, VT>) - sizeof(BNAF_Infer<KT, VT>) + model_.size();
+    return sizeof(NumericalFlow<KT, VT>) - sizeof(BNAF_Infer<KT, VT>) + model_.size()
+          + (float_model_ != nullptr ? float_model_->size() : 0)
+          + (table_ != nullptr ? table_->size() : 0);
   }
 
   void set_batch_size(uint32_t batch_size) {
     batch_size_ = batch_size;
     model_.set_batch_size(batch_size_);
+    if (float_model_ != nullptr) {
+      float_model_->set_batch_size(batch_size_);
+    }
   }
 
-  void transform(const KVT* kvs, uint32_t size, KKVT* tran_kvs) {
-    for (uint32_t i = 0; i < size; ++ i) {
-      tran_kvs[i] = {(kvs[i].first - mean_) / var_, kvs[i]};
+  bool use_float() { return float_model_ != nullptr; }
+
+  // Compute the flow in float, with the weights rounded to float, or in 
+  // double. The features of the keys and the transformed keys stay doubles.
+  void set_float(bool use_float) {
+    if (use_float == (float_model_ != nullptr)) {
+      return;
+    } else if (!use_float) {
+      delete float_model_;
+      float_model_ = nullptr;
+      return;
+    }
+    float_model_ = new BNAF_Infer<KT, VT, float>();
+    float_model_->in_dim_ = model_.in_dim_;
+    float_model_->hidden_dim_ = model_.hidden_dim_;
+    float_model_->num_layers_ = model_.num_layers_;
+    float_model_->weights_ = new float*[model_.num_layers_];
+    for (int w = 0; w < model_.num_layers_; ++ w) {
+      uint32_t n, m;
+      layer_shape(w, n, m);
+      float_model_->weights_[w] = flow_alloc<float>(n * m);
+      for (uint32_t i = 0; i < n * m; ++ i) {
+        float_model_->weights_[w][i] = model_.weights_[w][i];
+      }
+    }
+    float_model_->set_batch_size(batch_size_);
+  }
+
+  const FlowTable* table() { return table_; }
+
+  // Replace the flow with a table of `num_segments` segments over the keys in
+  // [lo, hi], sampled from the flow in its current precision
+  void compile(KT lo, KT hi, uint32_t num_segments) {
+    decompile();
+    double x_lo = normalize(lo);
+    double x_hi = normalize(hi);
+    assert_p(x_lo < x_hi, "The keys of the flow table span no range");
+    KKVT* ends = new KKVT[num_segments + 1];
+    for (uint32_t i = 0; i <= num_segments; ++ i) {
+      ends[i].first = x_lo + (x_hi - x_lo) * i / num_segments;
+    }
+    for (uint32_t l = 0; l <= num_segments; l += batch_size_) {
+      transform_batch(ends + l, std::min<uint32_t>(batch_size_, 
+                                                    num_segments + 1 - l));
+    }
+    double* values = new double[num_segments + 1];
+    for (uint32_t i = 0; i <= num_segments; ++ i) {
+      values[i] = ends[i].first;
+    }
+    table_ = new FlowTable(x_lo, x_hi, num_segments, values);
+    delete[] values;
+    delete[] ends;
+  }
+
+  void decompile() {
+    if (table_ != nullptr) {
+      delete table_;
+      table_ = nullptr;
     }
+  }
+
+  // Restore the table written by FlowTable::save
+  void load_table(BinaryReader& in) {
+    if (table_ != nullptr) {
+      delete table_;
+    }
+    table_ = new FlowTable(in);
+  }
+
+  void transform(const KVT* kvs, uint32_t size, KKVT* tran_kvs) {
     uint32_t num_batches = static_cast<uint32_t>(std::ceil(size * 1. / batch_size_));
     for (uint32_t i = 0; i < num_batches; ++ i) {
-      uint32_t l = i * batch_size_;
-      uint32_t r = std::min((i + 1) * batch_size_, size);
-      model_.transform(tran_kvs + l, r - l);
+      transform_range(kvs, i * batch_size_, 
+                      std::min((i + 1) * batch_size_, size), tran_kvs, 
+                      &model_, float_model_);
+    }
+  }
+
+  // Transform the keys as `transform` does, in the same batches, which are
+  // spread over the threads. Each thread has its own buffers and shares the
+  // weights.
+  void transform_parallel(const KVT* kvs, uint32_t size, KKVT* tran_kvs) {
+    uint32_t num_batches = static_cast<uint32_t>(std::ceil(size * 1. / batch_size_));
+    if (num_batches <= 1) {
+      transform(kvs, size, tran_kvs);
+      return;
+    }
+#pragma omp parallel
+    {
+      BNAF_Infer<KT, VT>* model = nullptr;
+      BNAF_Infer<KT, VT, float>* float_model = nullptr;
+      if (table_ != nullptr) {
+        // The table needs no buffers
+      } else if (float_model_ != nullptr) {
+        float_model = new BNAF_Infer<KT, VT, float>(*float_model_, 
+                                                    batch_size_);
+      } else {
+        model = new BNAF_Infer<KT, VT>(model_, batch_size_);
+      }
+#pragma omp for schedule(static)
+      for (uint32_t i = 0; i < num_batches; ++ i) {
+        transform_range(kvs, i * batch_size_, 
+                        std::min((i + 1) * batch_size_, size), tran_kvs, 
+                        model, float_model);
+      }
+      if (model != nullptr) {
+        delete model;
+      }
+      if (float_model != nullptr) {
+        delete float_model;
+      }
     }
   }
 
+  // One key, without the batch buffers of the flow. The key is transformed
+  // to the same value as in a batch.
   KKVT transform(const KVT kv) {
-    KKVT t_kv = {(kv.first - mean_) / var_, kv};
-    model_.transform(&t_kv, 1);
-    return t_kv;
+    double x = normalize(kv.first);
+    if (table_ != nullptr) {
+      return {table_->transform(x), kv};
+    } else if (float_model_ != nullptr) {
+      return {float_model_->transform_key(x), kv};
+    } else {
+      return {model_.transform_key(x), kv};
+    }
   }
 
 private:
+  double normalize(KT key) {
+    return (static_cast<double>(key) - mean_) / var_;
+  }
+
+  // Transform kvs[l, r) with the table if it is set, and with `float_model`
+  // if it is not null or `model` otherwise, which are the flows of the 
+  // calling thread
+  void transform_range(const KVT* kvs, uint32_t l, uint32_t r, 
+                        KKVT* tran_kvs, BNAF_Infer<KT, VT>* model, 
+                        BNAF_Infer<KT, VT, float>* float_model) {
+    if (table_ != nullptr) {
+      for (uint32_t i = l; i < r; ++ i) {
+        tran_kvs[i] = {table_->transform(normalize(kvs[i].first)), kvs[i]};
+      }
+      return;
+    }
+    for (uint32_t i = l; i < r; ++ i) {
+      tran_kvs[i] = {normalize(kvs[i].first), kvs[i]};
+    }
+    if (float_model != nullptr) {
+      float_model->transform(tran_kvs + l, r - l);
+    } else {
+      model->transform(tran_kvs + l, r - l);
+    }
+  }
+
+  void transform_batch(KKVT* tran_kvs, uint32_t size) {
+    if (float_model_ != nullptr) {
+      float_model_->transform(tran_kvs, size);
+    } else {
+      model_.transform(tran_kvs, size);
+    }
+  }
+
+  // The first layer maps the inputs to the hidden units and the last one maps
+  // them back
+  void layer_shape(int w, uint32_t& n, uint32_t& m) {
+    n = w == 0 ? model_.in_dim_ : model_.hidden_dim_;
+    m = w + 1 == model_.num_layers_ ? model_.in_dim_ : model_.hidden_dim_;
+  }
+
   void load(std::string path) {
     std::fstream in(path, std::ios::in);
     if (!in.is_open()) {
@@ -63,7 +264,7 @@ private:
     for (uint32_t w = 0; w < model_.num_layers_; ++ w) {
       uint32_t n, m;
       in >> n >> m;
-      model_.weights_[w] = (double*)mkl_calloc(n * m, sizeof(double), 64);
+      model_.weights_[w] = flow_alloc<double>(n * m);
       for (uint32_t i = 0; i < n; ++ i) {
         for (uint32_t j = 0; j < m; ++ j) {
           in >> model_.weights_[w][i * m + j];
@@ -1,18 +1,71 @@
 #ifndef NFL_H
 #define NFL_H
 
+#include <condition_variable>
+#include <thread>
+
 #include "afli/afli.h"
 #include "afli/iterator.h"
+#include "afli/range_iterator.h"
 #include "benchmark/workload.h"
 #include "models/numerical_flow.h"
 #include "util/common.h"
+#include "util/parallel_sort.h"
 
 namespace nfl {
 
+// Iterator over the original key-value pairs. Without the flow, it walks the
+// index in key order. With the flow, it walks the transformed index, whose
+// values are the original pairs, in the order of the transformed keys, which
+// is off the key order by up to NFL::max_inversion.
+template<typename KT, typename VT>
+class NFLIterator {
+typedef std::pair<KT, VT> KVT;
+private:
+  bool enable_flow_;
+  RangeIterator<KT, VT> it_;
+  RangeIterator<double, KVT> tran_it_;
+
+public:
+  explicit NFLIterator(const RangeIterator<KT, VT>& it) 
+    : enable_flow_(false), it_(it) { }
+
+  explicit NFLIterator(const RangeIterator<double, KVT>& tran_it) 
+    : enable_flow_(true), tran_it_(tran_it) { }
+
+  bool is_end() { return enable_flow_ ? tran_it_.is_end() : it_.is_end(); }
+
+  KT key() { return enable_flow_ ? tran_it_.value_addr()->first : it_.key(); }
+
+  // The transformed key, if the flow is enabled
+  double tran_key() { return tran_it_.key(); }
+
+  VT value() { return *value_addr(); }
+
+  VT* value_addr() { 
+    return enable_flow_ ? &tran_it_.value_addr()->second : it_.value_addr(); 
+  }
+
+  KVT kv() { return enable_flow_ ? *tran_it_.value_addr() : it_.kv(); }
+
+  void next() {
+    if (enable_flow_) {
+      tran_it_.next();
+    } else {
+      it_.next();
+    }
+  }
+
+  NFLIterator<KT, VT>& operator++() {
+    next();
+    return *this;
+  }
+};
+
 template<typename KT, typename VT>
 class NFL {
 typedef std::pair<KT, VT> KVT;
-typedef std::pair<KT, KVT> KKVT;
+typedef std::pair<double, KVT> KKVT;
 private:
   AFLI<KT, VT>* index_;
   uint32_t batch_size_;
@@ -20,15 +73,74 @@ private:
 
   bool enable_flow_;
   NumericalFlow<KT, VT>* flow_;
-  AFLI<KT, KVT>* tran_index_;
+  AFLI<double, KVT>* tran_index_;  // Indexes the transformed keys, which are
+                                   // doubles for any key type
   KKVT* tran_kvs_;
+  GrowthPolicy growth_;
+  bool float_flow_;           // Try the flow in float in auto_switch
+  double float_tolerance_;
+  bool compiled_flow_;        // Try a table of the flow in auto_switch
+  double compiled_tolerance_;
+  bool ordered_flow_;         // Keep only a flow that keeps the keys in order
+  // The most that the transformed key of a pair falls below that of a 
+  // smaller key. It is measured on the bulk loaded keys, and bounded for the
+  // inserted keys out of their range by the ranges of the transformed keys, 
+  // see bound_inversions.
+  double max_inversion_;
+  KT min_load_key_;           // The range of the bulk loaded keys
+  KT max_load_key_;
+  KT min_key_;                // The range of all the keys
+  KT max_key_;
+  double min_tran_key_;       // The range of all the transformed keys
+  double max_tran_key_;
+  double lower_max_tran_key_; // The largest transformed key of the keys 
+                              // below min_load_key_
+  double upper_min_tran_key_; // The smallest transformed key of the keys 
+                              // above max_load_key_
+
+  // The pipeline of the batches, see start_pipeline. The helper thread 
+  // transforms the next batch into the back buffer of tran_kvs_ or 
+  // batch_kvs_, which next_batch swaps with the front one.
+  std::thread* pipeline_;
+  std::mutex pipeline_mutex_;
+  std::condition_variable pipeline_cv_;
+  const KVT* next_kvs_;       // The batch to transform, or null
+  uint32_t next_size_;
+  bool next_ready_;           // The back buffer holds the transformed batch
+  bool pipeline_stop_;
+  uint64_t next_time_;        // Nanoseconds of the transform of the batch
+  KKVT* next_tran_kvs_;
+  KVT* next_batch_kvs_;
 
   const float kConflictsDecay = 0.1;
   const uint32_t kMaxBatchSize = 4196;
   const float kSizeAmplification = 1.5;
   const float kTailPercent = 0.99;
+  // The approximations of the flow are checked on kFloatCheckWindows windows
+  // of at most kFloatCheckWindowSize consecutive keys
+  const uint32_t kFloatCheckWindows = 16;
+  const uint32_t kFloatCheckWindowSize = 4096;
+  // The tables of the flow that are tried, growing by 4 times
+  const uint32_t kMinFlowTableSize = 1 << 12;
+  const uint32_t kMaxFlowTableSize = 1 << 18;
+  // The inversions of an ordered flow, relative to the range of the 
+  // transformed keys, that are left to the numerical errors
+  const double kMaxOrderedInversion = 1e-9;
+
+  static constexpr uint32_t kSnapshotMagic = 0x004c464e;  // "NFL"
+  // Version 2 adds the precision of the flow, version 3 its table, version 4
+  // its inversions and version 5 the range of the keys they cover
+  static constexpr uint32_t kSnapshotVersion = 5;
 public:
-  explicit NFL(std::string weights_path, uint32_t batch_size) : batch_size_(batch_size) { 
+  explicit NFL(std::string weights_path, uint32_t batch_size) 
+    : batch_size_(batch_size), float_flow_(false), float_tolerance_(0),
+      compiled_flow_(false), compiled_tolerance_(0), ordered_flow_(true),
+      max_inversion_(0), min_load_key_(), max_load_key_(), min_key_(), 
+      max_key_(), min_tran_key_(0), max_tran_key_(0), 
+      lower_max_tran_key_(-std::numeric_limits<double>::infinity()),
+      upper_min_tran_key_(std::numeric_limits<double>::infinity()),
+      pipeline_(nullptr), next_tran_kvs_(nullptr),
+      next_batch_kvs_(nullptr) { 
     enable_flow_ = true;
     flow_ = new NumericalFlow<KT, VT>(weights_path, batch_size);
     index_ = nullptr;
@@ -37,7 +149,26 @@ public:
     batch_kvs_ = nullptr;
   }
 
+  // An empty NFL to be restored from a snapshot by `load`
+  explicit NFL(uint32_t batch_size) 
+    : batch_size_(batch_size), float_flow_(false), float_tolerance_(0),
+      compiled_flow_(false), compiled_tolerance_(0), ordered_flow_(true),
+      max_inversion_(0), min_load_key_(), max_load_key_(), min_key_(), 
+      max_key_(), min_tran_key_(0), max_tran_key_(0), 
+      lower_max_tran_key_(-std::numeric_limits<double>::infinity()),
+      upper_min_tran_key_(std::numeric_limits<double>::infinity()),
+      pipeline_(nullptr), next_tran_kvs_(nullptr),
+      next_batch_kvs_(nullptr) {
+    enable_flow_ = false;
+    flow_ = nullptr;
+    index_ = nullptr;
+    tran_index_ = nullptr;
+    tran_kvs_ = nullptr;
+    batch_kvs_ = nullptr;
+  }
+
   ~NFL() {
+    stop_pipeline();
     if (index_ != nullptr) {
       delete index_;
     }
@@ -56,6 +187,8 @@ public:
   }
 
   void set_batch_size(uint32_t batch_size) {
+    assert_p(pipeline_ == nullptr, 
+              "The batch size is set with the pipeline stopped");
     if (batch_size > batch_size_) {
       if (enable_flow_) {
         delete[] tran_kvs_;
@@ -68,18 +201,74 @@ public:
     batch_size_ = batch_size;
   }
 
+  // The policy of growing the nodes of the index with insertions
+  void set_growth_policy(const GrowthPolicy& growth) {
+    growth_ = growth;
+    if (index_ != nullptr) {
+      index_->set_growth_policy(growth_);
+    }
+    if (tran_index_ != nullptr) {
+      tran_index_->set_growth_policy(growth_);
+    }
+  }
+
+  // Let auto_switch compute the flow in float if the tail conflicts of the
+  // keys transformed in float exceed those in double by at most `tolerance`
+  // of them
+  void set_float_flow(bool float_flow, double tolerance=0.1) {
+    float_flow_ = float_flow;
+    float_tolerance_ = tolerance;
+  }
+
+  // Let auto_switch replace the flow with the smallest table (see FlowTable)
+  // whose tail conflicts exceed those of the flow by at most `tolerance` of
+  // them
+  void set_compiled_flow(bool compiled_flow, double tolerance=0) {
+    compiled_flow_ = compiled_flow;
+    compiled_tolerance_ = tolerance;
+  }
+
+  // Let auto_switch keep the flow only if it swaps the keys by no more than
+  // its numerical errors. The features of the flow wrap at the steps of the
+  // normalized key, so that lower_bound and scan otherwise walk most of the 
+  // transformed keys. It is on by default; turn it off only if the NFL
+  // serves no range requests.
+  void set_ordered_flow(bool ordered_flow) {
+    ordered_flow_ = ordered_flow;
+  }
+
+  // The most that the transformed key of a pair falls below that of a
+  // smaller key
+  double max_inversion() const {
+    return max_inversion_;
+  }
+
   uint32_t auto_switch(const KVT* kvs, uint32_t size, uint32_t aggregate_size=0) {
     tran_kvs_ = new KKVT[size];
     uint32_t origin_tail_conflicts = compute_tail_conflicts<KT, VT>(kvs, size, kSizeAmplification, kTailPercent);
     flow_->set_batch_size(kMaxBatchSize);
-    flow_->transform(kvs, size, tran_kvs_);
-    std::sort(tran_kvs_, tran_kvs_ + size, [](const KKVT& a, const KKVT& b) {
-      return a.first < b.first;
-    });
-    uint32_t tran_tail_conflicts = compute_tail_conflicts<KT, KVT>(tran_kvs_, size, kSizeAmplification, kTailPercent);
+    if (float_flow_) {
+      uint64_t reference = window_conflicts(kvs, size);
+      flow_->set_float(true);
+      flow_->set_float(within_tolerance(window_conflicts(kvs, size), 
+                                        reference, float_tolerance_));
+    }
+    max_inversion_ = transform_sorted(kvs, size, tran_kvs_);
+    if (flow_->use_float() && has_equal_keys(tran_kvs_, size)) {
+      // The float flow merges keys that the index cannot tell apart
+      flow_->set_float(false);
+      max_inversion_ = transform_sorted(kvs, size, tran_kvs_);
+    }
+    uint32_t tran_tail_conflicts = compute_tail_conflicts<double, KVT>(tran_kvs_, size, kSizeAmplification, kTailPercent);
+    if (compiled_flow_) {
+      tran_tail_conflicts = compile_flow(kvs, size, tran_tail_conflicts);
+    }
+    double tran_range = tran_kvs_[size - 1].first - tran_kvs_[0].first;
     if (origin_tail_conflicts <= tran_tail_conflicts
       || origin_tail_conflicts - tran_tail_conflicts 
-        < static_cast<uint32_t>(origin_tail_conflicts * kConflictsDecay)) {
+        < static_cast<uint32_t>(origin_tail_conflicts * kConflictsDecay)
+      || (ordered_flow_ 
+          && max_inversion_ > kMaxOrderedInversion * tran_range)) {
       enable_flow_ = false;
       delete[] tran_kvs_;
       tran_kvs_ = nullptr;
@@ -92,18 +281,101 @@ public:
 
   void bulk_load(const KVT* kvs, uint32_t size, uint32_t tail_conflicts, uint32_t aggregate_size=0) {
     if (enable_flow_) {
-      tran_index_ = new AFLI<KT, KVT>();
+      tran_index_ = new AFLI<double, KVT>();
+      tran_index_->set_growth_policy(growth_);
       tran_index_->bulk_load(tran_kvs_, size, tail_conflicts, aggregate_size);
+      min_load_key_ = min_key_ = kvs[0].first;
+      max_load_key_ = max_key_ = kvs[size - 1].first;
+      min_tran_key_ = tran_kvs_[0].first;
+      max_tran_key_ = tran_kvs_[size - 1].first;
+      lower_max_tran_key_ = -std::numeric_limits<double>::infinity();
+      upper_min_tran_key_ = std::numeric_limits<double>::infinity();
       flow_->set_batch_size(batch_size_);
-      delete tran_kvs_;
+      delete[] tran_kvs_;
       tran_kvs_ = new KKVT[batch_size_];
     } else {
       index_ = new AFLI<KT, VT>();
+      index_->set_growth_policy(growth_);
       index_->bulk_load(kvs, size, tail_conflicts, aggregate_size);
       batch_kvs_ = new KVT[batch_size_];      
     }
   }
 
+  // Write the bulk loaded NFL to a snapshot file: the choice of auto_switch, 
+  // the flow if it is enabled, and the index
+  void save(const std::string& path) {
+    BinaryWriter out(path);
+    out.write(kSnapshotMagic);
+    out.write(kSnapshotVersion);
+    out.write<uint8_t>(enable_flow_);
+    if (enable_flow_) {
+      out.write<uint8_t>(flow_->use_float());
+      flow_->save(out);
+      out.write<uint8_t>(flow_->table() != nullptr);
+      if (flow_->table() != nullptr) {
+        flow_->table()->save(out);
+      }
+      out.write(max_inversion_);
+      out.write(min_load_key_);
+      out.write(max_load_key_);
+      out.write(min_key_);
+      out.write(max_key_);
+      out.write(min_tran_key_);
+      out.write(max_tran_key_);
+      out.write(lower_max_tran_key_);
+      out.write(upper_min_tran_key_);
+      tran_index_->save(out);
+    } else {
+      index_->save(out);
+    }
+  }
+
+  // Restore an NFL created with NFL(batch_size) from a snapshot written by 
+  // `save`. It replaces both auto_switch and bulk_load.
+  void load(const std::string& path) {
+    assert_p(index_ == nullptr && tran_index_ == nullptr, 
+              "The index must be empty before loading");
+    BinaryReader in(path);
+    assert_p(in.read<uint32_t>() == kSnapshotMagic, "Not an NFL snapshot");
+    uint32_t version = in.read<uint32_t>();
+    assert_p(version >= 1 && version <= kSnapshotVersion, 
+              "Unsupported NFL snapshot version");
+    enable_flow_ = in.read<uint8_t>();
+    if (enable_flow_) {
+      bool use_float = version > 1 && in.read<uint8_t>();
+      delete flow_;
+      flow_ = new NumericalFlow<KT, VT>(in, batch_size_);
+      flow_->set_float(use_float);
+      if (version > 2 && in.read<uint8_t>()) {
+        flow_->load_table(in);
+      }
+      // The older snapshots leave the scans to walk all the keys, as the 
+      // inversions of the inserted keys cannot be bounded without the ranges
+      max_inversion_ = std::numeric_limits<double>::infinity();
+      double inversion = version > 3 ? in.read<double>() : max_inversion_;
+      if (version > 4) {
+        max_inversion_ = inversion;
+        min_load_key_ = in.read<KT>();
+        max_load_key_ = in.read<KT>();
+        min_key_ = in.read<KT>();
+        max_key_ = in.read<KT>();
+        min_tran_key_ = in.read<double>();
+        max_tran_key_ = in.read<double>();
+        lower_max_tran_key_ = in.read<double>();
+        upper_min_tran_key_ = in.read<double>();
+      }
+      tran_index_ = new AFLI<double, KVT>();
+      tran_index_->set_growth_policy(growth_);
+      tran_index_->load(in);
+      tran_kvs_ = new KKVT[batch_size_];
+    } else {
+      index_ = new AFLI<KT, VT>();
+      index_->set_growth_policy(growth_);
+      index_->load(in);
+      batch_kvs_ = new KVT[batch_size_];
+    }
+  }
+
   void transform(const KVT* kvs, uint32_t size) {
     if (enable_flow_) {
       flow_->transform(kvs, size, tran_kvs_);
@@ -112,22 +384,223 @@ public:
     }
   }
 
+  // Transform the batches on a helper thread, so that the transform of the
+  // next batch overlaps the requests of the current one:
+  //   transform_async(batch 0)
+  //   for each batch i:
+  //     next_batch()                   // batch i is the current batch
+  //     transform_async(batch i + 1)
+  //     the requests of batch i by their index in the batch
+  // The flow and its buffers belong to the helper thread while a batch is
+  // pending, so only the requests by index in the batch may run meanwhile;
+  // the requests by key and the range requests transform their keys.
+  void start_pipeline() {
+    assert_p(pipeline_ == nullptr, "The pipeline is already started");
+    if (enable_flow_) {
+      next_tran_kvs_ = new KKVT[batch_size_];
+    } else {
+      next_batch_kvs_ = new KVT[batch_size_];
+    }
+    next_kvs_ = nullptr;
+    next_ready_ = false;
+    pipeline_stop_ = false;
+    pipeline_ = new std::thread([this] { run_pipeline(); });
+  }
+
+  void stop_pipeline() {
+    if (pipeline_ == nullptr) {
+      return;
+    }
+    {
+      std::lock_guard<std::mutex> lock(pipeline_mutex_);
+      pipeline_stop_ = true;
+    }
+    pipeline_cv_.notify_all();
+    pipeline_->join();
+    delete pipeline_;
+    pipeline_ = nullptr;
+    if (next_tran_kvs_ != nullptr) {
+      delete[] next_tran_kvs_;
+      next_tran_kvs_ = nullptr;
+    }
+    if (next_batch_kvs_ != nullptr) {
+      delete[] next_batch_kvs_;
+      next_batch_kvs_ = nullptr;
+    }
+  }
+
+  // Start transforming the batch of `size` pairs of `kvs`, which stay valid
+  // until next_batch returns. At most one batch is pending.
+  void transform_async(const KVT* kvs, uint32_t size) {
+    assert_p(size <= batch_size_, "The batch is larger than the batch size");
+    {
+      std::lock_guard<std::mutex> lock(pipeline_mutex_);
+      assert_p(next_kvs_ == nullptr && !next_ready_, 
+                "A batch is already pending");
+      next_kvs_ = kvs;
+      next_size_ = size;
+    }
+    pipeline_cv_.notify_all();
+  }
+
+  // Wait for the pending batch and make it the current batch of the requests
+  // by index. Return the nanoseconds that the helper thread spent on its 
+  // transform.
+  uint64_t next_batch() {
+    std::unique_lock<std::mutex> lock(pipeline_mutex_);
+    pipeline_cv_.wait(lock, [this] { return next_ready_; });
+    next_ready_ = false;
+    std::swap(tran_kvs_, next_tran_kvs_);
+    std::swap(batch_kvs_, next_batch_kvs_);
+    return next_time_;
+  }
+
   ResultIterator<KT, VT> find(uint32_t idx_in_batch) {
     if (enable_flow_) {
-      auto it = tran_index_->find(tran_kvs_[idx_in_batch].first);
-      if (!it.is_end()) {
-        return {it.value_addr()};
-      } else {
-        return {};
-      }
+      const KKVT& tran_kv = tran_kvs_[idx_in_batch];
+      return find_transformed(tran_kv.first, tran_kv.second.first);
     } else {
       return index_->find(batch_kvs_[idx_in_batch].first);
     }
   }
 
+  // The requests of single keys, which are transformed one by one rather 
+  // than staged in a batch by `transform`. The batch overloads take the 
+  // index in the batch, so the keys are found and removed by name, as a key
+  // may be of the same type as the index.
+  ResultIterator<KT, VT> find_key(KT key) {
+    if (enable_flow_) {
+      assert_p(pipeline_ == nullptr || !batch_pending(), 
+                "The flow is transforming the next batch");
+      double tran_key = flow_->transform(KVT(key, VT())).first;
+      return find_transformed(tran_key, key);
+    } else {
+      return index_->find(key);
+    }
+  }
+
+  bool update(const KVT& kv) {
+    if (enable_flow_) {
+      assert_p(pipeline_ == nullptr || !batch_pending(), 
+                "The flow is transforming the next batch");
+      return update_pair(flow_->transform(kv).first, kv);
+    } else {
+      return index_->update(kv);
+    }
+  }
+
+  uint32_t remove_key(KT key) {
+    if (enable_flow_) {
+      assert_p(pipeline_ == nullptr || !batch_pending(), 
+                "The flow is transforming the next batch");
+      return remove_pair(flow_->transform(KVT(key, VT())).first, key);
+    } else {
+      return index_->remove(key);
+    }
+  }
+
+  void insert(const KVT& kv) {
+    if (enable_flow_) {
+      assert_p(pipeline_ == nullptr || !batch_pending(), 
+                "The flow is transforming the next batch");
+      KKVT tran_kv = flow_->transform(kv);
+      bound_inversions(tran_kv);
+      tran_index_->insert(tran_kv);
+    } else {
+      index_->insert(kv);
+    }
+  }
+
+  // Iterator at the first pair, see NFLIterator for the order of the pairs
+  NFLIterator<KT, VT> begin() {
+    if (enable_flow_) {
+      return NFLIterator<KT, VT>(tran_index_->begin());
+    } else {
+      return NFLIterator<KT, VT>(index_->begin());
+    }
+  }
+
+  // Iterator at the first key that is not less than `key`. If the flow is 
+  // enabled, the pairs that follow are in the order of the transformed keys,
+  // see NFLIterator.
+  NFLIterator<KT, VT> lower_bound(KT key) {
+    if (enable_flow_) {
+      assert_p(pipeline_ == nullptr || !batch_pending(), 
+                "The flow is transforming the next batch");
+      // The keys from `key` on are transformed to at least tran_key minus
+      // the inversions, and those below the first of them to at most its
+      // transformed key plus the inversions
+      double tran_key = flow_->transform(KVT(key, VT())).first;
+      NFLIterator<KT, VT> it(tran_index_->lower_bound(tran_key 
+                                                      - max_inversion_));
+      NFLIterator<KT, VT> first = it;
+      bool found = false;
+      double bound = 0;
+      for (; !it.is_end() && (!found || it.tran_key() <= bound); it.next()) {
+        if (!(it.key() < key) && (!found || it.key() < first.key())) {
+          first = it;
+          found = true;
+          bound = it.tran_key() + max_inversion_;
+        }
+      }
+      return found ? first : it;
+    } else {
+      return NFLIterator<KT, VT>(index_->lower_bound(key));
+    }
+  }
+
+  // Copy at most `limit` pairs with keys in [lo, hi] into `results` in key 
+  // order and return the number of copied pairs
+  uint32_t scan(KT lo, KT hi, uint32_t limit, KVT* results) {
+    uint32_t num = 0;
+    if (!enable_flow_) {
+      for (auto it = index_->lower_bound(lo); num < limit && !it.is_end() 
+            && !(hi < it.key()); it.next()) {
+        results[num ++] = it.kv();
+      }
+      return num;
+    }
+    if (limit == 0) {
+      return 0;
+    }
+    assert_p(pipeline_ == nullptr || !batch_pending(), 
+              "The flow is transforming the next batch");
+    // The pairs swapped by the numerical errors of the flow are at most 
+    // max_inversion_ apart in the transformed keys, so the keys in [lo, hi] 
+    // lie within it of the transformed bounds. Keep the `limit` smallest
+    // keys in a max-heap, and stop once the transformed keys pass by the
+    // inversions the last one pushed, which is not below that of the 
+    // largest key kept.
+    auto less = [](const KVT& a, const KVT& b) { return a.first < b.first; };
+    double tran_lo = flow_->transform(KVT(lo, VT())).first - max_inversion_;
+    double tran_hi = flow_->transform(KVT(hi, VT())).first + max_inversion_;
+    double last = 0;
+    for (NFLIterator<KT, VT> it(tran_index_->lower_bound(tran_lo)); 
+          !it.is_end() && it.tran_key() <= tran_hi; it.next()) {
+      if (num == limit && it.tran_key() > last + max_inversion_) {
+        break;
+      }
+      KT key = it.key();
+      if (key < lo || hi < key 
+          || (num == limit && !(key < results[0].first))) {
+        continue;
+      }
+      if (num == limit) {
+        std::pop_heap(results, results + num, less);
+        -- num;
+      }
+      results[num ++] = it.kv();
+      std::push_heap(results, results + num, less);
+      last = it.tran_key();
+    }
+    std::sort_heap(results, results + num, less);
+    return num;
+  }
+
   bool update(uint32_t idx_in_batch) {
     if (enable_flow_) {
-      return tran_index_->update(tran_kvs_[idx_in_batch]);
+      return update_pair(tran_kvs_[idx_in_batch].first, 
+                          tran_kvs_[idx_in_batch].second);
     } else {
       return index_->update(batch_kvs_[idx_in_batch]);
     }
@@ -135,7 +608,8 @@ public:
 
   uint32_t remove(uint32_t idx_in_batch) {
     if (enable_flow_) {
-      return tran_index_->remove(tran_kvs_[idx_in_batch].first);
+      const KKVT& tran_kv = tran_kvs_[idx_in_batch];
+      return remove_pair(tran_kv.first, tran_kv.second.first);
     } else {
       return index_->remove(batch_kvs_[idx_in_batch].first);
     }
@@ -143,12 +617,35 @@ public:
 
   void insert(uint32_t idx_in_batch) {
     if (enable_flow_) {
+      bound_inversions(tran_kvs_[idx_in_batch]);
       tran_index_->insert(tran_kvs_[idx_in_batch]);
     } else {
       index_->insert(batch_kvs_[idx_in_batch]);
     }
   }
 
+  // Insert the pairs [idx_in_batch, idx_in_batch + n) of the transformed 
+  // batch at once
+  void insert_batch(uint32_t idx_in_batch, uint32_t n) {
+    if (enable_flow_) {
+      for (uint32_t i = 0; i < n; ++ i) {
+        bound_inversions(tran_kvs_[idx_in_batch + i]);
+      }
+      tran_index_->insert_batch(tran_kvs_ + idx_in_batch, n);
+    } else {
+      index_->insert_batch(batch_kvs_ + idx_in_batch, n);
+    }
+  }
+
+  // Rebuild the degraded sub-trees of the index, see AFLI::retrain
+  uint64_t retrain(uint64_t max_pairs=std::numeric_limits<uint64_t>::max()) {
+    if (enable_flow_) {
+      return tran_index_->retrain(max_pairs);
+    } else {
+      return index_->retrain(max_pairs);
+    }
+  }
+
   uint64_t model_size() {
     if (enable_flow_) {
       return tran_index_->model_size() + flow_->size();
@@ -168,11 +665,272 @@ public:
 
   void print_stats() {
     if (enable_flow_) {
+      std::cout << "Flow Precision\t" 
+                << (flow_->use_float() ? "float" : "double") << std::endl;
+      if (flow_->table() != nullptr) {
+        std::cout << "Flow Table Segments\t" << flow_->table()->num_segments()
+                  << std::endl;
+      }
       tran_index_->print_stats();
     } else {
       index_->print_stats();
     }
   }
+
+private:
+  void run_pipeline() {
+    std::unique_lock<std::mutex> lock(pipeline_mutex_);
+    while (true) {
+      pipeline_cv_.wait(lock, [this] { 
+        return pipeline_stop_ || next_kvs_ != nullptr; 
+      });
+      if (pipeline_stop_) {
+        return;
+      }
+      lock.unlock();
+      auto start = std::chrono::high_resolution_clock::now();
+      if (enable_flow_) {
+        flow_->transform(next_kvs_, next_size_, next_tran_kvs_);
+      } else {
+        std::memcpy(next_batch_kvs_, next_kvs_, sizeof(KVT) * next_size_);
+      }
+      auto end = std::chrono::high_resolution_clock::now();
+      lock.lock();
+      next_time_ = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    end - start).count();
+      next_kvs_ = nullptr;
+      next_ready_ = true;
+      pipeline_cv_.notify_all();
+    }
+  }
+
+  bool batch_pending() {
+    std::lock_guard<std::mutex> lock(pipeline_mutex_);
+    return next_kvs_ != nullptr;
+  }
+
+  // The flow may transform another key to one that the index takes as equal
+  // to `tran_key`, so the original key of a hit is checked. Such keys are 
+  // stored in the slot of `tran_key`, and are walked in the rare case that 
+  // the hit is another key.
+  KVT* find_pair(double tran_key, KT key) {
+    auto it = tran_index_->find(tran_key);
+    if (it.is_end()) {
+      return nullptr;
+    }
+    if (compare(it.value_addr()->first, key)) {
+      return it.value_addr();
+    }
+    double eps = std::numeric_limits<double>::epsilon();
+    for (auto range = tran_index_->lower_bound(tran_key - eps); 
+          !range.is_end() && range.key() < tran_key + eps; range.next()) {
+      if (compare(range.value_addr()->first, key)) {
+        return range.value_addr();
+      }
+    }
+    return nullptr;
+  }
+
+  ResultIterator<KT, VT> find_transformed(double tran_key, KT key) {
+    KVT* kv = find_pair(tran_key, key);
+    if (kv != nullptr) {
+      return {&kv->first, &kv->second};
+    } else {
+      return {};
+    }
+  }
+
+  bool update_pair(double tran_key, const KVT& kv) {
+    KVT* stored_kv = find_pair(tran_key, kv.first);
+    if (stored_kv != nullptr) {
+      stored_kv->second = kv.second;
+    }
+    return stored_kv != nullptr;
+  }
+
+  // The index removes the first pair of the keys it takes as equal to 
+  // `tran_key`. If that is another key, the pairs of the equal keys in the 
+  // slot of `tran_key` are removed, and all but that of `key` inserted again
+  // with their stored transformed keys, as the flow may be busy with the next
+  // batch.
+  uint32_t remove_pair(double tran_key, KT key) {
+    auto it = tran_index_->find(tran_key);
+    if (it.is_end()) {
+      return 0;
+    }
+    if (compare(it.value_addr()->first, key)) {
+      return tran_index_->remove(tran_key);
+    }
+    std::vector<KKVT> others;
+    uint32_t res = 0;
+    for (; !it.is_end(); it = tran_index_->find(tran_key)) {
+      KKVT tran_kv = it.kv();
+      tran_index_->remove(tran_key);
+      if (res == 0 && compare(tran_kv.second.first, key)) {
+        res = 1;
+      } else {
+        others.push_back(tran_kv);
+      }
+    }
+    for (const KKVT& tran_kv : others) {
+      tran_index_->insert(tran_kv);
+    }
+    return res;
+  }
+
+  // Add the inversions of an inserted pair to max_inversion_. Between the 
+  // bulk loaded keys, the flow is taken to be sampled by them, as for the 
+  // bounds of lower_bound and scan. Out of their range, the features of the
+  // flow wrap at other steps, so the transformed key is compared with those 
+  // of all the keys on each side: at most max_tran_key_ below a key, and at 
+  // least min_tran_key_ above it. The keys out of the range on the other side
+  // of a bulk loaded key are bounded the same. The rounding that pads the 
+  // inversions grows with the transformed keys.
+  void bound_inversions(const KKVT& tran_kv) {
+    double tran_key = tran_kv.first;
+    KT key = tran_kv.second.first;
+    double inversion;
+    if (max_load_key_ < key) {
+      inversion = std::max(max_tran_key_ - tran_key, max_key_ < key ? 0 
+                            : tran_key - upper_min_tran_key_);
+      max_key_ = std::max(max_key_, key);
+      upper_min_tran_key_ = std::min(upper_min_tran_key_, tran_key);
+    } else if (key < min_load_key_) {
+      inversion = std::max(tran_key - min_tran_key_, key < min_key_ ? 0 
+                            : lower_max_tran_key_ - tran_key);
+      min_key_ = std::min(min_key_, key);
+      lower_max_tran_key_ = std::max(lower_max_tran_key_, tran_key);
+    } else {
+      inversion = std::max(tran_key - upper_min_tran_key_, 
+                            lower_max_tran_key_ - tran_key);
+    }
+    double rounding = 4 * std::numeric_limits<double>::epsilon();
+    double old_pad = rounding * std::max(std::abs(min_tran_key_), 
+                                          std::abs(max_tran_key_));
+    min_tran_key_ = std::min(min_tran_key_, tran_key);
+    max_tran_key_ = std::max(max_tran_key_, tran_key);
+    double pad = rounding * std::max(std::abs(min_tran_key_), 
+                                      std::abs(max_tran_key_));
+    if (inversion > max_inversion_ - old_pad || pad > old_pad) {
+      max_inversion_ = std::max(max_inversion_ - old_pad, inversion) + pad;
+    }
+  }
+
+  // Transform and sort the keys with all the threads. Return the most that 
+  // the transformed key of a pair falls below that of a smaller key, as the
+  // pairs are in key order before the sort, padded by the rounding of the 
+  // bounds that are shifted by it.
+  double transform_sorted(const KVT* kvs, uint32_t size, KKVT* tran_kvs) {
+    flow_->transform_parallel(kvs, size, tran_kvs);
+    double inversion = 0;
+    double top = -std::numeric_limits<double>::infinity();
+    double magnitude = 0;
+    for (uint32_t i = 0; i < size; ++ i) {
+      inversion = std::max(inversion, top - tran_kvs[i].first);
+      top = std::max(top, tran_kvs[i].first);
+      magnitude = std::max(magnitude, std::abs(tran_kvs[i].first));
+    }
+    inversion += 4 * std::numeric_limits<double>::epsilon() * magnitude;
+    if (flow_->table() != nullptr) {
+      inversion = std::max(inversion, flow_->table()->max_inversion());
+    }
+    parallel_sort(tran_kvs, size, [](const KKVT& a, const KKVT& b) {
+      return a.first < b.first;
+    });
+    return inversion;
+  }
+
+  // Whether the unique keys of the sorted `tran_kvs` are transformed to keys
+  // that the index takes as equal
+  static bool has_equal_keys(const KKVT* tran_kvs, uint32_t size) {
+    for (uint32_t i = 1; i < size; ++ i) {
+      if (compare(tran_kvs[i].first, tran_kvs[i - 1].first)) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // The tail conflicts of the keys transformed by the flow as it is set, 
+  // summed over windows of consecutive keys and over the keys strided across
+  // all of them, or the largest value if the flow merges keys. The windows 
+  // keep the density of the keys that the approximations of the flow have to
+  // resolve, and the strided keys their shape over the whole key range.
+  uint64_t window_conflicts(const KVT* kvs, uint32_t size) {
+    uint32_t window = std::min(size, kFloatCheckWindowSize);
+    uint32_t num_windows = std::min(kFloatCheckWindows, size / window);
+    uint32_t stride = size / window;
+    KKVT* sample = new KKVT[window];
+    KVT* strided = new KVT[window];
+    uint64_t conflicts = 0;
+    for (uint32_t w = 0; w <= num_windows; ++ w) {
+      if (w < num_windows) {
+        uint32_t lo = num_windows == 1 ? 0 
+                      : static_cast<uint64_t>(size - window) * w 
+                        / (num_windows - 1);
+        transform_sorted(kvs + lo, window, sample);
+      } else if (stride > 1) {
+        for (uint32_t i = 0; i < window; ++ i) {
+          strided[i] = kvs[static_cast<uint64_t>(i) * stride];
+        }
+        transform_sorted(strided, window, sample);
+      } else {
+        break;
+      }
+      if (has_equal_keys(sample, window)) {
+        conflicts = std::numeric_limits<uint64_t>::max();
+        break;
+      }
+      conflicts += compute_tail_conflicts<double, KVT>(sample, window, 
+                    kSizeAmplification, kTailPercent);
+    }
+    delete[] sample;
+    delete[] strided;
+    return conflicts;
+  }
+
+  static bool within_tolerance(uint64_t conflicts, uint64_t reference, 
+                                double tolerance) {
+    return conflicts != std::numeric_limits<uint64_t>::max()
+          && conflicts <= reference 
+                          + tolerance * std::max<uint64_t>(reference, 1);
+  }
+
+  // Set the smallest table of the flow whose tail conflicts are within the
+  // tolerance of `tail_conflicts`, those of the flow, and transform the keys
+  // into tran_kvs_ with it. The windows pick the first table to try, and the
+  // tables are then checked on all the keys, as the windows miss some of the
+  // error of the small tables. Return the tail conflicts of the keys in 
+  // tran_kvs_.
+  uint32_t compile_flow(const KVT* kvs, uint32_t size, 
+                        uint32_t tail_conflicts) {
+    if (compare(kvs[0].first, kvs[size - 1].first)) {
+      return tail_conflicts;
+    }
+    uint64_t reference = window_conflicts(kvs, size);
+    uint32_t n = kMinFlowTableSize;
+    for (; n < kMaxFlowTableSize; n *= 4) {
+      flow_->compile(kvs[0].first, kvs[size - 1].first, n);
+      if (within_tolerance(window_conflicts(kvs, size), reference, 
+                            compiled_tolerance_)) {
+        break;
+      }
+    }
+    for (; n <= kMaxFlowTableSize; n *= 4) {
+      flow_->compile(kvs[0].first, kvs[size - 1].first, n);
+      max_inversion_ = transform_sorted(kvs, size, tran_kvs_);
+      if (!has_equal_keys(tran_kvs_, size)) {
+        uint32_t conflicts = compute_tail_conflicts<double, KVT>(tran_kvs_, 
+                              size, kSizeAmplification, kTailPercent);
+        if (within_tolerance(conflicts, tail_conflicts, compiled_tolerance_)) {
+          return conflicts;
+        }
+      }
+    }
+    flow_->decompile();
+    max_inversion_ = transform_sorted(kvs, size, tran_kvs_);
+    return tail_conflicts;
+  }
 };
 
 }
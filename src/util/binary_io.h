@@ -0,0 +1,129 @@
+#ifndef BINARY_IO_H
+#define BINARY_IO_H
+
+#include <cstdio>
+#include <type_traits>
+
+#include "util/common.h"
+
+namespace nfl {
+
+// Values that are copied as raw bytes. std::pair of plain values is not 
+// trivially copyable because of its assignment operator, but its bytes are.
+template<typename T>
+constexpr bool is_plain() {
+  return std::is_trivially_copy_constructible<T>::value 
+        && std::is_trivially_destructible<T>::value;
+}
+
+// Buffered writer and reader of raw binary values, used by the snapshots of
+// the indexes. Values are stored in the byte order of the machine.
+class BinaryWriter {
+private:
+  static constexpr size_t kBufferSize = 4 << 20;
+
+  std::FILE*  file_;
+  char*       buffer_;
+  size_t      pos_;
+
+public:
+  explicit BinaryWriter(const std::string& path) : pos_(0) {
+    file_ = std::fopen(path.c_str(), "wb");
+    assert_p(file_ != nullptr, "Failed to open " + path + " for writing");
+    buffer_ = new char[kBufferSize];
+  }
+
+  ~BinaryWriter() {
+    flush();
+    std::fclose(file_);
+    delete[] buffer_;
+  }
+
+  template<typename T>
+  void write(const T& value) {
+    write_array(&value, 1);
+  }
+
+  template<typename T>
+  void write_array(const T* values, size_t n) {
+    static_assert(is_plain<T>(), "Only plain values can be written");
+    const char* data = reinterpret_cast<const char*>(values);
+    size_t bytes = sizeof(T) * n;
+    if (pos_ + bytes > kBufferSize) {
+      flush();
+      if (bytes > kBufferSize) {
+        assert_p(std::fwrite(data, 1, bytes, file_) == bytes,
+                  "Failed to write the snapshot");
+        return;
+      }
+    }
+    std::memcpy(buffer_ + pos_, data, bytes);
+    pos_ += bytes;
+  }
+
+  void flush() {
+    if (pos_ > 0) {
+      assert_p(std::fwrite(buffer_, 1, pos_, file_) == pos_,
+                "Failed to write the snapshot");
+      pos_ = 0;
+    }
+  }
+};
+
+class BinaryReader {
+private:
+  static constexpr size_t kBufferSize = 4 << 20;
+
+  std::FILE*  file_;
+  char*       buffer_;
+  size_t      pos_;
+  size_t      end_;
+
+public:
+  explicit BinaryReader(const std::string& path) : pos_(0), end_(0) {
+    file_ = std::fopen(path.c_str(), "rb");
+    assert_p(file_ != nullptr, "Failed to open " + path + " for reading");
+    buffer_ = new char[kBufferSize];
+  }
+
+  ~BinaryReader() {
+    std::fclose(file_);
+    delete[] buffer_;
+  }
+
+  template<typename T>
+  T read() {
+    T value;
+    read_array(&value, 1);
+    return value;
+  }
+
+  template<typename T>
+  void read_array(T* values, size_t n) {
+    static_assert(is_plain<T>(), "Only plain values can be read");
+    char* data = reinterpret_cast<char*>(values);
+    size_t bytes = sizeof(T) * n;
+    while (bytes > 0) {
+      if (pos_ == end_) {
+        if (bytes >= kBufferSize) {
+          // Read large arrays directly
+          assert_p(std::fread(data, 1, bytes, file_) == bytes,
+                    "The snapshot is truncated");
+          return;
+        }
+        end_ = std::fread(buffer_, 1, kBufferSize, file_);
+        pos_ = 0;
+        assert_p(end_ > 0, "The snapshot is truncated");
+      }
+      size_t num = std::min(bytes, end_ - pos_);
+      std::memcpy(data, buffer_ + pos_, num);
+      pos_ += num;
+      data += num;
+      bytes -= num;
+    }
+  }
+};
+
+}
+
+#endif
@@ -8,6 +8,7 @@
 #include <boost/optional.hpp>
 #include <cassert>
 #include <chrono>
+#include <cstddef>
 #include <cstdint>
 #include <cstring>
 #include <filesystem>
@@ -17,12 +18,14 @@
 #include <iostream>
 #include <limits>
 #include <map>
+#include <mutex>
 #include <pthread.h>
 #include <queue>
 #include <random>
 #include <set>
 #include <sstream>
 #include <string>
+#include <type_traits>
 #include <vector>
 
 const long long kSEED = 1e9 + 7;
@@ -53,7 +56,7 @@ inline void assert_p(bool condition, const std::string& error_msg) {
 
 template<typename T>
 inline bool compare(const T& a, const T& b) {
-  if (std::numeric_limits<T>::is_integer) {
+  if constexpr (std::numeric_limits<T>::is_integer) {
     return a == b;
   } else {
     return std::fabs(a - b) < std::numeric_limits<T>::epsilon();
@@ -174,12 +177,12 @@ struct TreeStat {
   uint32_t num_data_dense_ = 0;
   // Depth
   uint32_t num_leaf_nodes_ = 0;
-  uint32_t sum_depth_ = 0;
+  uint64_t sum_depth_ = 0;
   uint32_t max_depth_ = 0;
   // Size
   uint64_t model_size_ = 0;
   uint64_t index_size_ = 0;
-  // Conflicts
+  // Conflicts. Negative if they are not collected.
   double node_conflicts_ = 0;
 
   uint32_t num_data() {
@@ -208,33 +211,154 @@ struct TreeStat {
     std::cout << "Maximum Depth\t" << max_depth_ << std::endl;
     std::cout << "Model Size\t" << model_size_ << std::endl;
     std::cout << "Index Size\t" << index_size_ << std::endl;
-    std::cout << "Average conflicts per node\t" << node_conflicts_ / (num_model_nodes_ + num_dense_nodes_) << std::endl;
+    if (node_conflicts_ >= 0) {
+      std::cout << "Average conflicts per node\t" << node_conflicts_ / (num_model_nodes_ + num_dense_nodes_) << std::endl;
+    }
     std::cout << std::string(45, '#') << std::endl;
   }
 };
 
+// The shape of an index, kept up to date by the nodes as they are built, 
+// changed and released, so that reading it does not walk the tree. The 
+// counters may be read by another thread while the index serves requests. 
+// They are updated with atomic additions if the index is `shared_` by 
+// concurrent writers, and with plain relaxed stores otherwise.
+struct IndexStats {
+  enum NodeKind {
+    kModelNode = 0,
+    kBucketNode = 1,
+    kDenseNode = 2
+  };
+  enum DataLocation {
+    kModelSlot = 0,
+    kBucketSlot = 1,
+    kDenseSlot = 2
+  };
+  static constexpr uint32_t kMaxDepth = 64;   // Deeper levels are counted in
+                                              // the last one
+
+  bool shared_ = false;
+  int64_t num_nodes_[3] = {0, 0, 0};  // By NodeKind
+  int64_t num_data_[3] = {0, 0, 0};   // By DataLocation
+  int64_t model_size_ = 0;
+  int64_t index_size_ = 0;
+  int64_t nodes_at_depth_[kMaxDepth] = {};  // Model and dense nodes
+  int64_t data_at_depth_[kMaxDepth] = {};
+  int64_t sum_depth_ = 0;
+  int64_t deepest_ = 0;   // The deepest node ever counted
+
+  inline void add(int64_t& counter, int64_t delta) {
+    if (shared_) {
+      __atomic_fetch_add(&counter, delta, __ATOMIC_RELAXED);
+    } else {
+      __atomic_store_n(&counter, 
+                        __atomic_load_n(&counter, __ATOMIC_RELAXED) + delta, 
+                        __ATOMIC_RELAXED);
+    }
+  }
+
+  static inline int64_t get(const int64_t& counter) {
+    return __atomic_load_n(&counter, __ATOMIC_RELAXED);
+  }
+
+  // `n` pairs at `location` whose slots are at `depth`. The pairs of a bucket
+  // are one level below the node of the bucket.
+  inline void add_data(DataLocation location, uint32_t depth, int64_t n) {
+    add(num_data_[location], n);
+    add(data_at_depth_[std::min(depth, kMaxDepth - 1)], n);
+    add(sum_depth_, n * depth);
+  }
+
+  // `n` nodes of `kind` at `depth`. Buckets are not counted by depth.
+  inline void add_nodes(NodeKind kind, uint32_t depth, int64_t n, 
+                        int64_t model_bytes, int64_t index_bytes) {
+    add(num_nodes_[kind], n);
+    if (kind != kBucketNode) {
+      add(nodes_at_depth_[std::min(depth, kMaxDepth - 1)], n);
+      int64_t deepest = get(deepest_);
+      while (depth > deepest && !__atomic_compare_exchange_n(&deepest_, 
+              &deepest, depth, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) { }
+    }
+    add(model_size_, model_bytes);
+    add(index_size_, index_bytes);
+  }
+
+  void reset() {
+    *this = IndexStats();
+  }
+
+  // The counters in the layout of a tree walk. The conflicts are not kept. 
+  // The maximum depth beyond the histogram is the deepest one ever reached.
+  TreeStat snapshot() const {
+    TreeStat ts;
+    ts.num_model_nodes_ = get(num_nodes_[kModelNode]);
+    ts.num_buckets_ = get(num_nodes_[kBucketNode]);
+    ts.num_dense_nodes_ = get(num_nodes_[kDenseNode]);
+    ts.num_data_model_ = get(num_data_[kModelSlot]);
+    ts.num_data_bucket_ = get(num_data_[kBucketSlot]);
+    ts.num_data_dense_ = get(num_data_[kDenseSlot]);
+    ts.sum_depth_ = get(sum_depth_);
+    for (uint32_t d = 0; d < kMaxDepth; ++ d) {
+      if (get(nodes_at_depth_[d]) > 0) {
+        ts.max_depth_ = d;
+      }
+    }
+    if (ts.max_depth_ == kMaxDepth - 1) {
+      ts.max_depth_ = get(deepest_);
+    }
+    ts.model_size_ = get(model_size_);
+    ts.index_size_ = get(index_size_);
+    ts.node_conflicts_ = -1;
+    return ts;
+  }
+
+  // One line of tab-separated counters for periodic monitoring: the model
+  // nodes, buckets and dense nodes, the pairs in each of them, the model and
+  // index bytes, and the pairs at each depth from 1 to the deepest one, where
+  // the last column also counts the deeper pairs
+  void dump(std::ostream& out) const {
+    for (uint32_t t = 0; t < 3; ++ t) {
+      out << get(num_nodes_[t]) << "\t";
+    }
+    for (uint32_t l = 0; l < 3; ++ l) {
+      out << get(num_data_[l]) << "\t";
+    }
+    out << get(model_size_) << "\t" << get(index_size_);
+    uint32_t max_depth = 0;
+    for (uint32_t d = 0; d < kMaxDepth; ++ d) {
+      if (get(data_at_depth_[d]) != 0) {
+        max_depth = d;
+      }
+    }
+    for (uint32_t d = 1; d <= max_depth; ++ d) {
+      out << "\t" << get(data_at_depth_[d]);
+    }
+    out << std::endl;
+  }
+};
+
 struct RunStat {
   // # num_data
-  uint32_t num_data_ = 0;
+  uint64_t num_data_ = 0;
   // # requests
-  uint32_t num_queries_ = 0;
-  uint32_t num_inserts_ = 0;
-  uint32_t num_updates_ = 0;
-  uint32_t num_query_depth_ = 0;
-  uint32_t num_query_model_ = 0;
-  uint32_t num_query_bucket_ = 0;
-  uint32_t num_query_dense_ = 0;
-  uint32_t num_update_model_ = 0;
-  uint32_t num_update_bucket_ = 0;
-  uint32_t num_update_dense_ = 0;
-  uint32_t num_insert_model_ = 0;
-  uint32_t num_insert_bucket_ = 0;
-  uint32_t num_insert_dense_ = 0;
-  uint32_t num_predictions_ = 0;
-  uint32_t num_comparisons_ = 0;
+  uint64_t num_queries_ = 0;
+  uint64_t num_inserts_ = 0;
+  uint64_t num_updates_ = 0;
+  uint64_t num_query_depth_ = 0;
+  uint64_t num_query_model_ = 0;
+  uint64_t num_query_bucket_ = 0;
+  uint64_t num_query_dense_ = 0;
+  uint64_t num_update_model_ = 0;
+  uint64_t num_update_bucket_ = 0;
+  uint64_t num_update_dense_ = 0;
+  uint64_t num_insert_model_ = 0;
+  uint64_t num_insert_bucket_ = 0;
+  uint64_t num_insert_dense_ = 0;
+  uint64_t num_predictions_ = 0;
+  uint64_t num_comparisons_ = 0;
   // # internal operations
-  uint32_t num_rebuilds_ = 0;
-  uint32_t num_data_rebuild_ = 0;
+  uint64_t num_rebuilds_ = 0;
+  uint64_t num_data_rebuild_ = 0;
   // Internal statistics
   uint32_t bucket_threshold_ = 0;
   // Space statistics
@@ -245,10 +369,20 @@ struct RunStat {
   uint32_t sum_len_cont_conflicts_ = 0;
   uint32_t max_len_cont_conflicts_ = 0;
 
-  uint32_t num_requests() {
+  uint64_t num_requests() {
     return num_queries_ + num_inserts_ + num_updates_;
   }
 
+  // Add the request counters of `other` times `sign`. `other` may be counted
+  // by another thread at the same time.
+  void merge(const RunStat& other, int64_t sign=1) {
+    const uint64_t* src = &other.num_queries_;
+    uint64_t* dst = &num_queries_;
+    for (uint32_t i = 0; i < kNumCounters; ++ i) {
+      dst[i] += sign * __atomic_load_n(src + i, __ATOMIC_RELAXED);
+    }
+  }
+
   void show() {
     std::cout << std::string(10, '#') << "Running Statistics" 
               << std::string(10, '#') << std::endl;
@@ -274,6 +408,149 @@ struct RunStat {
               << std::endl;
     std::cout << std::string(38, '#') << std::endl;
   }
+
+  // The counters from num_queries_ to num_data_rebuild_
+  static constexpr uint32_t kNumCounters = 17;
+};
+
+// The request counters are merged as an array, and the counters of the 
+// locations of a request are indexed by IndexStats::DataLocation
+static_assert(offsetof(RunStat, num_data_rebuild_) 
+              - offsetof(RunStat, num_queries_) 
+              == (RunStat::kNumCounters - 1) * sizeof(uint64_t),
+              "The counters of RunStat must be contiguous");
+static_assert(offsetof(RunStat, num_query_dense_) 
+              - offsetof(RunStat, num_query_model_) 
+              == IndexStats::kDenseSlot * sizeof(uint64_t),
+              "The counters of RunStat must follow IndexStats::DataLocation");
+
+// Compile-time policies that count the operations of an index in a RunStat.
+// The nodes call the hooks of the policy, so that the hooks of NoRunStat
+// compile to nothing and the index pays nothing for them.
+struct NoRunStat {
+  static constexpr bool kEnabled = false;
+
+  static inline void request(OperationType op, uint32_t n=1) { }
+  static inline void reach(OperationType op, 
+                            IndexStats::DataLocation location, 
+                            uint32_t n=1) { }
+  static inline void visit(uint32_t num_nodes=1) { }
+  static inline void predict(uint32_t n=1) { }
+  static inline void compare(uint32_t n) { }
+  static inline void rebuild(uint32_t num_data) { }
+
+  static RunStat collect() { return RunStat(); }
+  static void reset() { }
+};
+
+// Each thread counts into a RunStat of its own without synchronization. The
+// counters of all the threads, including the exited ones, are summed on 
+// demand by collect(). The counters are shared by all the indexes of the 
+// policy, so reset() marks the start of a measurement.
+struct CountRunStat {
+  static constexpr bool kEnabled = true;
+
+  // `n` queries, updates or insertions from the user
+  static inline void request(OperationType op, uint32_t n=1) {
+    RunStat& rs = local();
+    switch (op) {
+      case kQuery: bump(rs.num_queries_, n); break;
+      case kUpdate: bump(rs.num_updates_, n); break;
+      case kInsert: bump(rs.num_inserts_, n); break;
+      default: break;
+    }
+  }
+
+  // `n` requests end at a slot of `location`
+  static inline void reach(OperationType op, 
+                            IndexStats::DataLocation location, 
+                            uint32_t n=1) {
+    RunStat& rs = local();
+    uint64_t* counters = op == kQuery ? &rs.num_query_model_ 
+                        : op == kUpdate ? &rs.num_update_model_ 
+                        : op == kInsert ? &rs.num_insert_model_ : nullptr;
+    if (counters != nullptr) {
+      bump(counters[location], n);
+    }
+  }
+
+  // A query goes through `num_nodes` nodes
+  static inline void visit(uint32_t num_nodes=1) {
+    bump(local().num_query_depth_, num_nodes);
+  }
+
+  static inline void predict(uint32_t n=1) {
+    bump(local().num_predictions_, n);
+  }
+
+  static inline void compare(uint32_t n) { bump(local().num_comparisons_, n); }
+
+  // A node or a bucket is rebuilt from `num_data` pairs
+  static inline void rebuild(uint32_t num_data) {
+    RunStat& rs = local();
+    bump(rs.num_rebuilds_);
+    bump(rs.num_data_rebuild_, num_data);
+  }
+
+  static RunStat collect() {
+    Registry& registry = get_registry();
+    std::lock_guard<std::mutex> guard(registry.mutex_);
+    RunStat rs = registry.exited_;
+    for (RunStat* thread_rs : registry.threads_) {
+      rs.merge(*thread_rs);
+    }
+    rs.merge(registry.base_, -1);
+    return rs;
+  }
+
+  static void reset() {
+    RunStat rs = collect();
+    Registry& registry = get_registry();
+    std::lock_guard<std::mutex> guard(registry.mutex_);
+    registry.base_.merge(rs);
+  }
+
+private:
+  struct Registry {
+    std::mutex            mutex_;
+    std::vector<RunStat*> threads_;
+    RunStat               exited_;  // The counters of the exited threads
+    RunStat               base_;    // The counters at the last reset
+  };
+
+  // Registers the counters of a thread while the thread runs
+  struct ThreadStat {
+    RunStat stat_;
+
+    ThreadStat() {
+      Registry& registry = get_registry();
+      std::lock_guard<std::mutex> guard(registry.mutex_);
+      registry.threads_.push_back(&stat_);
+    }
+
+    ~ThreadStat() {
+      Registry& registry = get_registry();
+      std::lock_guard<std::mutex> guard(registry.mutex_);
+      registry.exited_.merge(stat_);
+      registry.threads_.erase(std::find(registry.threads_.begin(), 
+                                        registry.threads_.end(), &stat_));
+    }
+  };
+
+  static Registry& get_registry() {
+    static Registry registry;
+    return registry;
+  }
+
+  static inline RunStat& local() {
+    thread_local ThreadStat thread_stat;
+    return thread_stat.stat_;
+  }
+
+  // Only the owner writes the counter, but collect() may read it
+  static inline void bump(uint64_t& counter, uint64_t n=1) {
+    __atomic_store_n(&counter, counter + n, __ATOMIC_RELAXED);
+  }
 };
 
 struct ExperimentalResults {
@@ -282,6 +559,11 @@ struct ExperimentalResults {
   double bulk_load_index_time = 0;
   double sum_transform_time = 0;
   double sum_indexing_time = 0;
+  // With the pipeline of NFL, the transform time is the wait for the helper
+  // thread, and the overlap is the time of its transforms hidden behind the
+  // indexing
+  bool pipelined = false;
+  double sum_overlap_time = 0;
   uint32_t num_requests = 0;
   uint64_t model_size = 0;
   uint64_t index_size = 0;
@@ -336,6 +618,10 @@ struct ExperimentalResults {
                 << "Throughput (Overall)\t" << num_ops * 1e3 / sum_time << " (million ops/sec)" << std::endl 
                 << "Average Transform Latency\t" << sum_transform_time / num_ops << " (ns)" << std::endl
                 << "Average Indexing Latency\t" << sum_indexing_time / num_ops << " (ns)" << std::endl;
+      if (pipelined) {
+        std::cout << "Average Overlapped Transform Latency\t" 
+                  << sum_overlap_time / num_ops << " (ns)" << std::endl;
+      }
       for (uint32_t i = 0; i < tail_percent.size(); ++ i) {
         uint32_t idx = std::max(0, static_cast<int>(latencies.size() * tail_percent[i]) - 1);
         std::pair<double, double> tail_latency = latencies[idx];
@@ -352,7 +638,11 @@ struct ExperimentalResults {
                 << index_size << "\t"
                 << num_ops * 1e3 / sum_time << std::endl
                 << sum_transform_time / num_ops << "\t"
-                << sum_indexing_time / num_ops << std::endl;
+                << sum_indexing_time / num_ops;
+      if (pipelined) {
+        std::cout << "\t" << sum_overlap_time / num_ops;
+      }
+      std::cout << std::endl;
       for (uint32_t i = 0; i < tail_percent.size(); ++ i) {
         uint32_t idx = std::max(0, static_cast<int>(latencies.size() * tail_percent[i]) - 1);
         std::pair<double, double> tail_latency = latencies[idx];
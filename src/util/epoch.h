@@ -0,0 +1,148 @@
+#ifndef EPOCH_H
+#define EPOCH_H
+
+#include <atomic>
+#include <mutex>
+
+#include "util/common.h"
+
+namespace nfl {
+
+// Epoch-based reclamation. A thread enters the current epoch before touching
+// shared nodes and leaves it afterwards. Unlinked objects are retired with the
+// epoch at which they were unlinked, and are freed only when every thread that
+// is still inside an epoch has entered after that.
+class EpochManager {
+private:
+  struct Retired {
+    void*     ptr_;
+    void      (*deleter_)(void*);
+    uint64_t  epoch_;
+  };
+
+  struct alignas(64) ThreadState {
+    std::atomic<uint64_t> epoch_;   // 0 if the thread is outside any epoch
+    std::vector<Retired>  retired_;
+
+    ThreadState() : epoch_(0) { }
+  };
+
+  struct ThreadSlot {
+    uint32_t id_;
+
+    ThreadSlot() {
+      std::lock_guard<std::mutex> guard(slot_mutex());
+      std::vector<uint32_t>& free_slots = free_slot_list();
+      if (free_slots.empty()) {
+        id_ = num_slots()++;
+        assert_p(id_ < kMaxThreads, "Too many threads for the epoch manager");
+      } else {
+        id_ = free_slots.back();
+        free_slots.pop_back();
+      }
+    }
+
+    ~ThreadSlot() {
+      std::lock_guard<std::mutex> guard(slot_mutex());
+      free_slot_list().push_back(id_);
+    }
+  };
+
+  std::atomic<uint64_t> global_epoch_;
+  ThreadState*          threads_;
+
+  static std::mutex& slot_mutex() {
+    static std::mutex mutex;
+    return mutex;
+  }
+
+  static std::vector<uint32_t>& free_slot_list() {
+    static std::vector<uint32_t> free_slots;
+    return free_slots;
+  }
+
+  static uint32_t& num_slots() {
+    static uint32_t num = 0;
+    return num;
+  }
+
+public:
+  static constexpr uint32_t kMaxThreads = 256;
+  static constexpr uint32_t kReclaimThreshold = 128;
+
+  EpochManager() : global_epoch_(1) {
+    threads_ = new ThreadState[kMaxThreads];
+  }
+
+  ~EpochManager() {
+    for (uint32_t i = 0; i < kMaxThreads; ++ i) {
+      for (const Retired& r : threads_[i].retired_) {
+        r.deleter_(r.ptr_);
+      }
+    }
+    delete[] threads_;
+  }
+
+  // The slot of the calling thread. A slot is assigned on the first call of a 
+  // thread and given back when the thread exits.
+  static uint32_t thread_id() {
+    thread_local ThreadSlot slot;
+    return slot.id_;
+  }
+
+  void enter() {
+    threads_[thread_id()].epoch_.store(global_epoch_.load());
+  }
+
+  void exit() {
+    threads_[thread_id()].epoch_.store(0, std::memory_order_release);
+  }
+
+  template<typename T>
+  void retire(T* ptr) {
+    ThreadState& ts = threads_[thread_id()];
+    ts.retired_.push_back({ptr, [](void* p) { delete static_cast<T*>(p); },
+                          global_epoch_.load()});
+    if (ts.retired_.size() >= kReclaimThreshold) {
+      reclaim(ts);
+    }
+  }
+
+private:
+  void reclaim(ThreadState& ts) {
+    uint64_t min_epoch = global_epoch_.fetch_add(1) + 1;
+    for (uint32_t i = 0; i < kMaxThreads; ++ i) {
+      uint64_t e = threads_[i].epoch_.load();
+      if (e != 0) {
+        min_epoch = std::min(min_epoch, e);
+      }
+    }
+    uint32_t num_kept = 0;
+    for (uint32_t i = 0; i < ts.retired_.size(); ++ i) {
+      if (ts.retired_[i].epoch_ < min_epoch) {
+        ts.retired_[i].deleter_(ts.retired_[i].ptr_);
+      } else {
+        ts.retired_[num_kept ++] = ts.retired_[i];
+      }
+    }
+    ts.retired_.resize(num_kept);
+  }
+};
+
+class EpochGuard {
+private:
+  EpochManager& manager_;
+
+public:
+  explicit EpochGuard(EpochManager& manager) : manager_(manager) {
+    manager_.enter();
+  }
+
+  ~EpochGuard() {
+    manager_.exit();
+  }
+};
+
+}
+
+#endif
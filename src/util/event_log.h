@@ -0,0 +1,124 @@
+#ifndef EVENT_LOG_H
+#define EVENT_LOG_H
+
+#include <atomic>
+
+#include "util/common.h"
+
+namespace nfl {
+
+// The structural modifications of an index
+enum StructureEvent {
+  kBucketCreate = 0,    // A data slot becomes a bucket
+  kBucketSplit = 1,     // An overflowing bucket becomes a child node
+  kDenseRebuild = 2,    // A dense node is rebuilt or resized
+  kNodeExpand = 3,      // The slots of a model node are doubled
+  kNodeShrink = 4,      // An under-filled model node is rebuilt
+  kChildMerge = 5,      // A small child node is merged into its parent
+  kSubtreeRetrain = 6   // A degraded sub-tree is rebuilt with a fresh model
+};
+
+const uint32_t kNumStructureEvents = 7;
+
+const char* const kStructureEventNames[kNumStructureEvents] = {
+  "BucketCreate", "BucketSplit", "DenseRebuild",
+  "NodeExpand", "NodeShrink", "ChildMerge", "SubtreeRetrain"
+};
+
+struct EventRecord {
+  uint64_t  time_;        // Nanoseconds of EventLog::now()
+  uint32_t  depth_;       // The depth of the modified node
+  uint32_t  num_keys_;    // The pairs that the modification moves
+  uint16_t  thread_;      // EventLog::thread_id() of the recording thread
+  uint8_t   type_;        // StructureEvent
+};
+
+// Ring buffer of the latest structural modifications, recorded by any number
+// of threads. A writer claims a slot with one atomic increment and publishes
+// the record with the sequence number of the slot, so that a reader tells the
+// records that are being written or have been overwritten.
+class EventLog {
+private:
+  struct Slot {
+    std::atomic<uint64_t> seq_;   // The index of the record plus one
+    EventRecord           record_;
+  };
+
+  Slot*                 slots_;
+  uint64_t              mask_;
+  std::atomic<uint64_t> head_;    // The number of recorded events
+
+public:
+  // Keep the latest 2^`capacity_log` events
+  explicit EventLog(uint32_t capacity_log=16)
+    : mask_((1ULL << capacity_log) - 1), head_(0) {
+    slots_ = new Slot[mask_ + 1];
+    for (uint64_t i = 0; i <= mask_; ++ i) {
+      slots_[i].seq_.store(0, std::memory_order_relaxed);
+    }
+  }
+
+  ~EventLog() {
+    delete[] slots_;
+  }
+
+  static uint64_t now() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+  }
+
+  // A small id of the calling thread, to tell apart the events of concurrent
+  // requests
+  static uint16_t thread_id() {
+    static std::atomic<uint16_t> num_threads(0);
+    thread_local uint16_t id = num_threads.fetch_add(1);
+    return id;
+  }
+
+  uint64_t size() const {
+    return head_.load(std::memory_order_acquire);
+  }
+
+  void record(StructureEvent type, uint32_t depth, uint32_t num_keys) {
+    uint64_t idx = head_.fetch_add(1, std::memory_order_relaxed);
+    Slot& slot = slots_[idx & mask_];
+    slot.seq_.store(0, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    slot.record_ = {now(), depth, num_keys, thread_id(),
+                    static_cast<uint8_t>(type)};
+    slot.seq_.store(idx + 1, std::memory_order_release);
+  }
+
+  // Append the events from the `from`-th one on to `events` and return the
+  // index to read from next time. The reading stops at an event that is still
+  // being written. The events that have been overwritten are counted in 
+  // `num_lost`.
+  uint64_t read(uint64_t from, std::vector<EventRecord>& events,
+                uint64_t& num_lost) const {
+    uint64_t head = size();
+    if (head - from > mask_ + 1) {
+      num_lost += head - from - (mask_ + 1);
+      from = head - (mask_ + 1);
+    }
+    for (; from < head; ++ from) {
+      const Slot& slot = slots_[from & mask_];
+      uint64_t seq = slot.seq_.load(std::memory_order_acquire);
+      if (seq < from + 1) {
+        break;
+      }
+      EventRecord record = slot.record_;
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if (seq > from + 1 
+          || slot.seq_.load(std::memory_order_relaxed) != seq) {
+        num_lost ++;
+        continue;
+      }
+      events.push_back(record);
+    }
+    return from;
+  }
+};
+
+}
+
+#endif
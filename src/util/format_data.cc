@@ -30,15 +30,20 @@ T cut_key(T key, size_t len, bool verbose=false) {
   return ston<std::string, T>(key_cut_str);
 }
 
+// The keys are written as `P`. A key type other than float64 is appended to 
+// the output name, e.g. books-200M-uint64.bin.
 template<typename T, typename P>
-void format(std::string data_dir, std::string data_name, std::string suffix, int num_keys = 0) {
+void format(std::string data_dir, std::string data_name, std::string suffix, 
+            std::string key_type, int num_keys = 0) {
   std::string source_path = path_join(data_dir, data_name + suffix);
   for (int i = 0; i < data_name.size(); ++ i) {
     if (data_name[i] == '_') {
       data_name[i] = '-';
     }
   }
-  std::string output_path = path_join(data_dir, data_name + ".bin");
+  std::string output_path = path_join(data_dir, data_name 
+                            + (key_type == "float64" ? "" : "-" + key_type) 
+                            + ".bin");
   std::ifstream in(source_path, std::ios::binary | std::ios::in);
   if (!in.is_open()) {
     std::cout << "File [" << source_path << "] does not exist" << std::endl;
@@ -50,16 +55,21 @@ void format(std::string data_dir, std::string data_name, std::string suffix, int
   std::vector<T> origin_keys;
   std::vector<P> double_keys;
   if (num_keys == 0) {
-    in.read((char*)&num_keys, sizeof(T));
+    // SOSD files start with the number of keys in 64 bits
+    uint64_t num = 0;
+    in.read((char*)&num, sizeof(uint64_t));
+    num_keys = static_cast<int>(num);
   }
   std::cout << "[" << num_keys << "] keys found in " << data_name << std::endl;
   origin_keys.resize(num_keys);
   in.read((char*)origin_keys.data(), num_keys * sizeof(T));
   in.close();
 
-  if (sizeof(T) > sizeof(P) || (sizeof(T) == sizeof(P) && !std::numeric_limits<T>::is_signed)) {
+  // Integer keys that `P` cannot hold are cut to their last digits
+  if (std::numeric_limits<T>::is_integer && (sizeof(T) > sizeof(P) 
+      || (sizeof(T) == sizeof(P) && !std::numeric_limits<T>::is_signed 
+          && std::numeric_limits<P>::is_signed))) {
     std::cout << "Cut keys" << std::endl;
-    assert_p(std::numeric_limits<T>::is_integer, "Cannot cut the non-integer type");
     size_t key_len = std::numeric_limits<P>::digits10;
     for (int i = 0; i < origin_keys.size(); ++ i) {
       origin_keys[i] = cut_key<T>(origin_keys[i], key_len);
@@ -69,35 +79,63 @@ void format(std::string data_dir, std::string data_name, std::string suffix, int
 
   double_keys.reserve(num_keys);
   for (int i = 0; i < num_keys; ++ i) {
-    if (i == 0 || !compare<T>(origin_keys[i], origin_keys[i - 1])) {
-      double_keys.push_back(static_cast<P>(origin_keys[i]));
+    // Distinct keys may become equal when they are narrowed to `P`
+    P key = static_cast<P>(origin_keys[i]);
+    if (double_keys.empty() || !compare<P>(key, double_keys.back())) {
+      double_keys.push_back(key);
     }
   }
   int num_unique = double_keys.size();
   std::cout << "[" << num_unique << "] unique keys in " << data_name << std::endl;
   std::ofstream out(output_path, std::ios::binary | std::ios::out);
   out.write((char*)&num_unique, sizeof(int));
-  out.write((char*)double_keys.data(), num_keys * sizeof(P));
+  out.write((char*)double_keys.data(), num_unique * sizeof(P));
   out.close();
 }
 
+template<typename T>
+void format_as(std::string data_dir, std::string data_name, std::string suffix, 
+                std::string key_type, int num_keys = 0) {
+  if (key_type == "float64") {
+    format<T, double>(data_dir, data_name, suffix, key_type, num_keys);
+  } else if (key_type == "float32") {
+    format<T, float>(data_dir, data_name, suffix, key_type, num_keys);
+  } else if (key_type == "uint64") {
+    format<T, uint64_t>(data_dir, data_name, suffix, key_type, num_keys);
+  } else if (key_type == "int64") {
+    format<T, int64_t>(data_dir, data_name, suffix, key_type, num_keys);
+  } else if (key_type == "uint32") {
+    format<T, uint32_t>(data_dir, data_name, suffix, key_type, num_keys);
+  } else {
+    std::cout << "Unspported key type [" << key_type << "]" << std::endl;
+    exit(-1);
+  }
+}
+
 int main(int argc, char* argv[]) {
   if (argc < 4) {
       std::cout << "No enough parameters for formatting workloads\n"
-                << "Please input: format (base path) (workload) (data type)" << std::endl;
+                << "Please input: format (base path) (workload) (data type) "
+                << "[key type, float64 by default]" << std::endl;
       exit(-1);
   }
   std::string base_dir = std::string(argv[1]);
   std::string data_name = std::string(argv[2]);
   std::string data_type = std::string(argv[3]);
+  std::string key_type = argc > 4 ? std::string(argv[4]) : "float64";
+  std::string data_dir = path_join(base_dir, "data");
   if (data_type == "uint64") {
-    format<uint64_t, double>(path_join(base_dir, "data"), data_name, std::string("_") + data_type);
+    format_as<uint64_t>(data_dir, data_name, std::string("_") + data_type, 
+                        key_type);
+  } else if (data_type == "uint32") {
+    format_as<uint32_t>(data_dir, data_name, std::string("_") + data_type, 
+                        key_type);
   } else if (data_type == "float64") {
     int num_keys = get_num_keys(data_name);
-    format<double, double>(path_join(base_dir, "data"), data_name, ".bin.data", num_keys);
+    format_as<double>(data_dir, data_name, ".bin.data", key_type, num_keys);
   } else if (data_type == "int64") {
     int num_keys = get_num_keys(data_name);
-    format<long long, double>(path_join(base_dir, "data"), data_name, ".bin.data", num_keys);
+    format_as<long long>(data_dir, data_name, ".bin.data", key_type, num_keys);
   } else {
     std::cout << "Unspported data type [" << data_type << "]" << std::endl;
     exit(-1);
@@ -0,0 +1,187 @@
+#ifndef KEY_SEARCH_H
+#define KEY_SEARCH_H
+
+#if !defined(NFL_SCALAR_SEARCH) && (defined(__AVX2__) || defined(__AVX512F__))
+#include <immintrin.h>
+#endif
+
+#include "util/common.h"
+
+namespace nfl {
+
+// Key search kernels over arrays of keys that are stored apart from the
+// values. The kernel is selected at build time: AVX-512 or AVX2 if the target
+// supports it, and a scalar loop otherwise. Define NFL_SCALAR_SEARCH to force
+// the scalar kernels.
+
+// The position of the first of the `size` keys that equals `key` (exactly for
+// integer keys, with the epsilon of `compare` for floating keys), or `N` if 
+// there is none. `keys` must have `N` readable slots, the slots from `size` 
+// on are ignored.
+template<typename KT, uint32_t N>
+struct FixedKeySearch {
+  static inline uint32_t find(const KT* keys, uint32_t size, KT key) {
+    uint32_t mask = 0;
+#pragma GCC unroll 16
+    for (uint32_t i = 0; i < N; ++ i) {
+      mask |= static_cast<uint32_t>(compare(keys[i], key)) << i;
+    }
+    mask &= (1u << size) - 1;
+    return mask == 0 ? N : __builtin_ctz(mask);
+  }
+};
+
+#if !defined(NFL_SCALAR_SEARCH) && defined(__AVX512F__)
+template<uint32_t N>
+struct FixedKeySearch<double, N> {
+  static_assert(N <= 8, "The AVX-512 kernel compares at most 8 keys");
+
+  static inline uint32_t find(const double* keys, uint32_t size, double key) {
+    __mmask8 valid = static_cast<__mmask8>(((1u << N) - 1)
+                                            & ((1u << size) - 1));
+    __m512d diff = _mm512_sub_pd(_mm512_maskz_loadu_pd(valid, keys),
+                                  _mm512_set1_pd(key));
+    __mmask8 mask = _mm512_mask_cmp_pd_mask(valid, _mm512_abs_pd(diff),
+                      _mm512_set1_pd(std::numeric_limits<double>::epsilon()),
+                      _CMP_LT_OQ);
+    return mask == 0 ? N : __builtin_ctz(mask);
+  }
+};
+
+// Integer keys are compared exactly
+template<typename KT, uint32_t N>
+struct FixedKeySearch64 {
+  static_assert(N <= 8, "The AVX-512 kernel compares at most 8 keys");
+
+  static inline uint32_t find(const KT* keys, uint32_t size, KT key) {
+    __mmask8 valid = static_cast<__mmask8>(((1u << N) - 1)
+                                            & ((1u << size) - 1));
+    __mmask8 mask = _mm512_mask_cmpeq_epi64_mask(valid, 
+                      _mm512_maskz_loadu_epi64(valid, keys), 
+                      _mm512_set1_epi64(static_cast<int64_t>(key)));
+    return mask == 0 ? N : __builtin_ctz(mask);
+  }
+};
+
+template<typename KT, uint32_t N>
+struct FixedKeySearch32 {
+  static_assert(N <= 16, "The AVX-512 kernel compares at most 16 keys");
+
+  static inline uint32_t find(const KT* keys, uint32_t size, KT key) {
+    __mmask16 valid = static_cast<__mmask16>(((1u << N) - 1)
+                                              & ((1u << size) - 1));
+    __mmask16 mask = _mm512_mask_cmpeq_epi32_mask(valid, 
+                      _mm512_maskz_loadu_epi32(valid, keys), 
+                      _mm512_set1_epi32(static_cast<int32_t>(key)));
+    return mask == 0 ? N : __builtin_ctz(mask);
+  }
+};
+#elif !defined(NFL_SCALAR_SEARCH) && defined(__AVX2__)
+template<uint32_t N>
+struct FixedKeySearch<double, N> {
+  static inline uint32_t find(const double* keys, uint32_t size, double key) {
+    const __m256d target = _mm256_set1_pd(key);
+    const __m256d eps = _mm256_set1_pd(std::numeric_limits<double>::epsilon());
+    const __m256d abs_mask = _mm256_castsi256_pd(
+                              _mm256_set1_epi64x(0x7fffffffffffffffLL));
+    uint32_t mask = 0;
+#pragma GCC unroll 4
+    for (uint32_t i = 0; i < N; i += 4) {
+      __m256d k;
+      if (i + 4 <= N) {
+        k = _mm256_loadu_pd(keys + i);
+      } else {
+        // Do not read past the `N` slots
+        const __m256i tail = _mm256_cmpgt_epi64(
+                              _mm256_set1_epi64x(N - i),
+                              _mm256_set_epi64x(3, 2, 1, 0));
+        k = _mm256_maskload_pd(keys + i, tail);
+      }
+      __m256d diff = _mm256_and_pd(_mm256_sub_pd(k, target), abs_mask);
+      mask |= static_cast<uint32_t>(_mm256_movemask_pd(
+                _mm256_cmp_pd(diff, eps, _CMP_LT_OQ))) << i;
+    }
+    mask &= ((1u << N) - 1) & ((1u << size) - 1);
+    return mask == 0 ? N : __builtin_ctz(mask);
+  }
+};
+
+// Integer keys are compared exactly
+template<typename KT, uint32_t N>
+struct FixedKeySearch64 {
+  static inline uint32_t find(const KT* keys, uint32_t size, KT key) {
+    const __m256i target = _mm256_set1_epi64x(static_cast<int64_t>(key));
+    const long long* base = reinterpret_cast<const long long*>(keys);
+    uint32_t mask = 0;
+#pragma GCC unroll 4
+    for (uint32_t i = 0; i < N; i += 4) {
+      __m256i k;
+      if (i + 4 <= N) {
+        k = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(base + i));
+      } else {
+        // Do not read past the `N` slots
+        const __m256i tail = _mm256_cmpgt_epi64(
+                              _mm256_set1_epi64x(N - i),
+                              _mm256_set_epi64x(3, 2, 1, 0));
+        k = _mm256_maskload_epi64(base + i, tail);
+      }
+      mask |= static_cast<uint32_t>(_mm256_movemask_pd(_mm256_castsi256_pd(
+                _mm256_cmpeq_epi64(k, target)))) << i;
+    }
+    mask &= ((1u << N) - 1) & ((1u << size) - 1);
+    return mask == 0 ? N : __builtin_ctz(mask);
+  }
+};
+
+template<typename KT, uint32_t N>
+struct FixedKeySearch32 {
+  static_assert(N <= 8, "The AVX2 kernel compares at most 8 keys");
+
+  static inline uint32_t find(const KT* keys, uint32_t size, KT key) {
+    const __m256i tail = _mm256_cmpgt_epi32(_mm256_set1_epi32(N),
+                          _mm256_set_epi32(7, 6, 5, 4, 3, 2, 1, 0));
+    __m256i k = _mm256_maskload_epi32(reinterpret_cast<const int*>(keys), 
+                                      tail);
+    uint32_t mask = _mm256_movemask_ps(_mm256_castsi256_ps(
+                      _mm256_cmpeq_epi32(k, 
+                        _mm256_set1_epi32(static_cast<int32_t>(key)))));
+    mask &= ((1u << N) - 1) & ((1u << size) - 1);
+    return mask == 0 ? N : __builtin_ctz(mask);
+  }
+};
+#endif
+
+#if !defined(NFL_SCALAR_SEARCH) && (defined(__AVX2__) || defined(__AVX512F__))
+template<uint32_t N>
+struct FixedKeySearch<uint64_t, N> : FixedKeySearch64<uint64_t, N> { };
+
+template<uint32_t N>
+struct FixedKeySearch<int64_t, N> : FixedKeySearch64<int64_t, N> { };
+
+template<uint32_t N>
+struct FixedKeySearch<uint32_t, N> : FixedKeySearch32<uint32_t, N> { };
+
+template<uint32_t N>
+struct FixedKeySearch<int32_t, N> : FixedKeySearch32<int32_t, N> { };
+#endif
+
+// The position of the first of the `size` sorted keys that is not less than
+// `key`. The loop has no data-dependent branch, the halving step compiles to a
+// conditional move.
+template<typename KT>
+inline uint32_t branchless_lower_bound(const KT* keys, uint32_t size, KT key) {
+  if (size == 0) {
+    return 0;
+  }
+  const KT* base = keys;
+  while (size > 1) {
+    uint32_t half = size / 2;
+    base = base[half] < key ? base + half : base;
+    size -= half;
+  }
+  return (base - keys) + (*base < key);
+}
+
+}
+
+#endif
@@ -0,0 +1,245 @@
+#ifndef MEMORY_POOL_H
+#define MEMORY_POOL_H
+
+#include <atomic>
+#include <immintrin.h>
+#include <sys/mman.h>
+#include <type_traits>
+#include <unordered_map>
+
+#include "util/common.h"
+
+namespace nfl {
+
+// Memory pool of an index. Small objects (buckets, models, node headers) are
+// served from size-class slabs, medium arrays are bump-allocated from large
+// chunks, and large arrays are mapped on their own. The chunks and the large
+// arrays can optionally be backed by transparent huge pages. Freed memory is
+// kept in per-size free lists for reuse. All memory is returned to the system
+// at once when the pool is destroyed, so an index allocated from a pool never
+// walks its nodes on destruction. Allocations are serialized by a spin lock, 
+// so that the tasks of a parallel bulk load can share the pool.
+class MemoryPool {
+private:
+  struct FreeBlock {
+    FreeBlock* next_;
+  };
+
+  class SpinGuard {
+  private:
+    std::atomic_flag& flag_;
+
+  public:
+    explicit SpinGuard(std::atomic_flag& flag) : flag_(flag) {
+      while (flag_.test_and_set(std::memory_order_acquire)) {
+        _mm_pause();
+      }
+    }
+
+    ~SpinGuard() {
+      flag_.clear(std::memory_order_release);
+    }
+  };
+
+  static constexpr size_t kAlignment = 16;
+  static constexpr size_t kMaxSlabSize = 256;           // Largest size class
+  static constexpr size_t kNumSizeClasses = kMaxSlabSize / kAlignment;
+  static constexpr size_t kChunkSize = 4 << 20;
+  static constexpr size_t kLargeSize = kChunkSize / 4;  // Mapped on their own
+  static constexpr size_t kPageSize = 4 << 10;
+  static constexpr size_t kHugePageSize = 2 << 20;
+
+  bool                                  huge_pages_;
+  char*                                 cursor_;        // Bump pointer in the
+  char*                                 chunk_end_;     // current chunk
+  std::vector<std::pair<void*, size_t>> chunks_;
+  FreeBlock*                            slabs_[kNumSizeClasses];
+  std::unordered_map<size_t, FreeBlock*>  free_lists_;  // Medium free blocks
+  std::unordered_map<void*, size_t>       large_blocks_;
+  uint64_t                              allocated_size_;
+  std::atomic_flag                      lock_ = ATOMIC_FLAG_INIT;
+
+public:
+  explicit MemoryPool(bool huge_pages=false)
+    : huge_pages_(huge_pages), cursor_(nullptr), chunk_end_(nullptr),
+      allocated_size_(0) {
+    std::fill(slabs_, slabs_ + kNumSizeClasses, nullptr);
+  }
+
+  ~MemoryPool() {
+    for (auto& chunk : chunks_) {
+      munmap(chunk.first, chunk.second);
+    }
+    for (auto& block : large_blocks_) {
+      munmap(block.first, block.second);
+    }
+  }
+
+  MemoryPool(const MemoryPool&) = delete;
+
+  MemoryPool& operator=(const MemoryPool&) = delete;
+
+  // The bytes mapped from the system
+  uint64_t allocated_size() const { return allocated_size_; }
+
+  // With `zeroed`, the memory is zero-filled. Memory fresh from the system is
+  // already zero, so only reused blocks are cleared and the pages that are 
+  // never written are never touched.
+  void* allocate(size_t bytes, bool zeroed=false) {
+    SpinGuard guard(lock_);
+    bytes = round_up(std::max(bytes, sizeof(FreeBlock)));
+    if (bytes <= kMaxSlabSize) {
+      FreeBlock*& slab = slabs_[bytes / kAlignment - 1];
+      if (slab != nullptr) {
+        FreeBlock* block = slab;
+        slab = block->next_;
+        return zeroed ? memset(block, 0, bytes) : block;
+      }
+      return bump(bytes);
+    } else if (bytes <= kLargeSize) {
+      auto it = free_lists_.find(bytes);
+      if (it != free_lists_.end() && it->second != nullptr) {
+        FreeBlock* block = it->second;
+        it->second = block->next_;
+        return zeroed ? memset(block, 0, bytes) : block;
+      }
+      return bump(bytes);
+    } else {
+      size_t mapped_size = round_up(bytes, huge_pages_ ? kHugePageSize 
+                                                        : kPageSize);
+      void* ptr = map(mapped_size);
+      large_blocks_[ptr] = mapped_size;
+      return ptr;
+    }
+  }
+
+  void deallocate(void* ptr, size_t bytes) {
+    if (ptr == nullptr) {
+      return;
+    }
+    SpinGuard guard(lock_);
+    bytes = round_up(std::max(bytes, sizeof(FreeBlock)));
+    FreeBlock* block = static_cast<FreeBlock*>(ptr);
+    if (bytes <= kMaxSlabSize) {
+      FreeBlock*& slab = slabs_[bytes / kAlignment - 1];
+      block->next_ = slab;
+      slab = block;
+    } else if (bytes <= kLargeSize) {
+      FreeBlock*& head = free_lists_[bytes];
+      block->next_ = head;
+      head = block;
+    } else {
+      auto it = large_blocks_.find(ptr);
+      assert_p(it != large_blocks_.end(), "Unknown block in the memory pool");
+      munmap(it->first, it->second);
+      allocated_size_ -= it->second;
+      large_blocks_.erase(it);
+    }
+  }
+
+  template<typename T, typename... Args>
+  T* create(Args&&... args) {
+    return new (allocate(sizeof(T))) T(std::forward<Args>(args)...);
+  }
+
+  template<typename T>
+  void destroy(T* ptr) {
+    if (ptr != nullptr) {
+      ptr->~T();
+      deallocate(ptr, sizeof(T));
+    }
+  }
+
+  // Arrays are not initialized unless `zeroed` is set
+  template<typename T>
+  T* allocate_array(size_t n, bool zeroed=false) {
+    static_assert(std::is_trivially_destructible<T>::value,
+                  "Pool arrays must be trivially destructible");
+    return static_cast<T*>(allocate(sizeof(T) * n, zeroed));
+  }
+
+  template<typename T>
+  void deallocate_array(T* ptr, size_t n) {
+    deallocate(ptr, sizeof(T) * n);
+  }
+
+private:
+  static size_t round_up(size_t bytes, size_t alignment=kAlignment) {
+    return (bytes + alignment - 1) / alignment * alignment;
+  }
+
+  void* bump(size_t bytes) {
+    if (static_cast<size_t>(chunk_end_ - cursor_) < bytes) {
+      cursor_ = static_cast<char*>(map(kChunkSize));
+      chunk_end_ = cursor_ + kChunkSize;
+      chunks_.push_back({cursor_, kChunkSize});
+    }
+    void* ptr = cursor_;
+    cursor_ += bytes;
+    return ptr;
+  }
+
+  void* map(size_t bytes) {
+    // Over-map by a huge page so that the block can be aligned to it
+    size_t mapped_size = huge_pages_ ? bytes + kHugePageSize : bytes;
+    char* ptr = static_cast<char*>(mmap(nullptr, mapped_size, 
+                                        PROT_READ | PROT_WRITE,
+                                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+    assert_p(ptr != MAP_FAILED, "Failed to map memory for the memory pool");
+    if (huge_pages_) {
+      char* aligned = reinterpret_cast<char*>(round_up(
+                        reinterpret_cast<size_t>(ptr), kHugePageSize));
+      if (aligned > ptr) {
+        munmap(ptr, aligned - ptr);
+      }
+      if (aligned + bytes < ptr + mapped_size) {
+        munmap(aligned + bytes, ptr + mapped_size - aligned - bytes);
+      }
+      ptr = aligned;
+#ifdef MADV_HUGEPAGE
+      madvise(ptr, bytes, MADV_HUGEPAGE);
+#endif
+    }
+    allocated_size_ += bytes;
+    return ptr;
+  }
+};
+
+// Allocation helpers that fall back to the heap if no pool is given
+template<typename T, typename... Args>
+T* pool_new(MemoryPool* pool, Args&&... args) {
+  if (pool != nullptr) {
+    return pool->create<T>(std::forward<Args>(args)...);
+  }
+  return new T(std::forward<Args>(args)...);
+}
+
+template<typename T>
+void pool_delete(MemoryPool* pool, T* ptr) {
+  if (pool != nullptr) {
+    pool->destroy(ptr);
+  } else {
+    delete ptr;
+  }
+}
+
+template<typename T>
+T* pool_new_array(MemoryPool* pool, size_t n) {
+  if (pool != nullptr) {
+    return pool->allocate_array<T>(n);
+  }
+  return new T[n];
+}
+
+template<typename T>
+void pool_delete_array(MemoryPool* pool, T* ptr, size_t n) {
+  if (pool != nullptr) {
+    pool->deallocate_array(ptr, n);
+  } else {
+    delete[] ptr;
+  }
+}
+
+}
+
+#endif
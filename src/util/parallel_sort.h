@@ -0,0 +1,48 @@
+#ifndef PARALLEL_SORT_H
+#define PARALLEL_SORT_H
+
+#include "util/common.h"
+
+namespace nfl {
+
+// The elements that a thread sorts at once. The runs of the chunks are
+// merged in order, so the result does not depend on the number of threads.
+const uint32_t kSortChunkSize = 1 << 16;
+
+// Sort `data` by `less` with the threads of OpenMP: the chunks are sorted
+// and then merged pairwise in rounds of runs that double in size. The input
+// is often nearly sorted, e.g. keys transformed by a monotone flow, so the
+// sorted chunks are left as they are, and a merge only moves the elements of
+// the two runs that overlap.
+template<typename T, typename Compare>
+void parallel_sort(T* data, uint32_t size, Compare less) {
+  uint32_t num_chunks = (size + kSortChunkSize - 1) / kSortChunkSize;
+#pragma omp parallel for schedule(dynamic, 1) if(num_chunks > 1)
+  for (uint32_t c = 0; c < num_chunks; ++ c) {
+    T* lo = data + c * kSortChunkSize;
+    T* hi = data + std::min<uint64_t>(size, (c + 1ULL) * kSortChunkSize);
+    if (!std::is_sorted(lo, hi, less)) {
+      std::sort(lo, hi, less);
+    }
+  }
+  for (uint64_t run = kSortChunkSize; run < size; run *= 2) {
+    uint32_t num_pairs = (size + 2 * run - 1) / (2 * run);
+#pragma omp parallel for schedule(dynamic, 1) if(num_pairs > 1)
+    for (uint32_t p = 0; p < num_pairs; ++ p) {
+      T* lo = data + p * 2 * run;
+      T* mid = data + std::min<uint64_t>(size, p * 2 * run + run);
+      T* hi = data + std::min<uint64_t>(size, (p + 1) * 2 * run);
+      if (mid == hi || !less(*mid, *(mid - 1))) {
+        continue;
+      }
+      // Only [first, mid) and [mid, last) interleave
+      T* first = std::upper_bound(lo, mid, *mid, less);
+      T* last = std::lower_bound(mid, hi, *(mid - 1), less);
+      std::inplace_merge(first, mid, last, less);
+    }
+  }
+}
+
+}
+
+#endif
@@ -0,0 +1,74 @@
+#ifndef VERSION_LOCK_H
+#define VERSION_LOCK_H
+
+#include <atomic>
+#include <immintrin.h>
+
+#include "util/common.h"
+
+namespace nfl {
+
+// Optimistic lock with a version counter. Readers record the version before
+// reading and check it afterwards instead of taking the lock. Writers take the
+// lock by a CAS on the version they read, and bump the version on unlocking.
+//
+// Bit 0 marks a node that has been replaced and will be reclaimed, bit 1 is the
+// lock bit, and the remaining bits are the version.
+class VersionLock {
+private:
+  std::atomic<uint64_t> version_;
+
+  static constexpr uint64_t kObsoleteBit = 1;
+  static constexpr uint64_t kLockedBit = 2;
+
+public:
+  VersionLock() : version_(0) { }
+
+  // Wait until the lock is released and return the version. Set `restart` if
+  // the protected object is obsolete.
+  uint64_t read_lock(bool& restart) const {
+    uint64_t version = version_.load(std::memory_order_acquire);
+    while (version & kLockedBit) {
+      _mm_pause();
+      version = version_.load(std::memory_order_acquire);
+    }
+    if (version & kObsoleteBit) {
+      restart = true;
+    }
+    return version;
+  }
+
+  // Check whether the object is unchanged since `version` was read.
+  bool validate(uint64_t version) const {
+    std::atomic_thread_fence(std::memory_order_acquire);
+    return version_.load(std::memory_order_relaxed) == version;
+  }
+
+  // Take the lock if the object is unchanged since `version` was read.
+  bool upgrade(uint64_t version) {
+    return version_.compare_exchange_strong(version, version + kLockedBit,
+                                            std::memory_order_acquire);
+  }
+
+  void write_lock() {
+    while (true) {
+      bool restart = false;
+      uint64_t version = read_lock(restart);
+      if (upgrade(version)) {
+        return;
+      }
+    }
+  }
+
+  void write_unlock() {
+    version_.fetch_add(kLockedBit, std::memory_order_release);
+  }
+
+  void write_unlock_obsolete() {
+    version_.fetch_add(kLockedBit | kObsoleteBit, std::memory_order_release);
+  }
+};
+
+}
+
+#endif